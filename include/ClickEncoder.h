@@ -8,6 +8,8 @@
 // Timer-based rotary encoder logic by Peter Dannegger
 // http://www.mikrocontroller.net/articles/Drehgeber
 // Modified by Technik Gegg - added resetButton() method
+// Modified by Technik Gegg - service() queues timestamped events, which replace
+//                            getValue() / getButton()
 // ----------------------------------------------------------------------------
 
 #ifndef __have__ClickEncoder_h__
@@ -34,6 +36,10 @@
 #  define ENC_DECODER     ENC_NORMAL
 #endif
 
+#ifndef ENC_EVENT_QUEUE_LEN
+#  define ENC_EVENT_QUEUE_LEN  16     // must be a power of 2 (max. 128)
+#endif
+
 #if ENC_DECODER == ENC_FLAKY
 #  ifndef ENC_HALFSTEP
 #    define ENC_HALFSTEP  1        // use table for half step per default
@@ -58,17 +64,25 @@ public:
 
   } Button;
 
+  // an event is either a turn (button = Open) or a change of the button state
+  typedef struct Event_s {
+    uint8_t       button;         // Button
+    int8_t        turn;           // notches turned, including acceleration
+    unsigned long time;           // millis() at the time the event occurred
+  } Event;
+
 public:
   ClickEncoder(uint8_t A, uint8_t B, uint8_t BTN = -1,
                uint8_t stepsPerNotch = 1, bool active = LOW);
 
   void service(void);
-  int16_t getValue(void);
+  bool getEvent(Event* ev);
+  void flushEvents(void) { eventTail = eventHead; }
+  uint8_t getEventsLost(void) { return eventsLost; }
 
 #ifndef WITHOUT_BUTTON
 public:
-  Button getButton(void);
-  void resetButton(void) { button = Open; lastButtonCheck = millis(); doubleClickTicks = 0; }
+  bool isButtonDown(void) { return buttonDown; }
 #endif
 
 #ifndef WITHOUT_BUTTON
@@ -109,12 +123,21 @@ private:
   bool  accelerationEnabled = false;
   uint8_t steps = 0;
 
+  // single producer (service) / single consumer (getEvent) queue, 
+  // eventHead is written by the producer only, eventTail by the consumer only
+  Event events[ENC_EVENT_QUEUE_LEN];
+  volatile uint8_t eventHead = 0;
+  volatile uint8_t eventTail = 0;
+  volatile uint8_t eventsLost = 0;
+  bool pushEvent(uint8_t button, int8_t turn, unsigned long now);
+
 #ifndef WITHOUT_BUTTON
-  volatile Button button = Open;
+  Button button = Open;
   unsigned long lastButtonCheck = 0;
   uint8_t doubleClickTicks = 0;     
   bool doubleClickEnabled = false;  
   uint16_t keyDownTicks = 0;    
+  volatile bool buttonDown = false;
 #endif
 
 #if ENC_DECODER != ENC_NORMAL
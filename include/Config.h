@@ -26,7 +26,32 @@
 #define PMMU_BUILD        372               // Build number for Prusa MMU2 Emulation mode
 #define VERSION_DATE      "2019-12-29"
 #define CONFIG_FILE       "SMUFF.CFG"
-#define DATASTORE_FILE    "EEPROM.DAT"
+#define DATASTORE_FILE    "EEPROM.DAT"      // former JSON data store, migrated into the journal
+#define CONFIG_CACHE_FILE "SMUFF.BIN"       // binary snapshot of the configuration read from CONFIG_FILE
+#define JOURNAL_FILE      "EEPROM.JNL"
+#define PROFILE_FOLDER    "/PROFILES"       // config profiles (<name>.CFG), overlays of CONFIG_FILE
+#define PROFILE_EXT       ".CFG"
+#define MACRO_FOLDER      "/MACROS"         // G-code macros (<name>.gcode), run by M98 and on events
+#define MACRO_EXT         ".gcode"
+#define JOURNAL_RECORDS   256               // number of records in the journal (32 bytes each)
+#define STORE_FLUSH_DELAY 2000              // ms without updates before the data store gets written
+#define STORE_FLUSH_MAX   10000             // ms after which an update gets written even if the unit is busy
+#define STORE_RETRY_MAX   300000            // max. ms between retries after a failed write (doubled on each failure)
+
+// The data store journal is kept in on-chip memory unless STORE_ON_SD is defined
+#if !defined(STORE_ON_SD)
+#if defined(__AVR__)
+#define STORE_IN_EEPROM
+#define STORE_EEPROM_OFFSET     0           // start of the journal in EEPROM
+#define STORE_EEPROM_RECORDS    64          // number of records (2 KB of the 4 KB EEPROM)
+#elif defined(__STM32F1__)
+#define STORE_IN_FLASH
+#define STORE_FLASH_BASE        0x0803F000  // last two pages of the 256 KB flash of the STM32F103RC (kept free by board_upload.maximum_size)
+#define STORE_FLASH_END         0x08040000  // end of the flash
+#define STORE_FLASH_PAGE_SIZE   2048
+#define STORE_FLASH_PAGES       2
+#endif
+#endif
 
 #define NUM_STEPPERS      3
 #define SELECTOR          0
@@ -44,6 +69,21 @@
 #define DSP_CONTRAST        200
 #define MIN_CONTRAST        60
 #define MAX_CONTRAST        250
+#ifdef __STM32F1__
+#define DSP_REFRESH_IDLE    250           // display refresh interval (ms) while steppers are idle
+#else
+#define DSP_REFRESH_IDLE    500
+#endif
+#define DSP_REFRESH_MOVING  250           // display refresh interval (ms) while steppers are moving (STM32 only)
+#define DSP_REFRESH_SLOW    1000          // display refresh interval (ms) while the stepper interrupt load is high
+#define GOVERNOR_LOAD_SLOW    300         // stepper interrupt load (per mille) above which the refresh gets slowed down
+#define GOVERNOR_LOAD_SUSPEND 600         // stepper interrupt load (per mille) above which the refresh gets suspended
+#define GOVERNOR_RATE_SUSPEND 12000       // step rate (steps/s) above which the refresh gets suspended
+#define DSP_BUFFER_SIZE     (128*64/8)    // size of the display frame buffer
+#ifdef __AVR__
+#define DSP_PAGE_MODE                     // draw in pages of 2 tile rows (256 bytes) instead of using a full frame buffer
+#endif
+#define DSP_DMA_MIN_LEN     16            // min. number of bytes to be sent to the display via DMA
 
 #define I2C_SLAVE_ADDRESS   0x88
 
@@ -56,7 +96,35 @@
 #define USER_MESSAGE_RESET      15    // value in seconds
 #define MAX_LINES               5
 #define MAX_LINE_LENGTH         80
+#define MAX_MENU_ITEMS          16    // max. number of items in a menu table
+#define MENU_STACK_DEPTH        5     // max. nesting level of menus
+#define DLG_LINE_LEN            32    // max. length of a line in messages and dialogs (wrapped to the display width)
+#ifdef __STM32F1__
+#define TX_BUFFER_LEN           256   // transmit buffer per serial port (power of 2, max. 256)
+#else
+#define TX_BUFFER_LEN           128   // transmit buffer per serial port (power of 2, max. 256)
+#endif
+#ifdef __STM32F1__
+#define RX_BUFFER_LEN           128   // receive buffer for the ports read by the timer interrupt (power of 2, max. 256)
+#else
+#define RX_BUFFER_LEN           128   // receive buffer for the ports read by the timer interrupt (power of 2, max. 256)
+#endif
+#define BAUDRATE_SWITCH_DELAY   20    // ms to wait after the last response was sent before the baudrate gets switched
+#define LINE_HISTORY_LEN        8     // number of already processed line numbers a re-sent duplicate is accepted for
+#define HOST_SERIAL             0     // default of HostSerial, the port host prompts and notifications are sent to (HEADLESS only)
 #define POWER_SAVE_TIMEOUT      15    // value in seconds
+#ifdef __STM32F1__
+#define MACRO_CACHE_SIZE        1024  // bytes of compiled macros kept in RAM
+#define MACRO_CACHE_ENTRIES     12    // max. number of macros (incl. the ones not found) kept in the cache
+#else
+#define MACRO_CACHE_SIZE        160   // bytes of compiled macros kept in RAM
+#define MACRO_CACHE_ENTRIES     4     // max. number of macros (incl. the ones not found) kept in the cache
+#endif
+#ifdef __STM32F1__
+#define STARTUP_DELAY           1000  // ms to wait on startup (gives the USB serial port time to enumerate)
+#else
+#define STARTUP_DELAY           100   // ms to wait on startup
+#endif
 // Does not work yet due to some compile failures in the FastLED library for STM32
 #define NUM_LEDS                1     // number of Neopixel LEDS
 #define BRIGHTNESS              64
@@ -0,0 +1,98 @@
+/**
+ * SMuFF Firmware
+ * Copyright (C) 2019 Technik Gegg
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#ifndef _CONFIG_SCHEMA_H
+#define _CONFIG_SCHEMA_H 1
+
+#include <Arduino.h>
+
+#define CFG_KEY_LEN       20        // max. length of a key (incl. terminator)
+#define CFG_VALUE_LEN     81        // max. length of a value (incl. terminator)
+
+typedef enum {
+  CFG_SEC_TOP,                      // keys on the top level of the config file
+  CFG_SEC_SELECTOR,
+  CFG_SEC_REVOLVER,
+  CFG_SEC_FEEDER,
+  CFG_SEC_MATERIALS,
+  CFG_SECTIONS
+} ConfigSection;
+
+typedef enum {
+  CFG_INT,
+  CFG_UINT,
+  CFG_LONG,
+  CFG_ULONG,
+  CFG_FLOAT,
+  CFG_BOOL,
+  CFG_STRING,                       // char array, max = size of the array
+  CFG_MATERIAL                      // keys T0..Tn (or Tool0..Tooln), max = size of one entry
+} ConfigValueType;
+
+typedef enum {
+  CFG_OK,
+  CFG_RANGE,                        // value was out of range, the default has been set
+  CFG_INVALID                       // value couldn't be converted, nothing has been set
+} ConfigResult;
+
+/*
+  Hash of a key (FNV-1a folded to 16 bit). Being constexpr, the
+  hashes of the schema get computed by the compiler.
+*/
+constexpr uint32_t configHash32(const char* key, uint32_t hash) {
+  return *key ? configHash32(key+1, (hash ^ (uint8_t)*key) * 16777619UL) : hash;
+}
+constexpr uint16_t configHashFold(uint32_t hash) {
+  return (uint16_t)(hash >> 16) ^ (uint16_t)hash;
+}
+constexpr uint16_t configHash(const char* key) {
+  return configHashFold(configHash32(key, 2166136261UL));
+}
+
+/*
+  Description of a config key, the schema is a table of these stored in flash.
+  Values out of the range min..max get replaced by the default value def.
+  The schema is also the registry of the settings which can be changed
+  at runtime (M205), named "Section.Key" or just "Key" on the top level.
+*/
+typedef struct {
+  uint8_t   section;                // ConfigSection
+  uint8_t   type;                   // ConfigValueType
+  uint16_t  hash;                   // configHash() of key
+  char      key[CFG_KEY_LEN];
+  void*     value;                  // field in smuffConfig
+  float     min;
+  float     max;
+  float     def;
+} ConfigKey;
+
+extern const ConfigKey  configKeys[];
+extern const uint8_t    configKeyCount;
+
+extern int8_t   findConfigSection(const char* name);
+extern void     getConfigSectionName(uint8_t section, char* name);
+extern int      findConfigKey(uint8_t section, const char* key);
+extern int      findSetting(const char* name, const char** key);
+extern uint8_t  setConfigValue(uint8_t index, const char* key, const char* value, bool useDefault = true);
+extern void     printConfigValue(Print* out, uint8_t index, uint8_t item);
+extern void     printSettings(Print* out, int index = -1);
+extern bool     isConfigChanged(const SMuFFConfig* prev);
+
+#endif
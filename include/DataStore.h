@@ -26,8 +26,39 @@ typedef struct {
     byte tool;
 } DataStore;
 
+#define JOURNAL_MAGIC   0xA5
+
+/*
+  Record of the data store journal (32 bytes, so a record never
+  spans two sectors). The valid record with the highest sequence 
+  number holds the current state.
+*/
+typedef struct {
+    uint32_t  seq;
+    int32_t   stepperPos[3];
+    uint8_t   magic;
+    uint8_t   tool;
+    int8_t    swapTools[MAX_TOOLS];
+    uint8_t   reserved[12-MAX_TOOLS];
+    uint16_t  crc;                  // CRC16 of all the bytes before
+} JournalRecord;
+
 extern DataStore      dataStore;
 
+typedef struct {
+    unsigned long updates;          // calls of saveStore()
+    unsigned long flushes;          // records written
+    unsigned long unchanged;        // flushes skipped because nothing has changed
+    unsigned long failed;           // flushes failed
+    unsigned long lastFlush;        // us the last flush took
+    unsigned long maxFlush;         // us the longest flush took
+} StoreStatistics;
+
 void saveStore();
+void flushStore();
+void serviceStore();
 void recoverStore();
+void releaseStore();
+void printStoreStatistics(int serial);
+void resetStoreStatistics();
 #endif
\ No newline at end of file
@@ -29,6 +29,7 @@ typedef struct {
 } GCodeFunctions;
 
 extern unsigned int currentLine;
+extern long lastLineNumber[];
 
 extern bool dummy(const char* msg, String buf, int serial);
 extern bool M18(const char* msg, String buf, int serial);
@@ -43,6 +44,7 @@ extern bool M114(const char* msg, String buf, int serial);
 extern bool M115(const char* msg, String buf, int serial);
 extern bool M117(const char* msg, String buf, int serial);
 extern bool M119(const char* msg, String buf, int serial);
+extern bool M155(const char* msg, String buf, int serial);
 extern bool M201(const char* msg, String buf, int serial);
 extern bool M203(const char* msg, String buf, int serial);
 extern bool M205(const char* msg, String buf, int serial);
@@ -51,13 +53,20 @@ extern bool M250(const char* msg, String buf, int serial);
 extern bool M280(const char* msg, String buf, int serial);
 extern bool M300(const char* msg, String buf, int serial);
 extern bool M500(const char* msg, String buf, int serial);
+extern bool M501(const char* msg, String buf, int serial);
 extern bool M503(const char* msg, String buf, int serial);
 extern bool M575(const char* msg, String buf, int serial);
 extern bool M700(const char* msg, String buf, int serial);
 extern bool M701(const char* msg, String buf, int serial);
+extern bool M876(const char* msg, String buf, int serial);
 extern bool M999(const char* msg, String buf, int serial);
 extern bool M2000(const char* msg, String buf, int serial);
 extern bool M2001(const char* msg, String buf, int serial);
+extern bool M2002(const char* msg, String buf, int serial);
+extern bool M2003(const char* msg, String buf, int serial);
+extern bool M2004(const char* msg, String buf, int serial);
+extern bool M2005(const char* msg, String buf, int serial);
+extern bool M2006(const char* msg, String buf, int serial);
 
 extern bool G0(const char* msg, String buf, int serial);
 extern bool G1(const char* msg, String buf, int serial);
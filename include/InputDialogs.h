@@ -22,15 +22,29 @@
 #define _INPUT_DIALOGS_H 1
 
 #include "SMuFF.h"
-typedef void(*iCallback)(int val);
-typedef void(*fCallback)(float val);
-typedef void(*bCallback)(bool val);
+typedef enum {
+  INPUT_PENDING,
+  INPUT_OK,
+  INPUT_CANCELED
+} InputResult;
+
+/*
+  State of a (non-blocking) input dialog, see beginInput() / serviceInput().
+*/
+typedef struct {
+  char        title[MENU_LABEL_LEN];
+  const char* prompt;               // PROGMEM
+  uint8_t     type;                 // MenuValueType of the value edited
+  long        value;                // value edited (all types but MENU_FLOAT)
+  float       fValue;               // value edited (MENU_FLOAT)
+  long        min;
+  long        max;
+  uint8_t     option;               // index of the baudrate picked (MENU_BAUDRATE)
+  void        (*preview)(long val); // called whenever the value gets changed
+} InputDialog;
 
-void getEncoderButton(int* turn, int* button, bool* isHeld, bool* isClicked);
 void drawValue(const char* title, const char* PROGMEM message, String val);
-bool showInputDialog(const char* title, const char* PROGMEM message, float* val, float min, float max, fCallback cb = NULL);
-bool showInputDialog(const char* title, const char* PROGMEM message, int* val, int min, int max, iCallback cb = NULL);
-bool showInputDialog(const char* title, const char* PROGMEM message, bool* val, bCallback cb = NULL);
-bool showInputDialog(const char* title, const char* PROGMEM message, unsigned long* val, String list);
+void beginInput(InputDialog* dlg);
+uint8_t serviceInput(InputDialog* dlg, int turn, int button);
 
 #endif
\ No newline at end of file
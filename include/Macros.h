@@ -0,0 +1,43 @@
+/**
+ * SMuFF Firmware
+ * Copyright (C) 2019 Technik Gegg
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#ifndef _MACROS_H
+#define _MACROS_H
+
+#define MACRO_NAME_LEN      FILE_INDEX_NAME_LEN   // max. length of a macro name (incl. terminator), as listed by M98
+#define MACRO_MAX_DEPTH     3       // max. nesting of macros calling macros (M98)
+#define MACRO_PARAM         0x80    // placeholder {A}..{Z} in the compiled macro, ORed with the letter index
+
+/*
+  Parameters of a macro call (M98 P"name" A<value> ... Z<value>),
+  substituted for {A}..{Z} in the macro.
+*/
+typedef struct {
+  char      values[40];             // values given, each one terminated by 0
+  int8_t    pos[26];                // index of the value of each letter in values, -1 if not given
+} MacroParams;
+
+extern void   parseMacroParams(const char* text, MacroParams* params);
+extern bool   runMacro(const char* name, MacroParams* params, int serial);
+extern bool   macroExists(const char* name);
+extern void   runMacroHook(const char* name, int tool);
+extern void   clearMacros();
+extern void   printMacros(int serial);
+#endif
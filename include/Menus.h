@@ -21,20 +21,71 @@
 #ifndef _MENUS_H
 #define _MENUS_H 1
 
-extern void setupMainMenu(char* menu);
-extern void setupToolsMenu(char* menu);
-extern void setupOffsetMenu(char* menu);
-extern void setupSwapMenu(char* menu);
-extern void setupSettingsMenu(char* menu);
-extern void setupTestrunMenu(char* menu);
-
-extern void showMainMenu();
-extern void showToolsMenu();
-extern void showOffsetsMenu(char* menuTitle);
-extern void showSwapMenu(char* menuTitle);
-extern void showSettingsMenu(char* menuTitle);
-extern void showBaudratesMenu(char* menuTitle);
-extern void showTestrunMenu(char* menuTitle);
+#define MENU_LABEL_LEN    25
+#define MENU_VALUE_LEN    14
+
+typedef enum {
+  MENU_NONE,
+  MENU_SUBMENU,                     // opens the item's submenu
+  MENU_INT,
+  MENU_UINT,
+  MENU_LONG,
+  MENU_ULONG,
+  MENU_FLOAT,
+  MENU_YESNO,                       // bool shown as Yes / No
+  MENU_HILO,                        // int shown as HI / LO
+  MENU_BAUDRATE,                    // unsigned long picked from the list of baudrates
+  MENU_FUNC                         // value gets formatted by the item's format function
+} MenuValueType;
+
+typedef enum {
+  MENU_EV_SELECT,                   // an item without value or submenu got selected
+  MENU_EV_EDIT,                     // the value is about to be edited (uiInput may be adjusted)
+  MENU_EV_CHANGED,                  // the value has been changed
+  MENU_EV_CLOSE                     // the menu is being closed
+} MenuEvent;
+
+struct MenuDef;
+
+/*
+  Menu item description, the menus are tables of these stored in flash.
+*/
+typedef struct {
+  const char*     label;            // PROGMEM string, also used as the title of dialogs and submenus
+  uint8_t         id;               // identifies the item in the menu handler
+  uint8_t         type;             // MenuValueType of the value shown right aligned
+  void*           value;            // value shown and edited (MENU_INT ... MENU_BAUDRATE)
+  void            (*format)(char* buf); // formats the value shown (MENU_FUNC)
+  bool            (*isEnabled)();   // the item is hidden if this returns false (NULL = always shown)
+  const MenuDef*  submenu;          // menu opened (MENU_SUBMENU)
+  const char*     prompt;           // PROGMEM prompt of the input dialog, NULL if the value isn't editable
+  long            min;
+  long            max;
+} MenuItem;
+
+typedef void (*MenuLineFunc)(uint8_t index, char* label, char* value);
+
+/*
+  Menu description, either a table of items or a list, which
+  gets its lines from getLine(). The first line of a list is
+  always the BACK item.
+*/
+struct MenuDef {
+  const MenuItem* items;            // PROGMEM table, NULL for lists
+  uint8_t         count;            // number of items in the table
+  uint8_t         (*getCount)();    // number of lines in the list
+  MenuLineFunc    getLine;
+  void            (*handler)(uint8_t id, uint8_t event);  // item id for tables, line index for lists
+};
+
+#define MENU_COUNT(items)   (sizeof(items)/sizeof(MenuItem))
+
+extern void openMainMenu();
+extern void openToolsMenu();
+extern void openSettingsMenu();
+extern void uiTick();
+extern void uiClose();
+
 extern void changeOffset(int index);
 extern void drawOffsetPosition(int index);
 
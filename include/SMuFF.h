@@ -33,9 +33,14 @@
 #include <Wire.h>
 #include <SPI.h>
 #include <SdFs.h>
+#ifndef HEADLESS
 #include "U8g2lib.h"
+#endif
 #include "MemoryFree.h"
 #include "DataStore.h"
+#include "SdCard.h"
+#include "Macros.h"
+#include "SerialBuffers.h"
 //#include <FastLED.h>
 #ifdef __STM32F1__
 #include <wirish.h>
@@ -56,6 +61,55 @@ typedef enum {
   RELATIVE
 } PositionMode;
 
+/*
+  Values shown on the status screen (see updateStatusModel()).
+*/
+typedef struct {
+  int   tool;                   // -1 if no tool is selected
+  long  feed;                   // feeder position in 1/100 mm
+  bool  endstop;
+  bool  moving;                 // feeder is moving (the feed is shown instead of the endstop state)
+  bool  busy;
+  bool  pmmu;
+  char  trace[8];
+#ifdef __AVR__
+  int   mem;
+#endif
+} StatusModel;
+
+// display tile rows (8 pixel each) occupied by the status screen fields
+#define STATUS_ROWS_TOOL      0b00000111
+#define STATUS_ROWS_FEED      0b00011100
+#define STATUS_ROWS_BAR       0b11000000
+#define STATUS_ROWS_ALL       0b11111111
+
+typedef enum {
+  BOOT_START,                       // setup() entered
+  BOOT_DELAY,                       // STARTUP_DELAY passed
+  BOOT_DISPLAY,                     // serial port and display initialized
+  BOOT_CONFIG,                      // configuration loaded
+  BOOT_SERIAL,                      // serial ports set up
+  BOOT_STEPPERS,                    // steppers and timers set up
+  BOOT_SERVOS,                      // servos set up
+  BOOT_DATA,                        // data store recovered
+  BOOT_DONE,                        // revolver homed, setup() finished
+  BOOT_STAGES
+} BootStage;
+
+typedef enum {
+  CONFIG_NONE,                      // no config file, defaults are used
+  CONFIG_PARSED,                    // read from SMUFF.CFG
+  CONFIG_CACHED,                    // loaded from the snapshot SMUFF.BIN
+  CONFIG_FAILED                     // SMUFF.CFG is corrupted
+} ConfigSource;
+
+#define CFG_APPLY_STEPPERS    0x01  // subsystems changed by applyConfig()
+#define CFG_APPLY_SERVOS      0x02
+#define CFG_APPLY_FAN         0x04
+#define CFG_APPLY_DISPLAY     0x08
+#define CFG_APPLY_SERIAL      0x10
+#define CFG_APPLY_ANY         0x80  // any value changed at all
+
 typedef struct {
   int   toolCount           = 5;
   float firstToolOffset     = FIRST_TOOL_OFFSET;
@@ -69,7 +123,7 @@ typedef struct {
   bool  invertDir_X         = false;
   int   endstopTrigger_X    = HIGH;
   int   stepDelay_X         = 10;
-  unsigned maxSpeedHS_X     = 10;
+  unsigned maxSpeedHS_X     = 0;           // 0 = same as maxSpeed_X
   unsigned accelDistance_X  = 21;          
   
   long  stepsPerRevolution_Y= 9600;
@@ -80,7 +134,7 @@ typedef struct {
   bool  invertDir_Y         = false;
   int   endstopTrigger_Y    = HIGH;
   int   stepDelay_Y         = 10;
-  unsigned maxSpeedHS_Y     = 10;
+  unsigned maxSpeedHS_Y     = 0;           // 0 = same as maxSpeed_Y
   bool  wiggleRevolver      = false;
   bool  revolverIsServo     = false;
   int   revolverOffPos      = 0;
@@ -99,7 +153,7 @@ typedef struct {
   int   feedChunks          = 20;
   bool  enableChunks        = false;
   float insertLength        = 5.0;
-  unsigned maxSpeedHS_Z     = 10;          
+  unsigned maxSpeedHS_Z     = 0;           // 0 = same as maxSpeed_Z
   unsigned accelDistance_Z  = 5;          
     
   float unloadRetract       = -20.0f;
@@ -124,21 +178,30 @@ typedef struct {
   int   wipeSequence[20]    = { 150,20,45,20,45,20,45,20,45,20,45,20,45,20,45,20,45,20,110,-1 };
   bool  prusaMMU2           = true;
   bool  useDuetLaser        = false;
+  int   hostSerial          = HOST_SERIAL;
 } SMuFFConfig;
 
 
+#ifndef HEADLESS
 #ifdef __BRD_I3_MINI
-extern U8G2_ST7565_64128N_F_4W_HW_SPI       display;
+  #ifdef DSP_PAGE_MODE
+  extern U8G2_ST7565_64128N_2_4W_HW_SPI     display;
+  #else
+  extern U8G2_ST7565_64128N_F_4W_HW_SPI     display;
+  #endif
 #endif
 #ifdef __BRD_SKR_MINI
   #ifdef USE_TWI_DISPLAY
   extern U8G2_SSD1306_128X64_NONAME_F_HW_I2C  display;
   #else
-  extern U8G2_UC1701_MINI12864_1_2ND_4W_HW_SPI display;
+  extern U8G2_UC1701_MINI12864_F_2ND_4W_HW_SPI display;
   #endif
 #endif
 
 extern ClickEncoder   encoder;
+#else
+extern bool           hostPromptPending;
+#endif
 
 extern SMuFFConfig    smuffConfig;
 extern GCodeFunctions gCodeFuncsM[];
@@ -151,25 +214,59 @@ extern volatile unsigned long lastEncoderButtonTime;
 extern byte           toolSelected;
 extern PositionMode   positionMode;
 extern String         serialBuffer0, serialBuffer2, serialBuffer9, traceSerial2; 
+extern uint8_t        rxChecksum[];
 extern bool           displayingUserMessage;
 extern unsigned int   userMessageTime;
 extern bool           testMode;
 extern bool           feederJammed;
 extern volatile bool  parserBusy;
+extern volatile bool  cachedFeederEndstop;
+extern volatile unsigned int  stepperLoad;
+extern volatile unsigned long stepRate;
+extern volatile unsigned long stepRates[];
+extern volatile unsigned long loopsPerSecond;
+extern unsigned long  lastFrameTime;
+extern unsigned long  lastToolChangeTime;
+extern unsigned long  inputLatency;
+extern bool           showDiagnostics;
 extern volatile bool  isPwrSave;
 extern unsigned long  endstopZ2HitCnt;
 //extern CRGB           leds[];
 extern volatile bool  showMenu;
+extern volatile int   promptResponse;
+extern unsigned long  bootTimes[];
+extern uint8_t        configSource;
+extern char           activeProfile[];
 
 extern void setupDisplay();
 extern void setupTimers();
 extern void setupSteppers();
+extern void setupStepperConfig();
+extern uint8_t applyConfig(const SMuFFConfig* prev);
 extern void drawLogo();
 extern void drawStatus();
-extern void drawSelectingMessage();
+extern void drawSelectingMessage(int tool);
 extern void drawUserMessage(String message);
+extern void drawUserMessageP(PGM_P message, PGM_P addMessage = NULL);
 extern void drawSDStatus(int stat);
 extern void drawFeed();
+extern void drawDiagnostics();
+extern void printDiagnostics(int serial);
+extern void printStatusReport(int serial);
+extern void setStatusReport(int serial, int interval);
+extern void serviceStatusReport();
+#ifdef HEADLESS
+extern void beginHostPrompt(PGM_P title, PGM_P message, PGM_P addMessage, PGM_P buttons);
+extern void endHostPrompt();
+#endif
+extern uint8_t updateStatusModel();
+extern void invalidateStatus();
+extern void validateStatus();
+#ifdef __STM32F1__
+extern void queueDisplayRows(uint8_t rows);
+extern void cancelDisplayRows();
+extern void serviceDisplay();
+#endif
 extern void resetDisplay();
 extern bool selectorEndstop();
 extern bool revolverEndstop();
@@ -212,6 +309,11 @@ extern bool setServoPos(int servoNum, int degree);
 extern bool setServoMS(int servoNum, int microseconds);
 extern void getStoredData();
 extern void readConfig();
+extern bool reloadConfig(int serial);
+extern uint8_t changeSetting(int index, const char* key, const char* value);
+extern bool loadProfile(const char* name, int serial);
+extern void printProfiles(int serial);
+extern void printBootTimes(int serial);
 extern bool writeConfig(Print* dumpTo = NULL);
 extern bool checkAutoClose();
 extern void resetAutoClose();
@@ -221,7 +323,10 @@ extern void setPwrSave(int state);
 extern void __debug(const char* fmt, ...);
 extern void setAbortRequested(bool state);
 extern void resetSerialBuffer(int serial);
+extern void updateChecksum(int serial, char in);
 extern void checkSerialPending();
+extern void checkRxBuffers();
+extern unsigned long getRefreshInterval();
 extern void setPwrSave(int state);
 extern void drawSwapTool(int from, int with);
 extern uint8_t swapTool(uint8_t index);
@@ -230,10 +335,8 @@ extern bool feedToEndstop(bool showMessage);
 extern void feedToNozzle();
 extern void unloadFromNozzle();
 extern int splitStringLines(char* lines[], int maxLines, const char* message);
-extern void debounceButton();
-extern bool checkStopMenu(unsigned startTime);
+extern bool getEncoderButton(int* turn, int* button, bool* isHeld, bool* isClicked);
 extern void drawTestrunMessage(unsigned long loop, char* msg);
-extern bool getFiles(const char* rootFolder, const char* pattern, int maxFiles, bool cutExtension, char* files);
 extern void testRun(String fname);
 
 extern void printEndstopState(int serial);
@@ -262,5 +365,10 @@ extern void reportSettings(int serial);
 extern void printResponse(const char* response, int serial);
 extern void printResponseP(const char* response, int serial);
 extern void printOffsets(int serial);
+extern char* fmtInt(char* buf, long val);
+extern char* fmtFixed(char* buf, long val, uint8_t decimals);
+extern char* fmtMM(char* buf, long steps, long stepsPerMM);
+extern char* fmtFloat(char* buf, float val, uint8_t decimals = 2);
+extern uint16_t crc16(const uint8_t* data, uint16_t len, uint16_t crc = 0xFFFF);
 
 #endif
@@ -0,0 +1,37 @@
+/**
+ * SMuFF Firmware
+ * Copyright (C) 2019 Technik Gegg
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#ifndef _SDCARD_H
+#define _SDCARD_H
+
+#if defined(__AVR__)
+#define FILE_INDEX_MAX      8       // max. number of files kept in the directory index (168 bytes of RAM)
+#else
+#define FILE_INDEX_MAX      20      // max. number of files kept in the directory index (420 bytes of RAM)
+#endif
+#define FILE_INDEX_NAME_LEN 21      // max. length of a file name in the index (incl. terminator)
+
+extern SdFs     SD;
+
+extern bool         mountSD();
+extern void         unmountSD();
+extern int          indexFiles(const char* folder, const char* pattern);
+extern const char*  getIndexedFile(const char* folder, const char* pattern, int index);
+#endif
@@ -0,0 +1,145 @@
+/**
+ * SMuFF Firmware
+ * Copyright (C) 2019 Technik Gegg
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#pragma once
+
+#ifndef _SERIAL_BUFFERS_H
+#define _SERIAL_BUFFERS_H 1
+
+#include <stdlib.h>
+#include <Arduino.h>
+#include "Config.h"
+
+#define NUM_SERIALS       4                 // Serial, Serial1, Serial2, Serial3
+
+#if (TX_BUFFER_LEN > 256) || ((TX_BUFFER_LEN & (TX_BUFFER_LEN-1)) != 0)
+#error "TX_BUFFER_LEN must be a power of 2 and must not exceed 256"
+#endif
+#if (RX_BUFFER_LEN > 256) || ((RX_BUFFER_LEN & (RX_BUFFER_LEN-1)) != 0)
+#error "RX_BUFFER_LEN must be a power of 2 and must not exceed 256"
+#endif
+
+#define URGENT_LEN        8                 // max. length of an urgent message
+
+/*
+  Transmit ring buffer for one serial port.
+  Output is queued by the main program and pushed out to the port
+  from the 1 ms timer interrupt (and from the main loop) - but only
+  as much as the port is able to take without blocking.
+*/
+class TxBuffer : public Print {
+public:
+  typedef enum {
+    PRIO_RESPONSE = 0,      // protocol responses; never dropped, will stall if the buffer is full
+    PRIO_DEBUG              // debug output; dropped first if the buffer runs full
+  } Priority;
+
+  TxBuffer() { };
+
+  void          attach(int serial, bool isrSafe);
+  bool          send(const char* data, bool isProgmem = false, Priority prio = PRIO_RESPONSE);
+  size_t        write(uint8_t data);
+  using         Print::write;
+  void          sendUrgent(const char* data);
+  void          service(bool fromIsr = false);
+  void          drain();
+
+  bool          isEmpty() { return _head == _tail; }
+  unsigned int  getUsed() { return (uint8_t)(_head - _tail) & (TX_BUFFER_LEN-1); }
+  unsigned int  getFree() { return (TX_BUFFER_LEN-1) - getUsed(); }
+  unsigned int  getMaxUsed() { return _maxUsed; }
+  unsigned long getStalls() { return _stalls; }
+  unsigned long getDrops() { return _drops; }
+  unsigned long getOverflows() { return _overflows; }
+  void          resetStats() { _maxUsed = 0; _stalls = 0; _drops = 0; _overflows = 0; }
+
+private:
+  int                     _serial = -1;           // index of the serial port (0-3)
+  bool                    _isrSafe = false;       // true if the port may be serviced from within an interrupt
+  char                    _buffer[TX_BUFFER_LEN];
+  volatile uint8_t        _head = 0;              // written by the main program only
+  volatile uint8_t        _tail = 0;              // written by the consumer (service) only
+  volatile bool           _busy = false;          // set while service() is running
+  bool                    _atLineStart = true;    // true if the last character sent was a line feed
+  char                    _urgent[URGENT_LEN];    // message to be sent at the next line boundary
+  volatile uint8_t        _urgentLen = 0;
+  unsigned int            _maxUsed = 0;           // high water mark
+  unsigned long           _stalls = 0;            // number of responses which had to wait for free space
+  unsigned long           _drops = 0;             // number of debug messages dropped
+  unsigned long           _overflows = 0;         // number of bytes dropped because the buffer was full and put() couldn't wait
+
+  void          put(char data);
+};
+
+/*
+  Receive ring buffer for one serial port.
+  The port is read from within the 1 ms timer interrupt, which
+  also answers the FINDA status requests (P0) in Prusa MMU2
+  emulation mode right away, without involving the main program.
+*/
+class RxBuffer {
+public:
+  typedef enum {
+    FRAME_START = 0,        // at the beginning of a line
+    FRAME_P,                // 'P' received
+    FRAME_P0,               // 'P0' received
+    FRAME_LINE              // within any other line
+  } FrameState;
+
+  RxBuffer() { };
+
+  void          attach(int serial);
+  bool          isAttached() { return _serial != -1; }
+  void          poll();
+  int           available() { return (uint8_t)(_head - _tail) & (RX_BUFFER_LEN-1); }
+  int           read();
+  unsigned long getOverruns() { return _overruns; }
+  unsigned long getFastReplies() { return _fastReplies; }
+  void          resetStats() { _overruns = 0; _fastReplies = 0; }
+
+private:
+  int                     _serial = -1;           // index of the serial port (0-3)
+  char                    _buffer[RX_BUFFER_LEN];
+  volatile uint8_t        _head = 0;              // written by the interrupt only
+  volatile uint8_t        _tail = 0;              // written by the main program only
+  FrameState              _frame = FRAME_START;
+  char                    _held[4];               // characters held back while a fast path frame is pending
+  uint8_t                 _heldLen = 0;
+  unsigned long           _overruns = 0;          // number of characters lost
+  unsigned long           _fastReplies = 0;       // number of requests answered by the fast path
+
+  void          put(char data);
+  bool          checkFastPath(char data);
+};
+
+extern TxBuffer   txBuffer[];
+extern RxBuffer   rxBuffer[];
+
+extern void setupTxBuffers();
+extern void serviceTxBuffers(bool fromIsr = false);
+extern void drainTxBuffers();
+extern void printSerialStatistics(int serial);
+extern void setupRxBuffers();
+extern void pollRxBuffers();
+extern void setBaudrate(int serial, unsigned long baudrate);
+extern void requestBaudrate(int port, unsigned long baudrate);
+extern void serviceBaudrates();
+extern void startAutobaud(int port);
+extern bool checkAutobaud(int serial, char in);
+
+#endif
@@ -27,21 +27,66 @@
 #define SD_READING_CONFIG     0
 
 #ifdef __STM32F1__
-const char P_MenuItemBack [] PROGMEM        = { "\u25c0 BACK\n" };
-const char P_MenuItemSeparator [] PROGMEM   = { "\u25ab\u25ab\u25ab\u25ab\u25ab\n"};
-const char P_MenuItems [] PROGMEM           = { "Home All\nMotors %s\nReset Feeder Jam\nSwap Tools \u25b8\nLoad Filament\nUnload Filament\n%s%s%s" };
-const char P_MenuItemsDefault[] PROGMEM     = { "Settings \u25b8\n%sTestrun \u25b8" };
-const char P_OfsMenuItems [] PROGMEM        = { "Selector         %4s\nRevolver        %5s" };
+const char P_MnuBack [] PROGMEM             = { "\u25c0 BACK" };
+const char P_MnuSeparator [] PROGMEM        = { "\u25ab\u25ab\u25ab\u25ab\u25ab" };
+const char P_MnuSubmenu [] PROGMEM          = { "\u25b8" };
+const char P_MnuSaveConfig [] PROGMEM       = { "\u25b9 SAVE TO SD-CARD \u25c3" };
 #else
-const char P_MenuItemBack [] PROGMEM        = { "< BACK\n" };
-const char P_MenuItemSeparator [] PROGMEM   = { "-----\n"};
-const char P_MenuItems [] PROGMEM           = { "Home All\nMotors %s\nReset Feeder Jam\nSwap Tools >\nLoad Filament\nUnload Filament\nOffsets >" };
-//const char P_MenuItems [] PROGMEM           = { "Home All\nMotors %s\nReset Feeder Jam\nSwap Tools >\nLoad Filament\nUnload Filament\n%s%S%S" };
-const char P_MenuItemsDefault[] PROGMEM     = { "Settings >" };
-const char P_OfsMenuItems [] PROGMEM        = { "Selector         %4s\nRevolver        %5s" };
+const char P_MnuBack [] PROGMEM             = { "< BACK" };
+const char P_MnuSeparator [] PROGMEM        = { "-----" };
+const char P_MnuSubmenu [] PROGMEM          = { ">" };
+const char P_MnuSaveConfig [] PROGMEM       = { "> SAVE TO SD-CARD <" };
 #endif
-const char P_MenuItemsPMMU [] PROGMEM       = { "Load To Nozzle\n" };
+const char P_MnuHomeAll [] PROGMEM          = { "Home All" };
+const char P_MnuMotors [] PROGMEM           = { "Motors" };
+const char P_MnuResetJam [] PROGMEM         = { "Reset Feeder Jam" };
+const char P_MnuSwapTools [] PROGMEM        = { "Swap Tools" };
+const char P_MnuLoad [] PROGMEM             = { "Load Filament" };
+const char P_MnuUnload [] PROGMEM           = { "Unload Filament" };
+const char P_MnuLoadNozzle [] PROGMEM       = { "Load To Nozzle" };
+const char P_MnuOffsets [] PROGMEM          = { "Offsets" };
+const char P_MnuSettings [] PROGMEM         = { "Settings" };
+const char P_MnuDiagnostics [] PROGMEM     = { "Diagnostics" };
+const char P_MnuTestrun [] PROGMEM          = { "Testrun" };
+const char P_MnuResetSwaps [] PROGMEM       = { "Reset swaps" };
+const char P_MnuToolCount [] PROGMEM        = { "Tool Count" };
+const char P_MnuBowdenLen [] PROGMEM        = { "Bowden Length" };
+const char P_MnuSelectorDist [] PROGMEM     = { "Selector Dist." };
+const char P_MnuAutoClose [] PROGMEM        = { "Menu Auto Close" };
+const char P_MnuFanSpeed [] PROGMEM         = { "Fan Speed" };
+const char P_MnuPwrSaveTime [] PROGMEM      = { "Power Save Time" };
+const char P_MnuPmmuEmul [] PROGMEM         = { "Prusa MMU2 Emul." };
+const char P_MnuBaudrates [] PROGMEM        = { "Baudrates" };
+const char P_MnuSteppers [] PROGMEM         = { "Steppers" };
+const char P_MnuProfiles [] PROGMEM         = { "Profiles" };
+const char P_MnuBaseConfig [] PROGMEM       = { "- Config file -" };
+const char P_MnuSelector [] PROGMEM         = { "Selector" };
+const char P_MnuRevolver [] PROGMEM         = { "Revolver" };
+const char P_MnuFeeder [] PROGMEM           = { "Feeder" };
+const char P_MnuBaudUsb [] PROGMEM          = { "USB-Serial" };
+const char P_MnuBaud2nd [] PROGMEM          = { "2nd Serial" };
+const char P_MnuInvertDir [] PROGMEM        = { "Invert DIR" };
+const char P_MnuEndstopTrigger [] PROGMEM   = { "Endstop Trigger" };
+const char P_MnuStepDelay [] PROGMEM        = { "Step Delay" };
+const char P_MnuMaxSpeed [] PROGMEM         = { "Max. Speed" };
+const char P_MnuMaxSpeedHS [] PROGMEM       = { "Max. Speed HS" };
+const char P_MnuAcceleration [] PROGMEM     = { "Acceleration" };
+const char P_MnuStepsPerMM [] PROGMEM       = { "Steps per MM" };
+const char P_MnuStepsPerRev [] PROGMEM      = { "Steps per Rev." };
+const char P_MnuHomeAfterFeed [] PROGMEM    = { "Home After Feed" };
+const char P_MnuResetBefFeed [] PROGMEM     = { "Reset Bef. Feed" };
+const char P_MnuWiggle [] PROGMEM           = { "Wiggle" };
+const char P_MnuUseServo [] PROGMEM         = { "Use Servo" };
+const char P_MnuServoOpen [] PROGMEM        = { "Servo open" };
+const char P_MnuServoClosed [] PROGMEM      = { "Servo closed" };
+const char P_MnuServoCycles [] PROGMEM      = { "Servo cycles" };
+const char P_MnuEnableChunks [] PROGMEM     = { "Enable Chunks" };
+const char P_MnuFeedChunks [] PROGMEM       = { "Feed Chunks" };
+const char P_MnuInsertLen [] PROGMEM        = { "Insert Length" };
+const char P_MnuInsertSpeed [] PROGMEM      = { "Insert Speed" };
+const char P_MnuReinforceLen [] PROGMEM     = { "Reinforce Len." };
 const char P_OkButtonOnly [] PROGMEM        = { " Ok " };
+const char P_StopButtonOnly [] PROGMEM      = { " Stop " };
 const char P_CancelButtonOnly [] PROGMEM    = { " Cancel " };
 const char P_OkCancelButtons [] PROGMEM     = { " Ok \n Cancel " };
 const char P_CancelRetryButtons [] PROGMEM  = { " Cancel \n Retry " };
@@ -58,11 +103,9 @@ const char P_CheckUnit [] PROGMEM           = { "Please check unit!" };
 const char P_TitleConfigError [] PROGMEM    = { "CONFIG FAILURE" };
 const char P_ConfigFail1 [] PROGMEM         = { "Your config file is" };
 const char P_ConfigFail2 [] PROGMEM         = { "possibly corrupted,\nplease check!" };
-const char P_ConfigFail3 [] PROGMEM         = { "too big,\nplease reduce content!" };
 const char P_ConfigFail4 [] PROGMEM         = { "data inconsistent\nor memory failure!" };
 const char P_ToolMenu [] PROGMEM            = { "Tool %d" };
 const char P_SwapMenu [] PROGMEM            = { "Slot %d: T%d" };
-const char P_SwapReset [] PROGMEM           = { "Reset swaps\n" };
 const char P_SwapToolDialog [] PROGMEM      = { "Swap Tool %d\nwith Tool %d" };
 const char P_Selecting [] PROGMEM           = { "Selecting" };
 const char P_Wait [] PROGMEM                = { "please wait..." };
@@ -71,11 +114,6 @@ const char P_TitleToolsMenu [] PROGMEM      = { "Tool Selection" };
 const char P_Busy[] PROGMEM                 = { "busy..." };
 const char P_Ready[] PROGMEM                = { "ready." };
 const char P_Pemu[] PROGMEM                 = { "PMMU2" };
-#ifdef __STM32F1__
-const char P_SettingsMenuItems[] PROGMEM    = { "Tool Count      %5s\nBowden Length   %5s\nSelector Dist.  %5s\nMenu Auto Close  %4s\nFan Speed       %5s\nPower Save Time %5s\nPrusa MMU2 Emul. %4s\nBaudrates          %4s\nOffsets            %4s\nSteppers           %4s\n%s\u25b9 SAVE TO SD-CARD \u25c3" };
-#else
-const char P_SettingsMenuItems[] PROGMEM    = { "Tool Count      %5s\nBowden Length   %5s\nSelector Dist.  %5s\nMenu Auto Close  %4s\nFan Speed       %5s\nPower Save Time %5s\nPrusa MMU2 Emul. %4S\nBaudrates           %s\nOffsets             %s\nSteppers            %s\n%S> SAVE TO SD-CARD <" };
-#endif
 const char P_Off[] PROGMEM                  = { "OFF" };
 const char P_On[] PROGMEM                   = { "ON" };
 const char P_Yes[] PROGMEM                  = { "Yes" };
@@ -97,25 +135,13 @@ const char P_OpenPos[] PROGMEM              = { "open @:" };
 const char P_ClosedPos[] PROGMEM            = { "closed @:" };
 const char P_ServoCycles[] PROGMEM          = { "cycles:" };
 const char P_NoOfChunks[] PROGMEM           = { "# of chunks:" };
-const char P_BaudMenuItems[] PROGMEM        = { "USB-Serial     %6s\n2nd Serial     %6s" };
-const char P_Baudrates[] PROGMEM            = { "4800\n9600\n19200\n38400\n56700\n115200\n230400" };
-#ifdef __STM32F1__
-const char P_SteppersMenuItems[] PROGMEM    = { "Selector            %2s\nRevolver            %2s\nFeeder              %2s" };
-const char P_AllSteppersMenuItems[] PROGMEM = { "Invert DIR       %4s\nEndstop Trigger  %4s\nStep Delay       %4s\nMax. Speed      %5s\nMax. Speed HS   %5s\nAcceleration    %5s" };
-const char P_RevolverMenuItems[] PROGMEM    = { "\nSteps per Rev.  %5s\nHome After Feed  %4s\nReset Bef. Feed  %4s\nWiggle           %4s\nUse Servo        %4s\nServo open      %5s\nServo closed    %5s\nServo cycles    %5s" };
-const char P_FeederMenuItems[] PROGMEM      = { "\nSteps per MM    %5s\nEnable Chunks    %4s\nFeed Chunks      %4s\nInsert Length    %5s\nInsert Speed     %5s\nReinforce Len.  %5s" };
-const char P_SelectorMenuItems[] PROGMEM    = { "\nSteps per MM    %5s" };
-#else
-const char P_SteppersMenuItems[] PROGMEM    = { "Selector            >\nRevolver            >\nFeeder              >" };
-const char P_AllSteppersMenuItems[] PROGMEM = { "Invert DIR       %4S\nEndstop Trigger  %4S\nStep Delay       %4s\nMax. Speed      %5s\nMax. Speed HS   %5s\nAcceleration    %5s" };
-const char P_RevolverMenuItems[] PROGMEM    = { "\nSteps per Rev.  %5s\nHome After Feed  %4s\nReset Bef. Feed  %4s\nWiggle           %4s\nUse Servo        %4s\nServo open      %5s\nServo closed    %5s\nServo cycles    %5s" };
-const char P_FeederMenuItems[] PROGMEM      = { "\nSteps per MM    %5s\nEnable Chunks    %4S\nFeed Chunks      %4s\nInsert Length    %5s\nInsert Speed     %5s\nReinforce Len.  %5s" };
-const char P_SelectorMenuItems[] PROGMEM    = { "\nSteps per MM    %5s" };
-#endif
+const char P_Baudrates[] PROGMEM            = { "4800\n9600\n19200\n38400\n57600\n115200\n230400\n250000\n500000\n1000000" };
 const char P_ConfigWriteSuccess[] PROGMEM   = { "Config success-\nfully written." };
 const char P_ConfigWriteFail[] PROGMEM      = { "Config write failed!\nPlease check SD-Card." };
+const char P_ProfileLoadFail[] PROGMEM      = { "Profile load failed!\nPlease check SD-Card." };
 
 const char P_RunningTest[] PROGMEM          = { "Starting\n\n%s" };
+const char P_TestRunning[] PROGMEM          = { "Test run in progress." };
 const char P_TestFailed[] PROGMEM           = { "Failed to open\n\n%s" };
 const char P_RunningCmd[] PROGMEM           = { "Running loop %ld" };
 const char P_CmdLoop[] PROGMEM              = { "CMD: %-7ld T%d" };
@@ -123,6 +149,12 @@ const char P_ToolChanges[] PROGMEM          = { "Tool change: %5ld" };
 const char P_TestTime[] PROGMEM             = { "Elapsed: %3d:%02d:%02d" };
 const char P_FeederErrors[] PROGMEM         = { "Feed errors: %5ld" };
 const char P_ButtonToStop[] PROGMEM         = { "Press Button To Stop" };
+const char P_DiagLoops[] PROGMEM            = { "Loop/s%6lu  ISR%3u%%" };
+const char P_DiagStepsXY[] PROGMEM          = { "Step/s X%5lu Y%5lu" };
+const char P_DiagStepsZ[] PROGMEM           = { "       Z%5lu" };
+const char P_DiagQueues[] PROGMEM           = { "RX%4u  TX%4u bytes" };
+const char P_DiagFrame[] PROGMEM            = { "Frame %8lu us" };
+const char P_DiagToolChange[] PROGMEM       = { "Tool change %6s s" };
 
 const char P_SD_ReadingConfig[] PROGMEM = { "Reading config..." };
 const char P_SD_InitError[] PROGMEM     = { "SD-Card not ready!" };
@@ -132,12 +164,43 @@ const char P_Ok[] PROGMEM             = { "ok\n" };
 const char P_Start[] PROGMEM          = { "start\n" };
 const char P_Error[] PROGMEM          = { "Error: %s\n" };
 const char P_UnknownCmd[] PROGMEM     = { "Unknown command:" };
+const char P_ChecksumMismatch[] PROGMEM = { "Error:checksum mismatch, Last Line: %ld\n" };
+const char P_LineNumberError[] PROGMEM  = { "Error:Line Number is not Last Line Number+1, Last Line: %ld\n" };
+const char P_NoChecksum[] PROGMEM       = { "Error:No Checksum with line number, Last Line: %ld\n" };
+const char P_NoLineNumber[] PROGMEM     = { "Error:No Line Number with checksum, Last Line: %ld\n" };
+const char P_Resend[] PROGMEM           = { "Resend: %ld\n" };
 const char P_AlreadySaved[] PROGMEM   = { "Already saved.\n" };
 const char P_GVersion[] PROGMEM       = { "FIRMWARE_NAME: Smart.Multi.Filament.Feeder (SMuFF) FIRMWARE_VERSION: %s ELECTRONICS: %s DATE: %s MODE: %s\n" };
 const char P_TResponse[] PROGMEM      = { "T%d\n" };
 const char P_GResponse[] PROGMEM      = { "G%d\n" };
 const char P_MResponse[] PROGMEM      = { "M%d\n" };
 const char P_M250Response[] PROGMEM   = { "M250 C%d\n" };
+const char P_AutobaudLocked[] PROGMEM = { "echo: Serial %d locked at %lu baud\n" };
+const char P_Diagnostics[] PROGMEM    = { "Loops/s: %lu, ISR load: %u.%u%%, steps/s X: %lu, Y: %lu, Z: %lu, RX: %u, TX: %u, frame: %lu us, tool change: %lu ms, input latency: %lu ms, inputs lost: %u\n" };
+const char P_RxStatistics[] PROGMEM   = { "Serial %d: RX overruns: %lu, fast replies: %lu\n" };
+const char P_ConfigApplied[] PROGMEM  = { "Config reloaded, changed: %s (steppers: %s, servos: %s, fan: %s, display: %s, serial: %s)\n" };
+const char P_ConfigNotApplied[] PROGMEM = { "Config file is corrupted, nothing has been changed\n" };
+const char P_ProfileApplied[] PROGMEM = { "Profile: %s, changed: %s (steppers: %s)\n" };
+const char P_ProfileFail[] PROGMEM    = { "Profile '%s' not found or corrupted, nothing has been changed\n" };
+const char P_ProfileActive[] PROGMEM  = { "Profile active, revert to the config file first (M2006 R)\n" };
+const char P_UnknownSetting[] PROGMEM = { "Unknown setting '%s'\n" };
+const char P_SettingRange[] PROGMEM   = { "Value of '%s' out of range\n" };
+const char P_SettingInvalid[] PROGMEM = { "Value of '%s' invalid\n" };
+const char P_MacroNotFound[] PROGMEM  = { "Macro '%s' not found\n" };
+const char P_MacroNameTooLong[] PROGMEM = { "Macro name too long (max. %d characters)\n" };
+const char P_MacroFailed[] PROGMEM    = { "Macro '%s' failed in line %d\n" };
+const char P_HookToolChange[] PROGMEM = { "toolchange" };
+const char P_HookLoad[] PROGMEM       = { "load" };
+const char P_HookUnload[] PROGMEM     = { "unload" };
+const char P_BootTimes[] PROGMEM      = { "Boot (ms): init: %lu, delay: %lu, display: %lu, config: %lu (%s), serial: %lu, steppers: %lu, servos: %lu, data: %lu, homing: %lu, total: %lu\n" };
+const char P_StoreStatistics[] PROGMEM= { "Store: updates: %lu, flushes: %lu, unchanged: %lu, failed: %lu, pending: %d, last: %lu us, max: %lu us\n" };
+const char P_TxStatistics[] PROGMEM   = { "Serial %d: %3u/%u bytes, max. %u, stalls: %lu, drops: %lu, overflows: %lu\n" };
+const char P_StatusReport[] PROGMEM   = { "echo: STATUS T:%d X:%s Y:%s Z:%s ES:%d%d%d%d MOT:%d JAM:%d BUSY:%d PWRSAVE:%d\n" };
+const char P_ActionNotification[] PROGMEM = { "//action:notification " };
+const char P_ActionPromptBegin[] PROGMEM  = { "//action:prompt_begin " };
+const char P_ActionPromptButton[] PROGMEM = { "//action:prompt_button " };
+const char P_ActionPromptShow[] PROGMEM   = { "//action:prompt_show\n" };
+const char P_ActionPromptEnd[] PROGMEM    = { "//action:prompt_end\n" };
 
 const char P_SelectorPos[] PROGMEM    = { "Selector position = %ld\n" };
 const char P_RevolverPos[] PROGMEM    = { "Revolver position = %ld\n" };
@@ -145,7 +208,7 @@ const char P_FeederPos[] PROGMEM      = { "Feeder position = %ld\n" };
 const char P_ToolSelected[] PROGMEM   = { "Tool selected = %d\n" };
 const char P_Contrast[] PROGMEM       = { "Display contrast = %d\n" };
 const char P_ToolsConfig[] PROGMEM    = { "Tools configured = %d\n" };
-const char P_AccelSpeed[] PROGMEM     = { "X (Selector):\t%s, D:%s\nY (Revolver):\t%s, D:%s\nZ (Feeder):\t%s, D:%s\n" };
+const char P_AccelSpeed[] PROGMEM     = { "X (Selector):\t%u, D:%d\nY (Revolver):\t%u, D:%d\nZ (Feeder):\t%s, D:%d\n" };
 const char P_Positions[] PROGMEM      = { "X (Selector): %s, Y (Revolver): %s, Z (Feeder): %s\n" };
 
 const char P_CurrentTool[] PROGMEM    = {"Tool    " };
@@ -178,29 +241,37 @@ const char P_MCmds[] PROGMEM = {
   "M84\t-\tMotors off\n" \
   "M20\t-\tList SD-Card\n" \
   "M42\t-\tSet pin state\n" \
-  "M98\t-\tExecute test run\n" \
+  "M98\t-\tRun macro (P\"name\" A..Z = parameters), test run if there's no such macro\n" \
   "M106\t-\tFan on\n" \
   "M107\t-\tFan off\n" \
   "M114\t-\tReport current positions\n" \
   "M115\t-\tReport version\n" \
   "M117\t-\tDisplay message\n" \
   "M119\t-\tReport endstop status\n" \
+  "M155\t-\tAuto report status (S = interval in seconds)\n" \
   "M120\t-\tEnable endstops\n" \
   "M121\t-\tDisable endstops\n" \
   "M201\t-\tSet max acceleration\n" \
   "M203\t-\tSet max feedrate\n" \
-  "M205\t-\tSet advanced options\n" \
+  "M205\t-\tList or change settings (P\"Section.Key\" S<value>)\n" \
   "M206\t-\tSet offsets\n" \
   "M250\t-\tLCD contrast\n" \
   "M300\t-\tBeep\n" \
   "M500\t-\tSave settings\n" \
-  "M503\t-\tReport settings\n" \
-  "M575\t-\tSet serial port baudrate\n" \
+  "M501\t-\tReload settings from SD-Card and apply them\n" \
+  "M503\t-\tReport settings (P\"Section.Key\" = single setting)\n" \
+  "M575\t-\tSet serial port baudrate (A1 = autobaud)\n" \
+  "M876\t-\tAnswer host prompt (S = button)\n" \
   "M700\t-\tLoad filament\n" \
   "M701\t-\tUnload filament\n" \
   "M999\t-\tReset\n" \
   "M2000\t-\tText to decimal\n" \
-  "M2001\t-\tDecimal to text\n"};
+  "M2001\t-\tDecimal to text\n" \
+  "M2002\t-\tSerial statistics\n" \
+  "M2003\t-\tDiagnostics (S1 = show on display)\n" \
+  "M2004\t-\tData store statistics (F = flush, R = reset)\n" \
+  "M2005\t-\tBoot time breakdown\n" \
+  "M2006\t-\tList profiles (P\"name\" = apply profile, R = revert to config file)\n"};
 
                              
 #endif
@@ -110,7 +110,7 @@ public:
   void          setAbort(bool state) { _abort = state; }
   bool          getIgnoreAbort() { return _ignoreAbort; }
   void          setIgnoreAbort(bool state) { _ignoreAbort = state; }
-  bool          getStepsTaken() { return _stepsTaken; }
+  long          getStepsTaken() { return _stepsTaken; }
   float         getStepsTakenMM() { return (float)_stepsTaken / _stepsPerMM; }
   void          setStepsTaken(long count) { _stepsTaken = count; }
   unsigned int  getAccelDistance() { return _accelDistance; }
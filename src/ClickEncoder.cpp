@@ -127,6 +127,16 @@ void ClickEncoder::service(void)
     }
   }
 
+  // queue a turn event for each full notch; if the queue is full, the
+  // steps remain in delta until there's room again
+  if (delta >= steps || delta <= -((int16_t)steps)) {
+    int8_t accel = (accelerationEnabled) ? (acceleration >> 8) : 0;
+    int8_t dir = (delta > 0) ? 1 : -1;
+    if (pushEvent(Open, dir * (1 + accel), now)) {
+      delta -= dir * steps;
+    }
+  }
+
   // handle button
   //
 #ifndef WITHOUT_BUTTON
@@ -136,9 +146,13 @@ void ClickEncoder::service(void)
     lastButtonCheck = now;
 
     if (digitalRead(pinBTN) == pinsActive) { // key is down
-      keyDownTicks++;
-      if (keyDownTicks > (ENC_HOLDTIME / ENC_BUTTONINTERVAL)) {
+      if (++keyDownTicks == 1) {
+        buttonDown = true;
+        pushEvent(Pressed, 0, now);
+      }
+      if (keyDownTicks > (ENC_HOLDTIME / ENC_BUTTONINTERVAL) && button != Held) {
         button = Held;
+        pushEvent(Held, 0, now);
       }
     }
 
@@ -146,6 +160,7 @@ void ClickEncoder::service(void)
       if (keyDownTicks > ENC_BUTTONINTERVAL) {
         if (button == Held) {
           button = Released;
+          pushEvent(Released, 0, now);
           doubleClickTicks = 0;
         }
         else {
@@ -153,6 +168,7 @@ void ClickEncoder::service(void)
           if (doubleClickTicks > ENC_SINGLECLICKONLY) {   // prevent trigger in single click mode
             if (doubleClickTicks < (ENC_DOUBLECLICKTIME / ENC_BUTTONINTERVAL)) {
               button = DoubleClicked;
+              pushEvent(DoubleClicked, 0, now);
               doubleClickTicks = 0;
             }
           }
@@ -163,12 +179,14 @@ void ClickEncoder::service(void)
       }
 
       keyDownTicks = 0;
+      buttonDown = false;
     }
 
     if (doubleClickTicks > 0) {
       doubleClickTicks--;
       if (--doubleClickTicks == 0) {
         button = Clicked;
+        pushEvent(Clicked, 0, now);
       }
     }
   }
@@ -177,52 +195,34 @@ void ClickEncoder::service(void)
 }
 
 // ----------------------------------------------------------------------------
-
-int16_t ClickEncoder::getValue(void)
+// called from service() only (producer side)
+//
+bool ClickEncoder::pushEvent(uint8_t btn, int8_t turn, unsigned long now)
 {
-  int16_t val;
-
-#if defined (__STM32F1__)	
-  noInterrupts();
-#else
-  cli();
-#endif
-  val = delta;
-
-  if (steps == 2) delta = val & 1;
-  else if (steps == 4) delta = val & 3;
-  else delta = 0; // default to 1 step per notch
-#if defined (__STM32F1__)	
-  interrupts();
-#else
-  sei();
-#endif
-  
-  if (steps == 4) val >>= 2;
-  if (steps == 2) val >>= 1;
-
-  int16_t r = 0;
-  int16_t accel = ((accelerationEnabled) ? (acceleration >> 8) : 0);
-
-  if (val < 0) {
-    r -= 1 + accel;
-  }
-  else if (val > 0) {
-    r += 1 + accel;
+  uint8_t next = (eventHead + 1) & (ENC_EVENT_QUEUE_LEN - 1);
+  if (next == eventTail) {     // queue is full
+    if (btn != Open && eventsLost < 255) {
+      eventsLost++;
+    }
+    return false;
   }
-
-  return r;
+  events[eventHead].button = btn;
+  events[eventHead].turn = turn;
+  events[eventHead].time = now;
+  eventHead = next;           // publish the event after it has been written
+  return true;
 }
 
 // ----------------------------------------------------------------------------
-
-#ifndef WITHOUT_BUTTON
-ClickEncoder::Button ClickEncoder::getButton(void)
+// fetches the oldest event (consumer side), returns false if there's none
+//
+bool ClickEncoder::getEvent(Event* ev)
 {
-  ClickEncoder::Button ret = button;
-  if (button != ClickEncoder::Held) {
-    button = ClickEncoder::Open; // reset
+  uint8_t tail = eventTail;
+  if (tail == eventHead) {
+    return false;
   }
-  return ret;
+  *ev = events[tail];
+  eventTail = (tail + 1) & (ENC_EVENT_QUEUE_LEN - 1);
+  return true;
 }
-#endif
@@ -18,26 +18,330 @@
  */
  
  /*
-  * Module for reading configuration file (JSON-Format) from SD-Card
+  * Module for reading and writing the configuration file (JSON-Format) 
+  * from/to SD-Card. 
+  * The file gets parsed as a stream and the values are stored straight 
+  * into smuffConfig as described by the schema (see ConfigSchema.cpp), 
+  * so there's neither a JSON document in memory nor a limit on the file size.
+  * After it has been parsed, smuffConfig gets saved as a binary snapshot 
+  * (CONFIG_CACHE_FILE), which is loaded instead of parsing the file again 
+  * as long as neither the file nor the firmware has changed.
+  * Profiles are config files in PROFILE_FOLDER containing only the keys
+  * which differ from CONFIG_FILE; they get parsed on top of it.
   */
 
 #include "SMuFF.h"
-#include <ArduinoJson.h>
+#include "ConfigSchema.h"
 
-SdFs SD;
+uint8_t configSource = CONFIG_NONE;
+char    activeProfile[FILE_INDEX_NAME_LEN];   // name of the profile applied, empty if none
 
-#ifdef __STM32F1__
-const size_t capacity = 2400;
-#else
-const size_t capacity = 1300;
-#endif
+#define CONFIG_CACHE_MAGIC  0x5343  // "SC"
 
+/*
+  Header of the snapshot file, followed by the contents of smuffConfig.
+  The snapshot is valid only for the config file of the size and
+  modification time given and the very firmware build it was saved by.
+*/
+typedef struct {
+  uint16_t  magic;
+  uint16_t  build;                // CRC of the firmware build date/time
+  uint16_t  size;                 // sizeof(SMuFFConfig)
+  uint16_t  cfgDate;              // modification date of CONFIG_FILE
+  uint16_t  cfgTime;              // modification time of CONFIG_FILE
+  uint32_t  cfgSize;              // size of CONFIG_FILE
+  uint16_t  crc;                  // CRC of the snapshot data
+} ConfigCacheHeader;
+
+#define JSON_MAX_DEPTH    4       // max. nesting level of objects / arrays
+
+typedef struct {
+  FsFile*   file;
+  char      buf[32];              // read ahead buffer
+  uint8_t   len;
+  uint8_t   pos;
+  int       ch;                   // current character, -1 at end of file
+  char      value[CFG_VALUE_LEN]; // value token currently read
+  uint8_t   unknown;              // number of keys not in the schema
+  uint8_t   invalid;              // number of values invalid or out of range
+} JsonReader;
+
+static int nextChar(JsonReader* rd) {
+  if(rd->pos >= rd->len) {
+    int n = rd->file->read(rd->buf, sizeof(rd->buf));
+    if(n <= 0)
+      return rd->ch = -1;
+    rd->len = n;
+    rd->pos = 0;
+  }
+  return rd->ch = rd->buf[rd->pos++];
+}
+
+static int skipWhitespace(JsonReader* rd) {
+  while(rd->ch == ' ' || rd->ch == '\t' || rd->ch == '\r' || rd->ch == '\n')
+    nextChar(rd);
+  return rd->ch;
+}
+
+/*
+  Reads a string token (the current character is the opening quote),
+  characters exceeding size get dropped.
+*/
+static bool readString(JsonReader* rd, char* str, uint8_t size) {
+  uint8_t n = 0;
+  int c;
+
+  while((c = nextChar(rd)) != '"') {
+    if(c == -1)
+      return false;
+    if(c == '\\') {
+      switch(c = nextChar(rd)) {
+        case -1:  return false;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'u':                 // unicode escapes aren't supported
+          for(uint8_t i=0; i < 4; i++)
+            nextChar(rd);
+          c = '?';
+          break;
+      }
+    }
+    if(n < size-1)
+      str[n++] = c;
+  }
+  str[n] = 0;
+  nextChar(rd);
+  return true;
+}
+
+/*
+  Reads a number or one of true, false, null.
+*/
+static bool readLiteral(JsonReader* rd, char* str, uint8_t size) {
+  uint8_t n = 0;
+  while(isalnum(rd->ch) || rd->ch == '.' || rd->ch == '-' || rd->ch == '+') {
+    if(n < size-1)
+      str[n++] = rd->ch;
+    nextChar(rd);
+  }
+  str[n] = 0;
+  return n > 0;
+}
+
+static void applyValue(JsonReader* rd, int8_t section, const char* key) {
+  int index = findConfigKey(section, key);
+  if(index == -1) {
+    rd->unknown++;
+    __debug(PSTR("Config: Unknown key '%s'"), key);
+    return;
+  }
+  if(setConfigValue(index, key, rd->value) != CFG_OK) {
+    rd->invalid++;
+    __debug(PSTR("Config: Invalid value '%s' for '%s'"), rd->value, key);
+  }
+}
+
+static bool parseValue(JsonReader* rd, int8_t section, const char* key, uint8_t depth);
+
+/*
+  Parses an object (the current character is the opening brace).
+  Section is the schema section the keys belong to, -1 if the
+  object isn't part of the schema.
+*/
+static bool parseObject(JsonReader* rd, int8_t section, uint8_t depth) {
+  char key[CFG_KEY_LEN];
+
+  nextChar(rd);
+  if(skipWhitespace(rd) == '}') {
+    nextChar(rd);
+    return true;
+  }
+  while(1) {
+    if(skipWhitespace(rd) != '"' || !readString(rd, key, sizeof(key)))
+      return false;
+    if(skipWhitespace(rd) != ':')
+      return false;
+    nextChar(rd);
+    if(!parseValue(rd, section, key, depth))
+      return false;
+    if(skipWhitespace(rd) == ',') {
+      nextChar(rd);
+      continue;
+    }
+    if(rd->ch != '}')
+      return false;
+    nextChar(rd);
+    return true;
+  }
+}
+
+/*
+  Parses the value of key. Objects on the top level (depth 1)
+  are the sections of the schema, anything else gets skipped.
+*/
+static bool parseValue(JsonReader* rd, int8_t section, const char* key, uint8_t depth) {
+  switch(skipWhitespace(rd)) {
+    case '{':
+      if(depth >= JSON_MAX_DEPTH)
+        return false;
+      if(section == CFG_SEC_TOP) {
+        section = findConfigSection(key);
+        if(section == -1) {
+          rd->unknown++;
+          __debug(PSTR("Config: Unknown section '%s'"), key);
+        }
+      }
+      else
+        section = -1;
+      return parseObject(rd, section, depth+1);
+
+    case '[':
+      if(depth >= JSON_MAX_DEPTH)
+        return false;
+      nextChar(rd);
+      if(skipWhitespace(rd) == ']') {
+        nextChar(rd);
+        return true;
+      }
+      while(1) {
+        if(!parseValue(rd, -1, NULL, depth+1))
+          return false;
+        if(skipWhitespace(rd) == ',') {
+          nextChar(rd);
+          continue;
+        }
+        if(rd->ch != ']')
+          return false;
+        nextChar(rd);
+        return true;
+      }
+
+    case '"':
+      if(!readString(rd, rd->value, sizeof(rd->value)))
+        return false;
+      break;
+
+    default:
+      if(!readLiteral(rd, rd->value, sizeof(rd->value)))
+        return false;
+      break;
+  }
+  if(section != -1 && key != NULL)
+    applyValue(rd, section, key);
+  return true;
+}
+
+/*
+  Parses the config file and stores the values in smuffConfig.
+  Returns false if the file isn't valid JSON; the values read up
+  to the error have been stored nonetheless.
+*/
+static bool parseConfig(FsFile* file) {
+  JsonReader rd;
+
+  memset(&rd, 0, sizeof(rd));
+  rd.file = file;
+  nextChar(&rd);
+  if(skipWhitespace(&rd) != '{')
+    return false;
+  if(!parseObject(&rd, CFG_SEC_TOP, 1))
+    return false;
+  if(rd.unknown || rd.invalid)
+    __debug(PSTR("Config: %d unknown keys, %d invalid values"), rd.unknown, rd.invalid);
+  return skipWhitespace(&rd) == -1;
+}
+
+/*
+  Sets the values which depend on others.
+*/
+static void finishConfig() {
+  smuffConfig.maxSteps_X = ((smuffConfig.toolCount-1)*smuffConfig.toolSpacing+smuffConfig.firstToolOffset) * smuffConfig.stepsPerMM_X;
+  smuffConfig.revolverSpacing = smuffConfig.stepsPerRevolution_Y / 10;
+  if(smuffConfig.insertSpeed_Z > smuffConfig.acceleration_Z)
+    smuffConfig.acceleration_Z = smuffConfig.insertSpeed_Z;
+  if(smuffConfig.maxSpeedHS_X == 0)
+    smuffConfig.maxSpeedHS_X = smuffConfig.maxSpeed_X;
+  if(smuffConfig.maxSpeedHS_Y == 0)
+    smuffConfig.maxSpeedHS_Y = smuffConfig.maxSpeed_Y;
+  if(smuffConfig.maxSpeedHS_Z == 0)
+    smuffConfig.maxSpeedHS_Z = smuffConfig.maxSpeed_Z;
+}
+
+/*
+  Resets smuffConfig to the defaults, so that keys missing in the
+  file parsed next don't keep the values set before.
+*/
+static void resetConfig() {
+  smuffConfig = SMuFFConfig();
+}
+
+static void getCacheHeader(FsFile* cfg, ConfigCacheHeader* hdr) {
+  static const char build[] PROGMEM = __DATE__ " " __TIME__;
+  char tmp[sizeof(build)];
+
+  memset(hdr, 0, sizeof(ConfigCacheHeader));
+  memcpy_P(tmp, build, sizeof(build));
+  hdr->magic = CONFIG_CACHE_MAGIC;
+  hdr->build = crc16((uint8_t*)tmp, sizeof(build)-1);
+  hdr->size = sizeof(SMuFFConfig);
+  hdr->cfgSize = (uint32_t)cfg->fileSize();
+  cfg->getModifyDateTime(&hdr->cfgDate, &hdr->cfgTime);
+}
+
+/*
+  Loads smuffConfig from the snapshot if it belongs to the config file given.
+  The snapshot gets verified before anything is copied into smuffConfig.
+*/
+static bool loadConfigCache(FsFile* cfg) {
+  ConfigCacheHeader hdr, cached;
+  uint8_t buf[32];
+  FsFile cache;
+
+  if(!cache.open(CONFIG_CACHE_FILE))
+    return false;
+  getCacheHeader(cfg, &hdr);
+  bool stat = false;
+  if(cache.read(&cached, sizeof(cached)) == sizeof(cached) &&
+     cached.magic == hdr.magic && cached.build == hdr.build && cached.size == hdr.size &&
+     cached.cfgSize == hdr.cfgSize && cached.cfgDate == hdr.cfgDate && cached.cfgTime == hdr.cfgTime) {
+    uint16_t crc = 0xFFFF;
+    uint16_t left = sizeof(SMuFFConfig);
+    while(left) {
+      int len = cache.read(buf, left < sizeof(buf) ? left : sizeof(buf));
+      if(len <= 0)
+        break;
+      crc = crc16(buf, len, crc);
+      left -= len;
+    }
+    if(left == 0 && crc == cached.crc && cache.seekSet(sizeof(cached)))
+      stat = cache.read(&smuffConfig, sizeof(SMuFFConfig)) == sizeof(SMuFFConfig);
+  }
+  cache.close();
+  return stat;
+}
+
+/*
+  Saves smuffConfig as snapshot of the config file given.
+*/
+static void saveConfigCache(FsFile* cfg) {
+  ConfigCacheHeader hdr;
+  FsFile cache;
+
+  getCacheHeader(cfg, &hdr);
+  hdr.crc = crc16((uint8_t*)&smuffConfig, sizeof(SMuFFConfig));
+  if(cache.open(CONFIG_CACHE_FILE, O_WRITE | O_CREAT | O_TRUNC)) {
+    cache.write(&hdr, sizeof(hdr));
+    cache.write(&smuffConfig, sizeof(SMuFFConfig));
+    cache.close();
+  }
+}
 
 void readConfig()
 {
-  DynamicJsonDocument jsonDoc(capacity);
-
-  if (!SD.begin()) {
+  if (!mountSD()) {
     drawSDStatus(SD_ERR_INIT);
     delay(5000);
     return;
@@ -47,131 +351,27 @@ void readConfig()
   FsFile cfg;
   if(cfg.open(CONFIG_FILE))
   {
-    if(cfg.fileSize() > capacity) {
-      longBeep(2);
-      showDialog(P_TitleConfigError, P_ConfigFail1, P_ConfigFail3, P_OkButtonOnly);
+    if(loadConfigCache(&cfg)) {
+      configSource = CONFIG_CACHED;
       cfg.close();
       return;
     }
-    
-    auto error = deserializeJson(jsonDoc, cfg);
-    if (error) {
+    drawSDStatus(SD_READING_CONFIG);
+    if(!parseConfig(&cfg)) {
+      configSource = CONFIG_FAILED;
+      SD.remove(CONFIG_CACHE_FILE);
       longBeep(2);
-      __debug(PSTR("deserializeJson() failed with code %s"), error.c_str());
       showDialog(P_TitleConfigError, P_ConfigFail1, P_ConfigFail2, P_OkButtonOnly);
+      resetConfig();          // don't run on a mix of the values parsed up to the error and defaults
+      finishConfig();
     }
     else {
-      const char* selector    = "Selector";
-      const char* revolver    = "Revolver";
-      const char* feeder      = "Feeder";
-      const char* maxSpeed    = "MaxSpeed";
-      const char* maxSpeedHS  = "MaxSpeedHS";
-      const char* acceleration= "Acceleration";
-      const char* invertDir   = "InvertDir";
-      const char* endstopTrig = "EndstopTrigger";
-      const char* stepDelay   = "StepDelay";
-      drawSDStatus(SD_READING_CONFIG);
-      int toolCnt =                     jsonDoc["ToolCount"];
-      smuffConfig.toolCount = (toolCnt > MIN_TOOLS && toolCnt <= MAX_TOOLS) ? toolCnt : 5;
-      smuffConfig.firstToolOffset =     jsonDoc[selector]["Offset"];
-      smuffConfig.toolSpacing =         jsonDoc[selector]["Spacing"];
-      smuffConfig.stepsPerMM_X =        jsonDoc[selector]["StepsPerMillimeter"];
-      smuffConfig.maxSteps_X = ((smuffConfig.toolCount-1)*smuffConfig.toolSpacing+smuffConfig.firstToolOffset) * smuffConfig.stepsPerMM_X;
-      smuffConfig.maxSpeed_X =          jsonDoc[selector][maxSpeed];
-      smuffConfig.acceleration_X =      jsonDoc[selector][acceleration];
-      smuffConfig.invertDir_X =         jsonDoc[selector][invertDir];
-      smuffConfig.endstopTrigger_X =    jsonDoc[selector][endstopTrig];
-      smuffConfig.stepDelay_X =         jsonDoc[selector][stepDelay];
-      smuffConfig.maxSpeedHS_X =        jsonDoc[selector][maxSpeedHS];
-      smuffConfig.stepsPerRevolution_Y= jsonDoc[revolver]["StepsPerRevolution"];
-      smuffConfig.firstRevolverOffset = jsonDoc[revolver]["Offset"];
-      smuffConfig.revolverSpacing =     smuffConfig.stepsPerRevolution_Y / 10;
-      smuffConfig.maxSpeed_Y =          jsonDoc[revolver][maxSpeed];
-      smuffConfig.acceleration_Y =      jsonDoc[revolver][acceleration];
-      smuffConfig.resetBeforeFeed_Y =   jsonDoc[revolver]["ResetBeforeFeed"];
-      smuffConfig.homeAfterFeed =       jsonDoc[revolver]["HomeAfterFeed"];
-      smuffConfig.invertDir_Y =         jsonDoc[revolver][invertDir];
-      smuffConfig.endstopTrigger_Y =    jsonDoc[revolver][endstopTrig];
-      smuffConfig.stepDelay_Y =         jsonDoc[revolver][stepDelay];
-      smuffConfig.maxSpeedHS_Y =        jsonDoc[revolver][maxSpeedHS];
-      smuffConfig.wiggleRevolver =      jsonDoc[revolver]["Wiggle"];
-      smuffConfig.revolverIsServo =     jsonDoc[revolver]["UseServo"];
-      smuffConfig.revolverOffPos =      jsonDoc[revolver]["ServoOffPos"];
-      smuffConfig.revolverOnPos =       jsonDoc[revolver]["ServoOnPos"];
-      smuffConfig.servoCycles =         jsonDoc[revolver]["ServoCycles"];
-
-      smuffConfig.externalControl_Z =   jsonDoc[feeder]["ExternalControl"];
-      smuffConfig.stepsPerMM_Z =        jsonDoc[feeder]["StepsPerMillimeter"];
-      smuffConfig.acceleration_Z =      jsonDoc[feeder][acceleration];
-      smuffConfig.maxSpeed_Z =          jsonDoc[feeder][maxSpeed];
-      smuffConfig.insertSpeed_Z =       jsonDoc[feeder]["InsertSpeed"];
-      if(smuffConfig.insertSpeed_Z > smuffConfig.acceleration_Z)
-        smuffConfig.acceleration_Z = smuffConfig.insertSpeed_Z;
-      smuffConfig.invertDir_Z =         jsonDoc[feeder][invertDir];
-      smuffConfig.endstopTrigger_Z =    jsonDoc[feeder][endstopTrig];
-      smuffConfig.stepDelay_Z =         jsonDoc[feeder][stepDelay];
-      smuffConfig.reinforceLength =     jsonDoc[feeder]["ReinforceLength"];
-      smuffConfig.unloadRetract =       jsonDoc[feeder]["UnloadRetract"];
-      smuffConfig.unloadPushback =      jsonDoc[feeder]["UnloadPushback"];
-      smuffConfig.pushbackDelay =       jsonDoc[feeder]["PushbackDelay"];
-      smuffConfig.enableChunks =        jsonDoc[feeder]["EnableChunks"];
-      smuffConfig.feedChunks =          jsonDoc[feeder]["FeedChunks"];
-      if(smuffConfig.feedChunks == 0)
-        smuffConfig.feedChunks = 20;
-      smuffConfig.insertLength =        jsonDoc[feeder]["InsertLength"];
-      if(smuffConfig.insertLength == 0)
-        smuffConfig.insertLength = 5;
-      smuffConfig.maxSpeedHS_Z =        jsonDoc[feeder][maxSpeedHS];
-      smuffConfig.useDuetLaser =        jsonDoc[feeder]["DuetLaser"];
-
-      int contrast =                    jsonDoc["LCDContrast"];
-      smuffConfig.lcdContrast = (contrast > MIN_CONTRAST && contrast < MAX_CONTRAST) ? contrast : DSP_CONTRAST;
-      smuffConfig.bowdenLength =        jsonDoc["BowdenLength"];
-      smuffConfig.selectorDistance =    jsonDoc["SelectorDist"];
-      int i2cAdr =                      jsonDoc["I2CAddress"];
-      smuffConfig.i2cAddress = (i2cAdr > 0 && i2cAdr < 255) ? i2cAdr : I2C_SLAVE_ADDRESS;
-      smuffConfig.menuAutoClose =       jsonDoc["MenuAutoClose"];
-      smuffConfig.delayBetweenPulses =  jsonDoc["DelayBetweenPulses"];
-      smuffConfig.serial1Baudrate =     jsonDoc["Serial1Baudrate"];
-      smuffConfig.serial2Baudrate =     jsonDoc["Serial2Baudrate"];
-      smuffConfig.serialDueBaudrate =   jsonDoc["SerialDueBaudrate"];
-      smuffConfig.fanSpeed =            jsonDoc["FanSpeed"];
-      smuffConfig.powerSaveTimeout =    jsonDoc["PowerSaveTimeout"];
-      smuffConfig.duetDirect =          jsonDoc["Duet3DDirect"];
-      const char* p =                   jsonDoc["UnloadCommand"];
-      if(p != NULL && strlen(p) > 0) {
-#ifdef __STM32F1__
-        strncpy(smuffConfig.unloadCommand, p, sizeof(smuffConfig.unloadCommand));
-#else
-        strlcpy(smuffConfig.unloadCommand, p, sizeof(smuffConfig.unloadCommand));
-#endif
-      }
-      smuffConfig.prusaMMU2 =           jsonDoc["EmulatePrusa"];
-
-#ifdef __STM32F1__  
-      for(int i=0; i < smuffConfig.toolCount; i++) {
-        char tmp[16];
-        sprintf(tmp,"T%d", i);
-        if(jsonDoc["Material"][tmp] == NULL)
-          sprintf(tmp,"Tool%d", i);
-        memset(smuffConfig.materials[i], 0, sizeof(smuffConfig.materials[i]));
-        strncpy(smuffConfig.materials[i], jsonDoc["Materials"][tmp], sizeof(smuffConfig.materials[i])); 
-      }
-#else
-      for(int i=0; i < smuffConfig.toolCount; i++) {
-        memset(smuffConfig.materials[i], 0, sizeof(smuffConfig.materials[i]));
-      }
-#endif
-      
-      //__debug(PSTR("DONE reading config"));
+      configSource = CONFIG_PARSED;
+      finishConfig();
+      saveConfigCache(&cfg);
     }
-    if(smuffConfig.maxSpeedHS_X == 0)
-      smuffConfig.maxSpeedHS_X = smuffConfig.maxSpeed_X;
-    if(smuffConfig.maxSpeedHS_Y == 0)
-      smuffConfig.maxSpeedHS_Y = smuffConfig.maxSpeed_Y;
-    if(smuffConfig.maxSpeedHS_Z == 0)
-      smuffConfig.maxSpeedHS_Z = smuffConfig.maxSpeed_Z;
     cfg.close();
+    //__debug(PSTR("DONE reading config"));
   }
   else {
     //__debug(PSTR("Open config file failed: handle = %s"), !cfg ? "FALSE" : "TRUE");
@@ -180,103 +380,220 @@ void readConfig()
   }
 }
 
+/*
+  Reads the config file again and applies the values changed to the
+  subsystems using them (see applyConfig()), without a reset.
+  Keys not in the file get their defaults, just like on boot.
+  If the file can't be parsed, the running config is kept as is.
+*/
+bool reloadConfig(int serial) {
+  char tmp[80];
+  FsFile cfg;
+
+  if(!mountSD()) {
+    sprintf_P(tmp, P_SD_InitError);
+    printResponse(tmp, serial);
+    return false;
+  }
+  if(!cfg.open(CONFIG_FILE)) {
+    sprintf_P(tmp, P_SD_NoConfig);
+    printResponse(tmp, serial);
+    return false;
+  }
+  SMuFFConfig* prev = (SMuFFConfig*)malloc(sizeof(SMuFFConfig));
+  if(prev == NULL) {
+    cfg.close();
+    return false;
+  }
+  memcpy(prev, &smuffConfig, sizeof(SMuFFConfig));
+  resetConfig();
+  bool stat = parseConfig(&cfg);
+  if(stat) {
+    finishConfig();
+    saveConfigCache(&cfg);
+    configSource = CONFIG_PARSED;
+    activeProfile[0] = 0;
+    uint8_t changed = applyConfig(prev);
+    sprintf_P(tmp, P_ConfigApplied,
+      (changed & CFG_APPLY_ANY)       ? "yes" : "no",
+      (changed & CFG_APPLY_STEPPERS)  ? "yes" : "no",
+      (changed & CFG_APPLY_SERVOS)    ? "yes" : "no",
+      (changed & CFG_APPLY_FAN)       ? "yes" : "no",
+      (changed & CFG_APPLY_DISPLAY)   ? "yes" : "no",
+      (changed & CFG_APPLY_SERIAL)    ? "yes" : "no");
+  }
+  else {
+    memcpy(&smuffConfig, prev, sizeof(SMuFFConfig));
+    sprintf_P(tmp, P_ConfigNotApplied);
+  }
+  printResponse(tmp, serial);
+  free(prev);
+  cfg.close();
+  return stat;
+}
+
+/*
+  Changes a single setting (M205) and applies it like M501 does.
+  A value out of range doesn't change anything.
+*/
+uint8_t changeSetting(int index, const char* key, const char* value) {
+  SMuFFConfig* prev = (SMuFFConfig*)malloc(sizeof(SMuFFConfig));
+  if(prev == NULL)
+    return CFG_INVALID;
+  memcpy(prev, &smuffConfig, sizeof(SMuFFConfig));
+  uint8_t stat = setConfigValue(index, key, value, false);
+  if(stat == CFG_OK) {
+    finishConfig();
+    applyConfig(prev);
+  }
+  free(prev);
+  return stat;
+}
+
+/*
+  Applies the profile given on top of the config file, or only the
+  config file if name is empty. The config file is loaded from its
+  snapshot if possible, so only the (small) profile needs to be parsed.
+*/
+bool loadProfile(const char* name, int serial) {
+  char tmp[80];
+  FsFile cfg;
+  bool stat = false;
+
+  if(!mountSD()) {
+    sprintf_P(tmp, P_SD_InitError);
+    printResponse(tmp, serial);
+    return false;
+  }
+  SMuFFConfig* prev = (SMuFFConfig*)malloc(sizeof(SMuFFConfig));
+  if(prev == NULL)
+    return false;
+  memcpy(prev, &smuffConfig, sizeof(SMuFFConfig));
+  if(cfg.open(CONFIG_FILE)) {
+    // keys missing in the config file would keep the values of the
+    // profile active if it had to be parsed over the running config
+    stat = loadConfigCache(&cfg);
+    if(!stat) {
+      resetConfig();
+      stat = parseConfig(&cfg);
+    }
+    cfg.close();
+  }
+  if(stat && *name) {
+    sprintf_P(tmp, PSTR("%s/%s%s"), PROFILE_FOLDER, name, PROFILE_EXT);
+    stat = cfg.open(tmp) && parseConfig(&cfg);
+    cfg.close();
+  }
+  if(stat) {
+    finishConfig();
+    strncpy(activeProfile, name, sizeof(activeProfile)-1);
+    activeProfile[sizeof(activeProfile)-1] = 0;
+    uint8_t changed = applyConfig(prev);
+    sprintf_P(tmp, P_ProfileApplied, *name ? name : "-",
+      (changed & CFG_APPLY_ANY)       ? "yes" : "no",
+      (changed & CFG_APPLY_STEPPERS)  ? "yes" : "no");
+  }
+  else {
+    memcpy(&smuffConfig, prev, sizeof(SMuFFConfig));
+    sprintf_P(tmp, P_ProfileFail, name);
+  }
+  printResponse(tmp, serial);
+  free(prev);
+  return stat;
+}
+
+/*
+  Lists the profiles available, the one active is marked with '*'.
+*/
+void printProfiles(int serial) {
+  char tmp[FILE_INDEX_NAME_LEN+4];
+
+  int cnt = indexFiles(PROFILE_FOLDER, PROFILE_EXT);
+  for(int i=0; i < cnt; i++) {
+    const char* name = getIndexedFile(PROFILE_FOLDER, PROFILE_EXT, i);
+    sprintf_P(tmp, PSTR("%c %s\n"), strcmp(name, activeProfile) == 0 ? '*' : ' ', name);
+    printResponse(tmp, serial);
+  }
+}
+
+static void printKey(Print* out, uint8_t level, bool first, const char* key) {
+  out->print(first ? "\n" : ",\n");
+  for(uint8_t i=0; i < level; i++)
+    out->print("  ");
+  out->write('"');
+  out->print(key);
+  out->print("\": ");
+}
+
+/*
+  Writes all the keys of the schema as (pretty printed) JSON.
+*/
+static void printConfig(Print* out) {
+  ConfigKey ck;
+  char key[CFG_KEY_LEN];
+  int8_t section = CFG_SEC_TOP;
+  bool firstTop = true, first = true;
+
+  out->write('{');
+  for(uint8_t i=0; i < configKeyCount; i++) {
+    memcpy_P(&ck, &configKeys[i], sizeof(ConfigKey));
+    if(ck.section != section) {
+      if(section != CFG_SEC_TOP)
+        out->print("\n  }");
+      section = ck.section;
+      getConfigSectionName(section, key);
+      printKey(out, 1, firstTop, key);
+      out->write('{');
+      firstTop = false;
+      first = true;
+    }
+    bool top = section == CFG_SEC_TOP;
+    if(ck.type == CFG_MATERIAL) {
+      for(int tool=0; tool < smuffConfig.toolCount; tool++) {
+        sprintf_P(key, PSTR("T%d"), tool);
+        printKey(out, 2, first, key);
+        printConfigValue(out, i, tool);
+        first = false;
+      }
+      continue;
+    }
+    printKey(out, top ? 1 : 2, top ? firstTop : first, ck.key);
+    printConfigValue(out, i, 0);
+    if(top)
+      firstTop = false;
+    else
+      first = false;
+  }
+  if(section != CFG_SEC_TOP)
+    out->print("\n  }");
+  out->print("\n}\n");
+}
+
 bool writeConfig(Print* dumpTo)
 {
   bool stat = false;
 
-  StaticJsonDocument<capacity> jsonDoc;
   if(dumpTo == NULL) {
-    if(!SD.begin()) {
+    // the values of the profile active must not get into the config file
+    if(activeProfile[0])
+      return false;
+    if(!mountSD()) {
       drawSDStatus(SD_ERR_INIT);
       delay(5000);
       return false;
     }
-  }
-  JsonObject jsonObj = jsonDoc.to<JsonObject>();
-  jsonDoc["Serial1Baudrate"]      = smuffConfig.serial1Baudrate;
-  jsonDoc["Serial2Baudrate"]      = smuffConfig.serial2Baudrate;
-  jsonDoc["SerialDueBaudrate"]    = smuffConfig.serialDueBaudrate;
-  jsonDoc["ToolCount"]            = smuffConfig.toolCount;
-  jsonDoc["BowdenLength"]         = smuffConfig.bowdenLength;
-  jsonDoc["SelectorDist"]         = smuffConfig.selectorDistance;
-  jsonDoc["LCDContrast"]          = smuffConfig.lcdContrast;
-  jsonDoc["I2CAddress"]           = smuffConfig.i2cAddress;
-  jsonDoc["MenuAutoClose"]        = smuffConfig.menuAutoClose;
-  jsonDoc["FanSpeed"]             = smuffConfig.fanSpeed;
-  jsonDoc["DelayBetweenPulses"]   = smuffConfig.delayBetweenPulses;
-  jsonDoc["PowerSaveTimeout"]     = smuffConfig.powerSaveTimeout;
-  jsonDoc["Duet3DDirect"]         = smuffConfig.duetDirect;
-  jsonDoc["EmulatePrusa"]         = smuffConfig.prusaMMU2;
-  jsonDoc["UnloadCommand"]        = smuffConfig.unloadCommand;
-  
-  JsonObject node = jsonObj.createNestedObject("Selector");
-  node["Offset"]              = smuffConfig.firstToolOffset;
-  node["Spacing"]             = smuffConfig.toolSpacing;
-  node["StepsPerMillimeter"]  = smuffConfig.stepsPerMM_X;
-  node["StepDelay"]           = smuffConfig.stepDelay_X;
-  node["MaxSpeed"]            = smuffConfig.maxSpeed_X;
-  node["MaxSpeedHS"]          = smuffConfig.maxSpeedHS_X;
-  node["Acceleration"]        = smuffConfig.acceleration_X;
-  node["InvertDir"]           = smuffConfig.invertDir_X;
-  node["EndstopTrigger"]      = smuffConfig.endstopTrigger_X;
-
-  node = jsonObj.createNestedObject("Revolver");
-  node["Offset"]              = smuffConfig.firstRevolverOffset;
-  node["StepsPerRevolution"]  = smuffConfig.stepsPerRevolution_Y;
-  node["StepDelay"]           = smuffConfig.stepDelay_Y;
-  node["MaxSpeed"]            = smuffConfig.maxSpeed_Y;
-  node["MaxSpeedHS"]          = smuffConfig.maxSpeedHS_Y;
-  node["Acceleration"]        = smuffConfig.acceleration_Y;
-  node["ResetBeforeFeed"]     = smuffConfig.resetBeforeFeed_Y;
-  node["HomeAfterFeed"]       = smuffConfig.homeAfterFeed;
-  node["InvertDir"]           = smuffConfig.invertDir_Y;
-  node["EndstopTrigger"]      = smuffConfig.endstopTrigger_Y;
-  node["Wiggle"]              = smuffConfig.wiggleRevolver;
-  node["UseServo"]            = smuffConfig.revolverIsServo;
-  node["ServoOffPos"]         = smuffConfig.revolverOffPos;
-  node["ServoOnPos"]          = smuffConfig.revolverOnPos;
-  node["ServoCycles"]         = smuffConfig.servoCycles;
-
-  node = jsonObj.createNestedObject("Feeder");
-  node["ExternalControl"]     = smuffConfig.externalControl_Z;
-  node["StepsPerMillimeter"]  = smuffConfig.stepsPerMM_Z;
-  node["StepDelay"]           = smuffConfig.stepDelay_Z;
-  node["MaxSpeed"]            = smuffConfig.maxSpeed_Z;
-  node["MaxSpeedHS"]          = smuffConfig.maxSpeedHS_Z;
-  node["Acceleration"]        = smuffConfig.acceleration_Z;
-  node["InsertSpeed"]         = smuffConfig.insertSpeed_Z;
-  node["InvertDir"]           = smuffConfig.invertDir_Z;
-  node["EndstopTrigger"]      = smuffConfig.endstopTrigger_Z;
-  node["ReinforceLength"]     = smuffConfig.reinforceLength;
-#ifdef __STM32F1__
-  node["UnloadRetract"]       = smuffConfig.unloadRetract;
-  node["UnloadPushback"]      = smuffConfig.unloadPushback;
-  node["PushbackDelay"]       = smuffConfig.pushbackDelay;
-#endif
-  node["EnableChunks"]        = smuffConfig.enableChunks;
-  node["FeedChunks"]          = smuffConfig.feedChunks;
-  node["InsertLength"]        = smuffConfig.insertLength;
-
-#ifdef __STM32F1__  
-  node = jsonObj.createNestedObject("Materials");
-  for(int i=0; i < smuffConfig.toolCount; i++) {
-    char tmp[16];
-    sprintf(tmp,"T%d", i);
-    node[tmp] = smuffConfig.materials[i] != NULL ?  smuffConfig.materials[i] : "";
-  }
-#endif
-
-  if(dumpTo == NULL) {
     FsFile cfg;
     if(cfg.open(CONFIG_FILE, O_WRITE | O_CREAT | O_TRUNC)) {
-      serializeJsonPretty(jsonDoc, cfg);
+      printConfig(&cfg);
+      cfg.sync();
+      saveConfigCache(&cfg);
       stat = true;
     }
     cfg.close();  
   }
   else {
-    serializeJsonPretty(jsonDoc, *dumpTo);
+    printConfig(dumpTo);
     stat = true;
   }
   return stat;
-}
\ No newline at end of file
+}
@@ -0,0 +1,428 @@
+/**
+ * SMuFF Firmware
+ * Copyright (C) 2019 Technik Gegg
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Schema of the configuration file: every key of SMUFF.CFG, its type,
+ * range, default value and the field of smuffConfig it's stored in.
+ * The keys of a section must be kept together, the config file gets
+ * written in the order of this table.
+ */
+
+#include "SMuFF.h"
+#include "ConfigSchema.h"
+
+#define CFG_KEY(section, key, type, field, min, max, def)  { section, type, configHash(key), key, (void*)&smuffConfig.field, min, max, def }
+
+// constexpr, so that the index below can be sorted by the compiler
+constexpr ConfigKey configKeys[] PROGMEM = {
+  CFG_KEY(CFG_SEC_TOP,        "Serial1Baudrate",    CFG_ULONG,  serial1Baudrate,      0,  1000000,  57600),
+  CFG_KEY(CFG_SEC_TOP,        "Serial2Baudrate",    CFG_ULONG,  serial2Baudrate,      0,  1000000,  57600),
+  CFG_KEY(CFG_SEC_TOP,        "SerialDueBaudrate",  CFG_ULONG,  serialDueBaudrate,    0,  1000000,  57600),
+  CFG_KEY(CFG_SEC_TOP,        "ToolCount",          CFG_INT,    toolCount,            MIN_TOOLS+1, MAX_TOOLS, 5),
+  CFG_KEY(CFG_SEC_TOP,        "BowdenLength",       CFG_FLOAT,  bowdenLength,         0,  5000,     400),
+  CFG_KEY(CFG_SEC_TOP,        "SelectorDist",       CFG_FLOAT,  selectorDistance,     0,  500,      23),
+  CFG_KEY(CFG_SEC_TOP,        "LCDContrast",        CFG_INT,    lcdContrast,          MIN_CONTRAST+1, MAX_CONTRAST-1, DSP_CONTRAST),
+  CFG_KEY(CFG_SEC_TOP,        "I2CAddress",         CFG_INT,    i2cAddress,           1,  254,      I2C_SLAVE_ADDRESS),
+  CFG_KEY(CFG_SEC_TOP,        "MenuAutoClose",      CFG_INT,    menuAutoClose,        0,  3600,     20),
+  CFG_KEY(CFG_SEC_TOP,        "FanSpeed",           CFG_INT,    fanSpeed,             0,  100,      0),
+  CFG_KEY(CFG_SEC_TOP,        "DelayBetweenPulses", CFG_BOOL,   delayBetweenPulses,   0,  1,        0),
+  CFG_KEY(CFG_SEC_TOP,        "PowerSaveTimeout",   CFG_LONG,   powerSaveTimeout,     0,  86400,    300),
+  CFG_KEY(CFG_SEC_TOP,        "Duet3DDirect",       CFG_BOOL,   duetDirect,           0,  1,        0),
+  CFG_KEY(CFG_SEC_TOP,        "EmulatePrusa",       CFG_BOOL,   prusaMMU2,            0,  1,        1),
+  CFG_KEY(CFG_SEC_TOP,        "HostSerial",         CFG_INT,    hostSerial,           0,  NUM_SERIALS-1, HOST_SERIAL),
+  CFG_KEY(CFG_SEC_TOP,        "UnloadCommand",      CFG_STRING, unloadCommand,        0,  sizeof(smuffConfig.unloadCommand), 0),
+
+  CFG_KEY(CFG_SEC_SELECTOR,   "Offset",             CFG_FLOAT,  firstToolOffset,      0,  500,      FIRST_TOOL_OFFSET),
+  CFG_KEY(CFG_SEC_SELECTOR,   "Spacing",            CFG_FLOAT,  toolSpacing,          0,  100,      TOOL_SPACING),
+  CFG_KEY(CFG_SEC_SELECTOR,   "StepsPerMillimeter", CFG_LONG,   stepsPerMM_X,         1,  100000,   800),
+  CFG_KEY(CFG_SEC_SELECTOR,   "StepDelay",          CFG_INT,    stepDelay_X,          0,  1000,     10),
+  CFG_KEY(CFG_SEC_SELECTOR,   "MaxSpeed",           CFG_UINT,   maxSpeed_X,           0,  65535,    10),
+  CFG_KEY(CFG_SEC_SELECTOR,   "MaxSpeedHS",         CFG_UINT,   maxSpeedHS_X,         0,  65535,    0),
+  CFG_KEY(CFG_SEC_SELECTOR,   "Acceleration",       CFG_UINT,   acceleration_X,       0,  65535,    510),
+  CFG_KEY(CFG_SEC_SELECTOR,   "InvertDir",          CFG_BOOL,   invertDir_X,          0,  1,        0),
+  CFG_KEY(CFG_SEC_SELECTOR,   "EndstopTrigger",     CFG_INT,    endstopTrigger_X,     0,  1,        HIGH),
+
+  CFG_KEY(CFG_SEC_REVOLVER,   "Offset",             CFG_INT,    firstRevolverOffset,  0,  30000,    FIRST_REVOLVER_OFFSET),
+  CFG_KEY(CFG_SEC_REVOLVER,   "StepsPerRevolution", CFG_LONG,   stepsPerRevolution_Y, 1,  1000000,  9600),
+  CFG_KEY(CFG_SEC_REVOLVER,   "StepDelay",          CFG_INT,    stepDelay_Y,          0,  1000,     10),
+  CFG_KEY(CFG_SEC_REVOLVER,   "MaxSpeed",           CFG_UINT,   maxSpeed_Y,           0,  65535,    800),
+  CFG_KEY(CFG_SEC_REVOLVER,   "MaxSpeedHS",         CFG_UINT,   maxSpeedHS_Y,         0,  65535,    0),
+  CFG_KEY(CFG_SEC_REVOLVER,   "Acceleration",       CFG_UINT,   acceleration_Y,       0,  65535,    2000),
+  CFG_KEY(CFG_SEC_REVOLVER,   "ResetBeforeFeed",    CFG_BOOL,   resetBeforeFeed_Y,    0,  1,        1),
+  CFG_KEY(CFG_SEC_REVOLVER,   "HomeAfterFeed",      CFG_BOOL,   homeAfterFeed,        0,  1,        1),
+  CFG_KEY(CFG_SEC_REVOLVER,   "InvertDir",          CFG_BOOL,   invertDir_Y,          0,  1,        0),
+  CFG_KEY(CFG_SEC_REVOLVER,   "EndstopTrigger",     CFG_INT,    endstopTrigger_Y,     0,  1,        HIGH),
+  CFG_KEY(CFG_SEC_REVOLVER,   "Wiggle",             CFG_BOOL,   wiggleRevolver,       0,  1,        0),
+  CFG_KEY(CFG_SEC_REVOLVER,   "UseServo",           CFG_BOOL,   revolverIsServo,      0,  1,        0),
+  CFG_KEY(CFG_SEC_REVOLVER,   "ServoOffPos",        CFG_INT,    revolverOffPos,       0,  180,      0),
+  CFG_KEY(CFG_SEC_REVOLVER,   "ServoOnPos",         CFG_INT,    revolverOnPos,        0,  180,      90),
+  CFG_KEY(CFG_SEC_REVOLVER,   "ServoCycles",        CFG_INT,    servoCycles,          0,  1000,     0),
+
+  CFG_KEY(CFG_SEC_FEEDER,     "ExternalControl",    CFG_BOOL,   externalControl_Z,    0,  1,        0),
+  CFG_KEY(CFG_SEC_FEEDER,     "StepsPerMillimeter", CFG_LONG,   stepsPerMM_Z,         1,  100000,   136),
+  CFG_KEY(CFG_SEC_FEEDER,     "StepDelay",          CFG_INT,    stepDelay_Z,          0,  1000,     10),
+  CFG_KEY(CFG_SEC_FEEDER,     "MaxSpeed",           CFG_UINT,   maxSpeed_Z,           0,  65535,    10),
+  CFG_KEY(CFG_SEC_FEEDER,     "MaxSpeedHS",         CFG_UINT,   maxSpeedHS_Z,         0,  65535,    0),
+  CFG_KEY(CFG_SEC_FEEDER,     "Acceleration",       CFG_UINT,   acceleration_Z,       0,  65535,    300),
+  CFG_KEY(CFG_SEC_FEEDER,     "InsertSpeed",        CFG_UINT,   insertSpeed_Z,        0,  65535,    1000),
+  CFG_KEY(CFG_SEC_FEEDER,     "InvertDir",          CFG_BOOL,   invertDir_Z,          0,  1,        0),
+  CFG_KEY(CFG_SEC_FEEDER,     "EndstopTrigger",     CFG_INT,    endstopTrigger_Z,     0,  1,        LOW),
+  CFG_KEY(CFG_SEC_FEEDER,     "ReinforceLength",    CFG_FLOAT,  reinforceLength,      0,  100,      3),
+  CFG_KEY(CFG_SEC_FEEDER,     "UnloadRetract",      CFG_FLOAT,  unloadRetract,        -1000, 1000,  -20),
+  CFG_KEY(CFG_SEC_FEEDER,     "UnloadPushback",     CFG_FLOAT,  unloadPushback,       -1000, 1000,  5),
+  CFG_KEY(CFG_SEC_FEEDER,     "PushbackDelay",      CFG_FLOAT,  pushbackDelay,        0,  60,       1.5),
+  CFG_KEY(CFG_SEC_FEEDER,     "EnableChunks",       CFG_BOOL,   enableChunks,         0,  1,        0),
+  CFG_KEY(CFG_SEC_FEEDER,     "FeedChunks",         CFG_INT,    feedChunks,           1,  1000,     20),
+  CFG_KEY(CFG_SEC_FEEDER,     "InsertLength",       CFG_FLOAT,  insertLength,         0.01, 1000,   5),
+  CFG_KEY(CFG_SEC_FEEDER,     "DuetLaser",          CFG_BOOL,   useDuetLaser,         0,  1,        0),
+
+  CFG_KEY(CFG_SEC_MATERIALS,  "T",                  CFG_MATERIAL, materials,          0,  sizeof(smuffConfig.materials[0]), 0),
+};
+
+#define CFG_KEY_COUNT   (sizeof(configKeys)/sizeof(ConfigKey))
+
+const uint8_t configKeyCount = CFG_KEY_COUNT;
+
+/*
+  Index of the schema sorted by the hashes of the keys (keys with the
+  same hash in the order of the schema), for the binary search in
+  findConfigKey(). It's computed by the compiler and stored in flash.
+*/
+typedef struct {
+  uint8_t entry[CFG_KEY_COUNT];
+} ConfigKeyIndex;
+
+constexpr bool isSortedBefore(uint8_t a, uint8_t b) {
+  return configKeys[a].hash < configKeys[b].hash || (configKeys[a].hash == configKeys[b].hash && a < b);
+}
+// position of schema entry i in the index
+constexpr uint8_t getIndexPos(uint8_t i, uint8_t j = 0) {
+  return j == CFG_KEY_COUNT ? 0 : isSortedBefore(j, i) + getIndexPos(i, j+1);
+}
+// schema entry at position pos of the index
+constexpr uint8_t getIndexEntry(uint8_t pos, uint8_t i = 0) {
+  return getIndexPos(i) == pos ? i : getIndexEntry(pos, i+1);
+}
+
+template<uint8_t... Pos> struct IndexList {};
+template<uint8_t N, uint8_t... Pos> struct MakeIndexList : MakeIndexList<N-1, N-1, Pos...> {};
+template<uint8_t... Pos> struct MakeIndexList<0, Pos...> { typedef IndexList<Pos...> type; };
+
+template<uint8_t... Pos> constexpr ConfigKeyIndex makeKeyIndex(IndexList<Pos...>) {
+  return {{ getIndexEntry(Pos)... }};
+}
+
+static const ConfigKeyIndex configKeyIndex PROGMEM = makeKeyIndex(MakeIndexList<CFG_KEY_COUNT>::type());
+
+static uint8_t getKeyIndexEntry(uint8_t pos) {
+  return pgm_read_byte(&configKeyIndex.entry[pos]);
+}
+
+static const char sectionNames[CFG_SECTIONS][CFG_KEY_LEN] PROGMEM = {
+  "", "Selector", "Revolver", "Feeder", "Materials"
+};
+
+int8_t findConfigSection(const char* name) {
+  for(uint8_t i=CFG_SEC_TOP+1; i < CFG_SECTIONS; i++) {
+    if(strcmp_P(name, sectionNames[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+void getConfigSectionName(uint8_t section, char* name) {
+  strcpy_P(name, sectionNames[section < CFG_SECTIONS ? section : (uint8_t)CFG_SEC_TOP]);
+}
+
+/*
+  Returns the tool number of a material key (T0..Tn or Tool0..Tooln)
+  or -1 if it's not a valid material key.
+*/
+static int getMaterialIndex(const char* key) {
+  if(*key++ != 'T')
+    return -1;
+  if(strncmp_P(key, PSTR("ool"), 3) == 0)
+    key += 3;
+  if(!isdigit(*key))
+    return -1;
+  char* end;
+  long tool = strtol(key, &end, 10);
+  return (*end == 0 && tool < MAX_TOOLS) ? (int)tool : -1;
+}
+
+/*
+  Returns the index of the key in the schema, or -1 if there's no such key.
+  The keys with a matching hash are looked up in the sorted index by
+  binary search; only those get compared.
+  If section is CFG_SECTIONS, the key is looked up in all sections but
+  must be unique then.
+*/
+int findConfigKey(uint8_t section, const char* key) {
+  if(section == CFG_SEC_MATERIALS) {
+    // T0..Tn (Tool0..Tooln) are all stored in the material key "T"
+    if(getMaterialIndex(key) == -1)
+      return -1;
+    key = "T";
+  }
+  uint16_t hash = configHash(key);
+  uint8_t lo = 0, hi = CFG_KEY_COUNT;
+  while(lo < hi) {
+    uint8_t mid = (lo + hi) / 2;
+    if(pgm_read_word(&configKeys[getKeyIndexEntry(mid)].hash) < hash)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  int found = -1;
+  for(; lo < CFG_KEY_COUNT; lo++) {
+    uint8_t i = getKeyIndexEntry(lo);
+    if(pgm_read_word(&configKeys[i].hash) != hash)
+      break;
+    uint8_t sec = pgm_read_byte(&configKeys[i].section);
+    // materials are never found without their section
+    if(section == CFG_SECTIONS ? sec == CFG_SEC_MATERIALS : sec != section)
+      continue;
+    if(strcmp_P(key, configKeys[i].key) != 0)
+      continue;
+    if(section != CFG_SECTIONS)
+      return i;
+    if(found != -1)
+      return -1;                    // ambiguous
+    found = i;
+  }
+  return found;
+}
+
+/*
+  Former names of settings (M205), mapped to the "Section.Key" names.
+*/
+typedef struct {
+  char  alias[CFG_KEY_LEN];
+  char  name[CFG_KEY_LEN*2];
+} SettingAlias;
+
+static const SettingAlias settingAliases[] PROGMEM = {
+  { "ServoOpened",      "Revolver.ServoOffPos" },
+  { "ServoClosed",      "Revolver.ServoOnPos" },
+};
+
+/*
+  Returns the index in the schema of the setting named "Section.Key" or
+  "Key" (which must be unique), or -1 if there's no such setting.
+  The key part of the name is returned in key.
+*/
+int findSetting(const char* name, const char** key) {
+  char sect[CFG_KEY_LEN];
+
+  for(uint8_t i=0; i < sizeof(settingAliases)/sizeof(settingAliases[0]); i++) {
+    if(strcmp_P(name, settingAliases[i].alias) == 0) {
+      // the alias table is in flash, hence the name gets resolved as static copy
+      static char aliasName[CFG_KEY_LEN*2];
+      strcpy_P(aliasName, settingAliases[i].name);
+      name = aliasName;
+      break;
+    }
+  }
+  const char* dot = strchr(name, '.');
+  *key = name;
+  if(dot == NULL)
+    return findConfigKey(CFG_SECTIONS, name);
+  if(dot - name >= CFG_KEY_LEN)
+    return -1;
+  memcpy(sect, name, dot - name);
+  sect[dot - name] = 0;
+  int8_t section = findConfigSection(sect);
+  if(section == -1)
+    return -1;
+  *key = dot+1;
+  return findConfigKey(section, dot+1);
+}
+
+static void storeValue(ConfigKey* ck, long lval, float fval) {
+  switch(ck->type) {
+    case CFG_INT:   *(int*)ck->value = (int)lval; break;
+    case CFG_UINT:  *(unsigned*)ck->value = (unsigned)lval; break;
+    case CFG_LONG:  *(long*)ck->value = lval; break;
+    case CFG_ULONG: *(unsigned long*)ck->value = (unsigned long)lval; break;
+    case CFG_FLOAT: *(float*)ck->value = fval; break;
+    case CFG_BOOL:  *(bool*)ck->value = lval != 0; break;
+  }
+}
+
+/*
+  Returns true if any value of the schema differs between smuffConfig
+  and prev. The values get compared one by one, since the padding
+  bytes of the structs may differ even if nothing has changed.
+*/
+bool isConfigChanged(const SMuFFConfig* prev) {
+  ConfigKey ck;
+
+  for(uint8_t i=0; i < configKeyCount; i++) {
+    memcpy_P(&ck, &configKeys[i], sizeof(ConfigKey));
+    const char* cur = (const char*)ck.value;
+    const char* old = (const char*)prev + (cur - (const char*)&smuffConfig);
+    size_t size = 0;
+    switch(ck.type) {
+      case CFG_INT:   size = sizeof(int); break;
+      case CFG_UINT:  size = sizeof(unsigned); break;
+      case CFG_LONG:  size = sizeof(long); break;
+      case CFG_ULONG: size = sizeof(unsigned long); break;
+      case CFG_FLOAT: size = sizeof(float); break;
+      case CFG_BOOL:  size = sizeof(bool); break;
+      case CFG_STRING:
+        if(strncmp(cur, old, (int)ck.max) != 0)
+          return true;
+        break;
+      case CFG_MATERIAL:
+        for(uint8_t tool=0; tool < MAX_TOOLS; tool++) {
+          if(strncmp(cur + tool*(int)ck.max, old + tool*(int)ck.max, (int)ck.max) != 0)
+            return true;
+        }
+        break;
+    }
+    if(size && memcmp(cur, old, size) != 0)
+      return true;
+  }
+  return false;
+}
+
+/*
+  Converts the value given (as read from the config file) and
+  stores it in the field of the key at index. A value out of range
+  gets replaced by the default or, if useDefault is false, isn't stored.
+*/
+uint8_t setConfigValue(uint8_t index, const char* key, const char* value, bool useDefault) {
+  ConfigKey ck;
+  char* end;
+  long lval;
+  float fval;
+
+  memcpy_P(&ck, &configKeys[index], sizeof(ConfigKey));
+  switch(ck.type) {
+    case CFG_STRING:
+    case CFG_MATERIAL: {
+      char* str = (char*)ck.value;
+      if(ck.type == CFG_MATERIAL)
+        str += getMaterialIndex(key) * (int)ck.max;
+      strncpy(str, value, (int)ck.max-1);
+      str[(int)ck.max-1] = 0;
+      return CFG_OK;
+    }
+  }
+  if(strcmp_P(value, PSTR("true")) == 0)
+    lval = 1, fval = 1;
+  else if(strcmp_P(value, PSTR("false")) == 0 || strcmp_P(value, PSTR("null")) == 0)
+    lval = 0, fval = 0;
+  else if(ck.type == CFG_FLOAT) {
+    fval = strtod(value, &end);
+    if(end == value || *end != 0)
+      return CFG_INVALID;
+    lval = (long)fval;
+  }
+  else {
+    lval = strtol(value, &end, 10);
+    if(end == value || *end != 0)
+      return CFG_INVALID;
+    fval = lval;
+  }
+  // any value other than 0 is true, so bools don't get range checked
+  if(ck.type != CFG_BOOL && (fval < ck.min || fval > ck.max)) {
+    if(useDefault)
+      storeValue(&ck, (long)ck.def, ck.def);
+    return CFG_RANGE;
+  }
+  storeValue(&ck, lval, fval);
+  return CFG_OK;
+}
+
+static void printJsonString(Print* out, const char* str) {
+  out->write('"');
+  for(; *str; str++) {
+    if(*str == '"' || *str == '\\')
+      out->write('\\');
+    if(*str == '\n') {
+      out->print("\\n");
+      continue;
+    }
+    out->write(*str);
+  }
+  out->write('"');
+}
+
+/*
+  Prints the value of the key at index as JSON value. Item is
+  the tool number for materials.
+*/
+void printConfigValue(Print* out, uint8_t index, uint8_t item) {
+  ConfigKey ck;
+  char buf[20];
+
+  memcpy_P(&ck, &configKeys[index], sizeof(ConfigKey));
+  switch(ck.type) {
+    case CFG_INT:     out->print(*(int*)ck.value); break;
+    case CFG_UINT:    out->print(*(unsigned*)ck.value); break;
+    case CFG_LONG:    out->print(*(long*)ck.value); break;
+    case CFG_ULONG:   out->print(*(unsigned long*)ck.value); break;
+    case CFG_BOOL:    out->print(*(bool*)ck.value ? "true" : "false"); break;
+    case CFG_STRING:  printJsonString(out, (char*)ck.value); break;
+    case CFG_MATERIAL:printJsonString(out, (char*)ck.value + item * (int)ck.max); break;
+    case CFG_FLOAT: {
+      fmtFloat(buf, *(float*)ck.value, 3);
+      char* p = buf + strlen(buf) - 1;
+      while(*p == '0')              // strip trailing zeros
+        *p-- = 0;
+      if(*p == '.')
+        *p = 0;
+      out->print(buf);
+      break;
+    }
+  }
+}
+
+/*
+  Prints the settings as "Section.Key=value" lines, all of them
+  or only the one at index.
+*/
+void printSettings(Print* out, int index) {
+  ConfigKey ck;
+  char sect[CFG_KEY_LEN];
+
+  for(uint8_t i=0; i < configKeyCount; i++) {
+    if(index != -1 && i != index)
+      continue;
+    memcpy_P(&ck, &configKeys[i], sizeof(ConfigKey));
+    getConfigSectionName(ck.section, sect);
+    uint8_t items = ck.type == CFG_MATERIAL ? smuffConfig.toolCount : 1;
+    for(uint8_t item=0; item < items; item++) {
+      if(*sect) {
+        out->print(sect);
+        out->write('.');
+      }
+      if(ck.type == CFG_MATERIAL) {
+        out->write('T');
+        out->print(item);
+      }
+      else
+        out->print(ck.key);
+      out->write('=');
+      printConfigValue(out, i, item);
+      out->write('\n');
+    }
+  }
+}
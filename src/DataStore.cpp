@@ -22,36 +22,322 @@
  */
  
 #include "SMuFF.h"
+#include "ZStepperLib.h"
 #include "ArduinoJson.h"
+#if defined(STORE_IN_EEPROM)
+#include <avr/eeprom.h>
+#elif defined(STORE_IN_FLASH)
+#include <flash_stm32.h>
+#endif
 
 DataStore dataStore;
 extern int  swapTools[];
+extern ZStepper steppers[];
 
+/*
+  The data store is kept in a journal of fixed size. Each saveStore() 
+  writes one record into the next slot (wrapping around), so there's no 
+  need to ever compact the journal.
+  recoverStore() replays the valid record with the highest sequence number.
+  The journal is kept in
+  - EEPROM on the AVR (STORE_IN_EEPROM); the slots get written in turn,
+    which spreads the wear over STORE_EEPROM_RECORDS slots
+  - the last flash pages on the STM32 (STORE_IN_FLASH); records get 
+    appended to the page erased last, the next page gets erased when 
+    the current one is full, so the other page always holds the 
+    records written before
+  - a file on the SD-Card otherwise (or if STORE_ON_SD is defined);
+    a save is a single sector write without any FAT update
+  The journal file on the SD-Card is also read to migrate the data store
+  into on-chip memory.
+*/
+static_assert(sizeof(JournalRecord) == 32, "JournalRecord must be 32 bytes");
+
+static FsFile         journal;
+static JournalRecord  lastRecord;           // last record written or recovered
+static uint32_t       journalSeq = 0;       // sequence number of lastRecord, 0 = none
+static bool           storeDirty = false;   // data store has been modified but not written yet
+static unsigned long  storeDirtySince = 0;  // millis() of the first update not written yet
+static unsigned long  storeLastUpdate = 0;  // millis() of the last update
+static unsigned long  storeFailedAt = 0;    // millis() of the last failed write
+static unsigned long  storeRetryDelay = 0;  // ms to wait before the next retry, 0 if the last write succeeded
+static StoreStatistics storeStats;
+
+static bool isValidRecord(JournalRecord* rec) {
+  return rec->magic == JOURNAL_MAGIC && rec->crc == crc16((uint8_t*)rec, offsetof(JournalRecord, crc));
+}
+
+#if !defined(STORE_IN_EEPROM) && !defined(STORE_IN_FLASH)
+/*
+  Opens the journal file, creates it if it doesn't exist or if its 
+  size doesn't match JOURNAL_RECORDS.
+*/
+static bool openJournal() {
+  if(journal.isOpen())
+    return true;
+  if(journal.open(JOURNAL_FILE, O_RDWR)) {
+    if(journal.fileSize() == (uint32_t)JOURNAL_RECORDS * sizeof(JournalRecord))
+      return true;
+    journal.close();
+  }
+  if(!journal.open(JOURNAL_FILE, O_RDWR | O_CREAT | O_TRUNC))
+    return false;
+  JournalRecord empty;
+  memset(&empty, 0, sizeof(empty));
+  for(int i=0; i < JOURNAL_RECORDS; i++) {
+    if(journal.write(&empty, sizeof(empty)) != sizeof(empty)) {
+      journal.close();
+      return false;
+    }
+  }
+  journal.sync();
+  journalSeq = 0;
+  return true;
+}
+#endif
+
+static bool readFileSlot(uint16_t slot, JournalRecord* rec) {
+  return journal.seekSet((uint32_t)slot * sizeof(JournalRecord)) && journal.read(rec, sizeof(JournalRecord)) == sizeof(JournalRecord);
+}
+
+/*
+  Closes the journal file without writing, since the card it was opened
+  on is gone. It gets opened (or created) again on the next write.
+*/
+void releaseStore() {
+  if(journal.isOpen())
+    journal.close();
+}
+
+#if defined(STORE_IN_EEPROM)
+
+#define JOURNAL_SLOTS   STORE_EEPROM_RECORDS
+
+static bool readSlot(uint16_t slot, JournalRecord* rec) {
+  eeprom_read_block(rec, (const void*)(STORE_EEPROM_OFFSET + slot * sizeof(JournalRecord)), sizeof(JournalRecord));
+  return true;
+}
+
+/*
+  Only the bytes changed get written (each one takes about 3.4 ms), 
+  the record is read back to verify it.
+*/
+static bool writeSlot(uint16_t slot, JournalRecord* rec) {
+  JournalRecord check;
+  eeprom_update_block(rec, (void*)(STORE_EEPROM_OFFSET + slot * sizeof(JournalRecord)), sizeof(JournalRecord));
+  readSlot(slot, &check);
+  return memcmp(rec, &check, sizeof(JournalRecord)) == 0;
+}
+
+#elif defined(STORE_IN_FLASH)
+
+#define JOURNAL_SLOTS   (STORE_FLASH_PAGES * STORE_FLASH_PAGE_SIZE / sizeof(JournalRecord))
+#define SLOTS_PER_PAGE  (STORE_FLASH_PAGE_SIZE / sizeof(JournalRecord))
+
+// the image must not grow into the journal; platformio.ini limits its size accordingly
+static_assert(STORE_FLASH_BASE + STORE_FLASH_PAGES * STORE_FLASH_PAGE_SIZE == STORE_FLASH_END,
+              "journal must occupy the last flash pages, see board_upload.maximum_size");
+
+static bool readSlot(uint16_t slot, JournalRecord* rec) {
+  memcpy(rec, (const void*)(STORE_FLASH_BASE + slot * sizeof(JournalRecord)), sizeof(JournalRecord));
+  return true;
+}
+
+static bool isBlankSlot(uint16_t slot) {
+  const uint16_t* p = (const uint16_t*)(STORE_FLASH_BASE + slot * sizeof(JournalRecord));
+  for(uint8_t i=0; i < sizeof(JournalRecord)/2; i++) {
+    if(p[i] != 0xFFFF)
+      return false;
+  }
+  return true;
+}
+
+/*
+  Programs the record into the slot. The page gets erased first if the
+  slot is its first one; slots left programmed by a failed write get
+  skipped (see getNextSeq()), so the newer records in the page are kept.
+  The CRC is programmed last, so a record written partially is invalid.
+*/
+static bool writeSlot(uint16_t slot, JournalRecord* rec) {
+  uint32_t addr = STORE_FLASH_BASE + slot * sizeof(JournalRecord);
+  const uint16_t* data = (const uint16_t*)rec;
+  bool stat = true;
+
+  FLASH_Unlock();
+  if(slot % SLOTS_PER_PAGE == 0)
+    stat = FLASH_ErasePage(STORE_FLASH_BASE + (slot / SLOTS_PER_PAGE) * STORE_FLASH_PAGE_SIZE) == FLASH_COMPLETE;
+  for(uint8_t i=0; stat && i < sizeof(JournalRecord)/2; i++)
+    stat = FLASH_ProgramHalfWord(addr + i*2, data[i]) == FLASH_COMPLETE;
+  FLASH_Lock();
+  return stat && memcmp(rec, (const void*)addr, sizeof(JournalRecord)) == 0;
+}
+
+/*
+  Erases the journal pages, so that none of the slots needs to be
+  erased out of turn later on.
+*/
+static void formatJournal() {
+  FLASH_Unlock();
+  for(uint8_t i=0; i < STORE_FLASH_PAGES; i++)
+    FLASH_ErasePage(STORE_FLASH_BASE + i * STORE_FLASH_PAGE_SIZE);
+  FLASH_Lock();
+}
+
+#else
+
+#define JOURNAL_SLOTS   JOURNAL_RECORDS
+
+static bool readSlot(uint16_t slot, JournalRecord* rec) {
+  return openJournal() && readFileSlot(slot, rec);
+}
+
+static bool writeSlot(uint16_t slot, JournalRecord* rec) {
+  if(!mountSD() || !openJournal())
+    return false;
+  if(!journal.seekSet((uint32_t)slot * sizeof(JournalRecord)) ||
+     journal.write(rec, sizeof(JournalRecord)) != sizeof(JournalRecord) ||
+     !journal.sync()) {
+    journal.close();          // gets reopened on the next write
+    return false;
+  }
+  return true;
+}
+
+#endif
+
+/*
+  Returns the sequence number of the next record. In flash, slots left
+  programmed by a failed write can't be programmed again before their
+  page gets erased in turn, so they're skipped.
+*/
+static uint32_t getNextSeq() {
+  uint32_t seq = journalSeq + 1;
+#if defined(STORE_IN_FLASH)
+  while(seq % SLOTS_PER_PAGE != 0 && !isBlankSlot(seq % JOURNAL_SLOTS))
+    seq++;
+#endif
+  return seq;
+}
+
+/*
+  Returns true if the next record needs a flash page to be erased, which
+  stalls the CPU and all interrupts (serial input as well) for 20-40 ms.
+*/
+static bool needsErase() {
+#if defined(STORE_IN_FLASH)
+  return getNextSeq() % SLOTS_PER_PAGE == 0;
+#else
+  return false;
+#endif
+}
+
+/*
+  Writes the current state as the next record of the journal.
+  Returns false if the journal couldn't be written.
+*/
+static bool writeStore() {
+    JournalRecord rec;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = JOURNAL_MAGIC;
+    rec.tool = dataStore.tool;
+    for(int i=0; i < NUM_STEPPERS; i++)
+      rec.stepperPos[i] = dataStore.stepperPos[i];
+    for(int i=0; i < MAX_TOOLS; i++)
+      rec.swapTools[i] = swapTools[i];
+    // skip the write if nothing has changed since the last record
+    if(journalSeq > 0 && memcmp((uint8_t*)&rec + sizeof(rec.seq), (uint8_t*)&lastRecord + sizeof(rec.seq), offsetof(JournalRecord, crc) - sizeof(rec.seq)) == 0) {
+      storeStats.unchanged++;
+      return true;
+    }
+    rec.seq = getNextSeq();
+    rec.crc = crc16((uint8_t*)&rec, offsetof(JournalRecord, crc));
+    if(!writeSlot(rec.seq % JOURNAL_SLOTS, &rec))
+      return false;
+    memcpy(&lastRecord, &rec, sizeof(rec));
+    journalSeq = rec.seq;
+    storeStats.flushes++;
+    return true;
+}
+
+/*
+  Write-behind:
+  saveStore() only marks the data store as modified. Updates coming in
+  quick succession (as in a tool change) get merged and written as one 
+  record by serviceStore(), once there were no updates for 
+  STORE_FLUSH_DELAY ms and the unit is idle (or at the latest after
+  STORE_FLUSH_MAX ms), or by flushStore() before operations which may 
+  end in a reset or power off.
+  Each record is a complete snapshot of the state and records are written
+  in sequence only, so after a power fail the unit always recovers the 
+  last state flushed completely; never a mix of older and newer values.
+*/
 void saveStore() {
-    StaticJsonDocument<512> jsonDoc;
-    JsonObject jsonObj = jsonDoc.to<JsonObject>();
-
-    jsonDoc["Tool"] = dataStore.tool;
-    JsonObject positions = jsonObj.createNestedObject("Positions");
-    positions["Selector"] = dataStore.stepperPos[SELECTOR];
-    positions["Revolver"] = dataStore.stepperPos[REVOLVER];
-    positions["Feeder"] = dataStore.stepperPos[FEEDER];
-    JsonObject swaps = jsonObj.createNestedObject("SwapTools");
-    char tmp[16];
-    for(int i=0; i < MAX_TOOLS; i++) {
-      sprintf(tmp,"T%d", i);
-      swaps[tmp] = swapTools[i];
+    unsigned long now = millis();
+    if(!storeDirty)
+      storeDirtySince = now;
+    storeDirty = true;
+    storeLastUpdate = now;
+    storeStats.updates++;
+}
+
+void flushStore() {
+    if(!storeDirty)
+      return;
+    unsigned long start = micros();
+    storeDirty = false;
+    if(!writeStore()) {
+      storeStats.failed++;
+      storeDirty = true;        // try again later, it's not a new update
+      // back off, so a missing card or a worn out cell doesn't get hammered on each loop
+      storeFailedAt = millis();
+      storeRetryDelay = storeRetryDelay == 0 ? STORE_FLUSH_DELAY : storeRetryDelay*2;
+      if(storeRetryDelay > STORE_RETRY_MAX)
+        storeRetryDelay = STORE_RETRY_MAX;
+      return;
     }
+    storeRetryDelay = 0;
+    storeStats.lastFlush = micros() - start;
+    if(storeStats.lastFlush > storeStats.maxFlush)
+      storeStats.maxFlush = storeStats.lastFlush;
+}
 
-    FsFile cfg;
-    if(cfg.open(DATASTORE_FILE, O_WRITE | O_CREAT | O_TRUNC)) {
-        serializeJsonPretty(jsonDoc, cfg);
+void serviceStore() {
+    if(!storeDirty)
+      return;
+    unsigned long now = millis();
+    if(storeRetryDelay > 0 && now - storeFailedAt < storeRetryDelay)
+      return;
+    // forced even while busy, but a page erase has to wait until the unit is idle
+    if(now - storeDirtySince >= STORE_FLUSH_MAX && !needsErase()) {
+      flushStore();
+      return;
+    }
+    if(now - storeLastUpdate < STORE_FLUSH_DELAY || parserBusy)
+      return;
+    for(int i=0; i < NUM_STEPPERS; i++) {
+      if(!steppers[i].getMovementDone())
+        return;
     }
-    cfg.close();  
+    flushStore();
 }
 
-void recoverStore() {
+void printStoreStatistics(int serial) {
+    char tmp[128];
+    sprintf_P(tmp, P_StoreStatistics, storeStats.updates, storeStats.flushes, storeStats.unchanged, storeStats.failed, storeDirty ? 1 : 0, storeStats.lastFlush, storeStats.maxFlush);
+    printResponse(tmp, serial);
+}
+
+void resetStoreStatistics() {
+    memset(&storeStats, 0, sizeof(storeStats));
+}
+
+/*
+  Reads the former JSON data store (EEPROM.DAT).
+*/
+static bool recoverStoreJson() {
     StaticJsonDocument<512> jsonDoc;
+    bool stat = false;
     
     FsFile cfg;
     if (!cfg.open(DATASTORE_FILE)){
@@ -75,8 +361,65 @@ void recoverStore() {
             swapTools[i] = jsonDoc["SwapTools"][tmp];
           }
         }
+        stat = true;
       }
       cfg.close();
     }
+    return stat;
+}
 
-}
\ No newline at end of file
+/*
+  Finds the valid record with the highest sequence number in the 
+  journal (or in the journal file on the SD-Card if fromFile is set).
+*/
+static bool findLastRecord(bool fromFile) {
+    JournalRecord rec;
+    bool found = false;
+    uint16_t slots = fromFile ? JOURNAL_RECORDS : JOURNAL_SLOTS;
+
+    if(fromFile && !journal.isOpen() && !journal.open(JOURNAL_FILE, O_RDONLY))
+      return false;
+    for(uint16_t slot=0; slot < slots; slot++) {
+      if(!(fromFile ? readFileSlot(slot, &rec) : readSlot(slot, &rec)))
+        break;
+      if(!isValidRecord(&rec))
+        continue;
+      if(!found || rec.seq > lastRecord.seq) {
+        memcpy(&lastRecord, &rec, sizeof(rec));
+        found = true;
+      }
+    }
+    return found;
+}
+
+void recoverStore() {
+    bool found = findLastRecord(false);
+#if defined(STORE_IN_EEPROM) || defined(STORE_IN_FLASH)
+    bool migrate = false;
+    if(!found) {
+#if defined(STORE_IN_FLASH)
+      formatJournal();
+#endif
+      // migrate the journal file written by former versions
+      found = migrate = findLastRecord(true);
+      releaseStore();
+    }
+#endif
+    if(found) {
+      journalSeq = lastRecord.seq;
+      dataStore.tool = lastRecord.tool;
+      for(int i=0; i < NUM_STEPPERS; i++)
+        dataStore.stepperPos[i] = lastRecord.stepperPos[i];
+      for(int i=0; i < MAX_TOOLS; i++)
+        swapTools[i] = lastRecord.swapTools[i];
+#if defined(STORE_IN_EEPROM) || defined(STORE_IN_FLASH)
+      if(migrate) {
+        journalSeq = 0;         // forces the write
+        writeStore();
+      }
+#endif
+    }
+    else if(recoverStoreJson()) {
+      writeStore();     // migrate the JSON data store into the journal
+    }
+}
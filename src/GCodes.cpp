@@ -27,6 +27,7 @@
 #include "ZStepperLib.h"
 #include "ZServo.h"
 #include "GCodes.h"
+#include "ConfigSchema.h"
 #ifdef __STM32F1__
 #include "libmaple/nvic.h"
 #endif
@@ -48,6 +49,7 @@ char* I_Param = (char*)"I";
 char* J_Param = (char*)"J";
 char* K_Param = (char*)"K";
 char* R_Param = (char*)"R";
+char* A_Param = (char*)"A";
 
 GCodeFunctions gCodeFuncsM[] = {
   {   0, dummy },     // used in Prusa Emulation mode to switch to normal mode
@@ -74,6 +76,7 @@ GCodeFunctions gCodeFuncsM[] = {
   { 115, M115 },
   { 117, M117 },
   { 119, M119 },
+  { 155, M155 },
   { 201, M201 },
   { 203, M203 },
   { 205, M205 },
@@ -82,13 +85,20 @@ GCodeFunctions gCodeFuncsM[] = {
   { 280, M280 },
   { 300, M300 },
   { 500, M500 },
+  { 501, M501 },
   { 503, M503 },
   { 575, M575 },
   { 700, M700 },
   { 701, M701 },
+  { 876, M876 },
   { 999, M999 },
   { 2000, M2000 },
   { 2001, M2001 },
+  { 2002, M2002 },
+  { 2003, M2003 },
+  { 2004, M2004 },
+  { 2005, M2005 },
+  { 2006, M2006 },
   { -1, NULL }
 };
 
@@ -139,6 +149,7 @@ bool M18(const char* msg, String buf, int serial) {
       stat = false;
     }
   }
+  flushStore();       // the unit is likely to be turned off next
   return stat;
 }
 
@@ -147,16 +158,10 @@ bool M20(const char* msg, String buf, int serial) {
   if(!getParamString(buf, S_Param, tmp, sizeof(tmp))){
     sprintf(tmp,"/");
   }
-  SdFs SD;
-  Print* out = &Serial;
-  if (SD.begin()) {
-    switch(serial) {
-      case 0: out = &Serial; break;
-      case 1: out = &Serial1; break;
-      case 2: out = &Serial2; break;
-      default: break;
-    }
-    SD.ls(out, LS_DATE | LS_SIZE | LS_R);
+  if (mountSD()) {
+    if(serial < 0 || serial >= NUM_SERIALS)
+      serial = 0;
+    SD.ls(&txBuffer[serial], LS_DATE | LS_SIZE | LS_R);
   }
   else {
     sprintf_P(tmp, P_SD_InitError);
@@ -183,10 +188,24 @@ bool M42(const char* msg, String buf, int serial) {
 bool M98(const char* msg, String buf, int serial) {
   printResponse(msg, serial);
   char cmd[80];
-  if((getParamString(buf, P_Param, cmd, sizeof(cmd)))) {
+  if(!getParamString(buf, P_Param, cmd, sizeof(cmd))) {
+    printMacros(serial);
+    return true;
+  }
+  if(macroExists(cmd)) {
+    MacroParams params;
+    parseMacroParams(buf.c_str(), &params);
+    return runMacro(cmd, &params, serial);
+  }
+  else {
+    // no such macro, run it as test (former behaviour of M98)
+#ifndef HEADLESS
+    uiClose();
+#endif
     showMenu = true;
     testRun(String(cmd));
     showMenu = false;
+    invalidateStatus();
   }
   return true;
 }
@@ -212,9 +231,12 @@ bool M107(const char* msg, String buf, int serial) {
 }
 
 bool M110(const char* msg, String buf, int serial) {
+  long paramL;
   printResponse(msg, serial); 
-  if((param = getParam(buf, N_Param)) != -1) {
-    currentLine = param;
+  if((paramL = getParamL(buf, N_Param)) != -1) {
+    currentLine = paramL;
+    if(serial >= 0 && serial < NUM_SERIALS)
+      lastLineNumber[serial] = paramL;
   }
   return true;
 }
@@ -227,11 +249,12 @@ bool M111(const char* msg, String buf, int serial) {
 }
 
 bool M114(const char* msg, String buf, int serial) {
+  char selector[14], revolver[14], feeder[14];
   printResponse(msg, serial); 
   sprintf_P(tmp, P_Positions, 
-  String(steppers[SELECTOR].getStepPositionMM()).c_str(),
-  String(steppers[REVOLVER].getStepPosition()).c_str(),
-  String(steppers[FEEDER].getStepPositionMM()).c_str());
+  fmtMM(selector, steppers[SELECTOR].getStepPosition(), steppers[SELECTOR].getStepsPerMM()),
+  fmtInt(revolver, steppers[REVOLVER].getStepPosition()),
+  fmtMM(feeder, steppers[FEEDER].getStepPosition(), steppers[FEEDER].getStepsPerMM()));
   printResponse(tmp, serial); 
   return true;
 }
@@ -259,6 +282,15 @@ bool M119(const char* msg, String buf, int serial) {
   return true;
 }
 
+bool M155(const char* msg, String buf, int serial) {
+  printResponse(msg, serial); 
+  if((param = getParam(buf, S_Param)) != -1) {
+    setStatusReport(serial, param);
+  }
+  printStatusReport(serial);
+  return true;
+}
+
 bool M201(const char* msg, String buf, int serial) {
   bool stat = true;
   printResponse(msg, serial); 
@@ -350,48 +382,42 @@ bool M203(const char* msg, String buf, int serial) {
 }
 
 bool M205(const char* msg, String buf, int serial) {
-  bool stat = true;
+  char name[CFG_KEY_LEN*2];
+  char value[CFG_VALUE_LEN];
+  const char* key;
   printResponse(msg, serial); 
-  if(buf.length()==0) {
-    //printAdvancedSettings(serial);
-    return stat;
+  if(serial < 0 || serial >= NUM_SERIALS)
+    serial = 0;
+  if(!getParamString(buf, P_Param, name, sizeof(name))) {
+    printSettings(&txBuffer[serial]);
+    return true;
+  }
+  int index = findSetting(name, &key);
+  if(index == -1) {
+    sprintf_P(tmp, P_UnknownSetting, name);
+    printResponse(tmp, serial);
+    return false;
   }
-  char cmd[80];
-  if((param = getParamString(buf, P_Param, cmd, sizeof(cmd)))  != -1) {
-    if((param = getParam(buf, S_Param)) != -1) {
-      if(strcmp_P(cmd, PSTR("BowdenLength"))==0) {
-        smuffConfig.bowdenLength = param;
-      }
-      else if(strcmp_P(cmd, PSTR("InsertLength"))==0) {
-        smuffConfig.insertLength = param;
-      }
-      else if(strcmp_P(cmd, PSTR("ReinforceLength"))==0) {
-        smuffConfig.reinforceLength = param;
-      }
-      else if(strcmp_P(cmd, PSTR("SelectorDist"))==0) {
-        smuffConfig.selectorDistance = param;
-      }
-      else if(strcmp_P(cmd, PSTR("HomeAfterFeed"))==0) {
-        smuffConfig.homeAfterFeed = (param > 0);
-      }
-      else if(strcmp_P(cmd, PSTR("ResetBeforeFeed"))==0) {
-        smuffConfig.resetBeforeFeed_Y = (param > 0);
-      }
-      else if(strcmp_P(cmd, PSTR("EmulatePrusa"))==0) {
-        smuffConfig.prusaMMU2 = (param > 0);
-      }
-      else if(strcmp_P(cmd, PSTR("UseServo"))==0) {
-        smuffConfig.revolverIsServo = (param > 0);
-      }
-      else if(strcmp_P(cmd, PSTR("ServoOpened"))==0) {
-        smuffConfig.revolverOffPos = param;
-      }
-      else if(strcmp_P(cmd, PSTR("ServoClosed"))==0) {
-        smuffConfig.revolverOnPos = param;
-      }
-    }
+  // the value follows the name, either as S<value> or S"<value>"
+  int pos = buf.indexOf(S_Param, buf.indexOf('"', buf.indexOf('"')+1));
+  if(pos == -1) {
+    printSettings(&txBuffer[serial], index);
+    return true;
   }
-  return stat;
+  String param = buf.substring(pos);
+  if(!getParamString(param, S_Param, value, sizeof(value))) {
+    param = param.substring(1);
+    param.trim();
+    if(param.indexOf(' ') != -1)
+      param = param.substring(0, param.indexOf(' '));
+    param.toCharArray(value, sizeof(value));
+  }
+  uint8_t stat = changeSetting(index, key, value);
+  if(stat != CFG_OK) {
+    sprintf_P(tmp, stat == CFG_RANGE ? P_SettingRange : P_SettingInvalid, name);
+    printResponse(tmp, serial);
+  }
+  return stat == CFG_OK;
 }
 
 bool M206(const char* msg, String buf, int serial) {
@@ -419,7 +445,9 @@ bool M250(const char* msg, String buf, int serial) {
   bool stat = true;
   if((param = getParam(buf, C_Param)) != -1) {
     if(param >= 60 && param < 256) {
+#ifndef HEADLESS
       display.setContrast(param);
+#endif
       smuffConfig.lcdContrast = param;
       printResponse(msg, serial); 
     }
@@ -472,47 +500,65 @@ bool M300(const char* msg, String buf, int serial) {
 
 bool M500(const char* msg, String buf, int serial) {
   printResponse(msg, serial);
+  flushStore();
+  if(activeProfile[0]) {
+    printResponseP(P_ProfileActive, serial);
+    return false;
+  }
   return writeConfig();
 }
 
+bool M501(const char* msg, String buf, int serial) {
+  printResponse(msg, serial);
+  return reloadConfig(serial);
+}
+
 bool M503(const char* msg, String buf, int serial) {
   printResponse(msg, serial);
-  Print *_print = &Serial;
-  switch (serial)
-  {
-      case 0:
-        _print = &Serial;
-        break;
-      case 1:
-        _print = &Serial1;
-        break;
-      case 2:
-        _print = &Serial2;
-        break;
-      default:
-        break;
-    }
-  return writeConfig(_print);
+  if(serial < 0 || serial >= NUM_SERIALS)
+    serial = 0;
+  if(getParamString(buf, P_Param, tmp, sizeof(tmp))) {
+    const char* key;
+    int index = findSetting(tmp, &key);
+    if(index == -1)
+      return false;
+    printSettings(&txBuffer[serial], index);
+    return true;
+  }
+  return writeConfig(&txBuffer[serial]);
 }
 
+/*
+  P is the port as in the configuration: 1 = Serial1Baudrate,
+  2 = Serial2Baudrate, both if not given. On the STM32 port 2 are
+  Serial1 and Serial3 together (they share Serial2Baudrate) and
+  port 1 is the USB port, which has no baudrate.
+*/
 bool M575(const char* msg, String buf, int serial) {
   bool stat = true;
   long paramL;
   int port = -1;
   printResponse(msg, serial);
   if((param = getParam(buf, P_Param)) != -1) {
+    if(param != 1 && param != 2)
+      return false;
     port = param;
   }
-  if((paramL = getParamL(buf, S_Param)) != -1) {
-    if(port != -1) {
-      switch(port) {
-        case 1: smuffConfig.serial1Baudrate = paramL; break;
-        case 2: smuffConfig.serial2Baudrate = paramL; break;
-      }
-    }
-    else {
+  if(getParam(buf, A_Param) == 1) {
+    if(port != 2)
+      startAutobaud(1);
+    if(port != 1)
+      startAutobaud(2);
+  }
+  else if((paramL = getParamL(buf, S_Param)) != -1) {
+    // the new rate gets applied as soon as the response has been sent
+    if(port != 2) {
       smuffConfig.serial1Baudrate = paramL;
+      requestBaudrate(1, paramL);
+    }
+    if(port != 1) {
       smuffConfig.serial2Baudrate = paramL;
+      requestBaudrate(2, paramL);
     }
   }
   else 
@@ -538,8 +584,18 @@ bool M701(const char* msg, String buf, int serial) {
   return unloadFilament();
 }
 
+bool M876(const char* msg, String buf, int serial) {
+  printResponse(msg, serial); 
+  if((param = getParam(buf, S_Param)) == -1)
+    return false;
+  promptResponse = param;
+  return true;
+}
+
 bool M999(const char* msg, String buf, int serial) {
   printResponse(msg, serial); 
+  flushStore();
+  drainTxBuffers();
   delay(500); 
 #ifndef __STM32F1__
   __asm__ volatile ("jmp 0x0000"); 
@@ -605,6 +661,55 @@ bool M2001(const char* msg, String buf, int serial) {
   return true;
 }
 
+bool M2002(const char* msg, String buf, int serial) {
+  printResponse(msg, serial); 
+  printSerialStatistics(serial);
+  if(getParam(buf, R_Param) != -1) {
+    for(int i=0; i < NUM_SERIALS; i++) {
+      txBuffer[i].resetStats();
+      rxBuffer[i].resetStats();
+    }
+  }
+  return true;
+}
+
+bool M2003(const char* msg, String buf, int serial) {
+  printResponse(msg, serial); 
+  if((param = getParam(buf, S_Param)) != -1) {
+    showDiagnostics = param == 1;
+    invalidateStatus();
+  }
+  printDiagnostics(serial);
+  return true;
+}
+
+bool M2004(const char* msg, String buf, int serial) {
+  printResponse(msg, serial); 
+  if(getParam(buf, F_Param) != -1)
+    flushStore();
+  printStoreStatistics(serial);
+  if(getParam(buf, R_Param) != -1)
+    resetStoreStatistics();
+  return true;
+}
+
+bool M2005(const char* msg, String buf, int serial) {
+  printResponse(msg, serial); 
+  printBootTimes(serial);
+  return true;
+}
+
+bool M2006(const char* msg, String buf, int serial) {
+  char name[FILE_INDEX_NAME_LEN];
+  printResponse(msg, serial); 
+  if(getParamString(buf, P_Param, name, sizeof(name)))
+    return loadProfile(name, serial);
+  if(hasParam(buf, R_Param) != -1)
+    return loadProfile("", serial);
+  printProfiles(serial);
+  return true;
+}
+
 /*========================================================
  * Class G
  ========================================================*/
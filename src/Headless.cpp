@@ -0,0 +1,165 @@
+/**
+ * SMuFF Firmware
+ * Copyright (C) 2019 Technik Gegg
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+  User interface replacements for the headless build (HEADLESS), which
+  comes without display, encoder and menus.
+  User messages are sent to the host as action notifications and dialogs
+  become host action prompts, which the host answers with M876 S<button>.
+  The state of the unit is reported by M155 (see printStatusReport()).
+*/
+#ifdef HEADLESS
+
+#include "SMuFF.h"
+
+extern char           tmp[];
+extern bool           isWarning;
+
+bool hostPromptPending = false;     // a dialog is waiting for M876
+
+void setupDisplay() {}
+void drawLogo() {}
+void drawStatus() {}
+void drawFeed() {}
+void drawDiagnostics() {}
+void drawSelectingMessage(int tool) {}
+void drawTestrunMessage(unsigned long loop, char* msg) {}
+
+void resetDisplay() {
+  invalidateStatus();
+}
+
+/*
+  Sends the given text (which may contain line breaks) as
+  one line of the action command given.
+*/
+static void sendHostAction(PGM_P action, const char* text) {
+  char line[MAX_LINE_LENGTH+1];
+  int len;
+
+  sprintf_P(line, action);
+  len = strlen(line);
+  while(*text && len < MAX_LINE_LENGTH-1) {
+    if(*text == '\n') {
+      if(line[len-1] != ' ')
+        line[len++] = ' ';
+    }
+    else
+      line[len++] = *text;
+    text++;
+  }
+  line[len++] = '\n';
+  line[len] = 0;
+  printResponse(line, smuffConfig.hostSerial);
+}
+
+void drawUserMessage(String message) {
+  sendHostAction(P_ActionNotification, message.c_str());
+  displayingUserMessage = true;
+  userMessageTime = millis();
+}
+
+void drawUserMessageP(PGM_P message, PGM_P addMessage) {
+  char msg[MAX_LINE_LENGTH];
+
+  strncpy_P(msg, message, sizeof(msg)-1);
+  msg[sizeof(msg)-1] = 0;
+  if(addMessage != NULL) {
+    int len = strlen(msg);
+    if(len > 0 && msg[len-1] != '\n' && len < (int)sizeof(msg)-1)
+      msg[len++] = '\n';
+    strncpy_P(msg+len, addMessage, sizeof(msg)-len-1);
+  }
+  drawUserMessage(String(msg));
+}
+
+void drawSDStatus(int stat) {
+  switch(stat) {
+    case SD_ERR_INIT:
+      sprintf_P(tmp, P_SD_InitError);
+      longBeep(2);
+      break;
+    case SD_ERR_NOCONFIG:
+      sprintf_P(tmp, P_SD_NoConfig);
+      longBeep(1);
+      break;
+    case SD_READING_CONFIG:
+      sprintf_P(tmp, P_SD_ReadingConfig);
+      break;
+  }
+  sendHostAction(P_ActionNotification, tmp);
+}
+
+/*
+  Sends a dialog as host action prompt, the buttons are
+  numbered from 0 in the order they appear in buttons.
+*/
+void beginHostPrompt(PGM_P title, PGM_P message, PGM_P addMessage, PGM_P buttons) {
+  char msg[MAX_LINE_LENGTH];
+  char btn[40];
+  char* btns[4];
+
+  printResponseP(P_ActionPromptEnd, smuffConfig.hostSerial);
+  memset(msg, 0, sizeof(msg));
+  strncpy_P(msg, title, sizeof(msg)-3);
+  strcat(msg, ": ");
+  int len = strlen(msg);
+  strncpy_P(msg+len, message, sizeof(msg)-len-2);
+  len = strlen(msg);
+  msg[len++] = ' ';
+  strncpy_P(msg+len, addMessage, sizeof(msg)-len-1);
+  sendHostAction(P_ActionPromptBegin, msg);
+  strncpy_P(btn, buttons, sizeof(btn)-1);
+  btn[sizeof(btn)-1] = 0;
+  int cnt = splitStringLines(btns, 4, btn);
+  for(int i=0; i < cnt; i++) {
+    String label = String(btns[i]);
+    label.trim();
+    sendHostAction(P_ActionPromptButton, label.c_str());
+  }
+  printResponseP(P_ActionPromptShow, smuffConfig.hostSerial);
+  promptResponse = -1;
+}
+
+void endHostPrompt() {
+  printResponseP(P_ActionPromptEnd, smuffConfig.hostSerial);
+}
+
+/*
+  Headless replacement of the display dialog. Waits for the host to
+  answer with M876 (closes automatically after menuAutoClose seconds
+  like the display dialog does, unless it's a warning).
+  Returns the button number (1..n) or 0 if closed automatically.
+*/
+int showDialog(PGM_P title, PGM_P message, PGM_P addMessage, PGM_P buttons) {
+  unsigned long startTime = millis();
+
+  beginHostPrompt(title, message, addMessage, buttons);
+  hostPromptPending = true;
+  while(promptResponse == -1) {
+    checkSerialPending();
+    if(!isWarning && millis() - startTime >= (unsigned long)smuffConfig.menuAutoClose*1000)
+      break;
+  }
+  hostPromptPending = false;
+  endHostPrompt();
+  return promptResponse + 1;
+}
+
+#endif
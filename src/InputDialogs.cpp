@@ -20,185 +20,128 @@
 #include "Config.h"
 #include "InputDialogs.h"
 
+#ifndef HEADLESS
+
 
 void drawValue(const char* title, const char* PROGMEM message, String val) {
-    char tmp[256];
-    char msg[128];
-    sprintf_P(msg, message);
-    sprintf(tmp,"%s\n \n%-12s%5s", title, msg, val.c_str());
+    char tmp[MAX_LINE_LENGTH];
+    char msg[DLG_LINE_LEN];
+    strncpy_P(msg, message, sizeof(msg)-1);
+    msg[sizeof(msg)-1] = 0;
+    snprintf(tmp, sizeof(tmp), "%s\n \n%-12s%5s", title, msg, val.c_str());
     drawUserMessage(String(tmp));
 }
 
-void getEncoderButton(int* turn, int* button, bool* isHeld, bool* isClicked) {
-  *turn = encoder.getValue();
-  *button = encoder.getButton();
-  *isHeld = false;
-  *isClicked = false;
-  if(*button != 0) {
-    if(*button == ClickEncoder::Held) {
-      *isHeld = true;
-    }
-    else if(*button == ClickEncoder::Clicked) {
-      *isClicked = true;
+/*
+  Returns the baudrate at index in the list of baudrates, or -1 if
+  there's no such entry.
+*/
+static long getBaudrateOption(uint8_t index) {
+  char tmp[12];
+  const char* p = P_Baudrates;
+  for(uint8_t i=0; i < index; i++) {
+    while(pgm_read_byte(p) != '\n') {
+      if(pgm_read_byte(p) == 0)
+        return -1;
+      p++;
     }
+    p++;
   }
+  uint8_t n = 0;
+  char c;
+  while((c = pgm_read_byte(p++)) != 0 && c != '\n' && n < sizeof(tmp)-1)
+    tmp[n++] = c;
+  tmp[n] = 0;
+  return n > 0 ? strtol(tmp, NULL, 10) : -1;
 }
 
-bool showInputDialog(const char* title, const char* PROGMEM message, float* val, float min, float max, fCallback cb) {
-  bool stat = true;
-  float steps = 1.0F;
-  int turn, btn;
-  bool isHeld, isClicked;
-
-  debounceButton();
-  encoder.setAccelerationEnabled(true);
-  drawValue(title, message, String(*val));
-  if(cb != NULL) {
-    cb(*val);
-  }
-
-  while(1) {
-    getEncoderButton(&turn, &btn, &isHeld, &isClicked);
-    if(isHeld || isClicked) {
-      stat = isHeld ? false : true;
+static void drawInput(InputDialog* dlg) {
+  char val[MENU_VALUE_LEN];
+  switch(dlg->type) {
+    case MENU_FLOAT:
+      fmtFloat(val, dlg->fValue);
       break;
-    }
-    if(turn != 0) {
-      if(turn < 0) {
-        if(*val > min)
-          *val += steps*turn;
-        else beep(1);
-      }
-      else if(turn > 0) {
-        if(*val < max)
-          *val += steps*turn;
-        else beep(1);
-      }
-      drawValue(title, message, String(*val));
-      if(cb != NULL) {
-        cb(*val);
-      }
-    }
-  }
-  encoder.setAccelerationEnabled(false);
-  return stat;
-}
-
-bool showInputDialog(const char* title, const char* PROGMEM message, int* val, int min, int max, iCallback cb) {
-  bool stat = true;
-  int turn, btn;
-  bool isHeld, isClicked;
-
-  debounceButton();
-  encoder.setAccelerationEnabled(true);
-  drawValue(title, message, String(*val));
-  if(cb != NULL) {
-    cb(*val);
-  }
-  
-  while(1) {
-    getEncoderButton(&turn, &btn, &isHeld, &isClicked);
-    if(isHeld || isClicked) {
-      stat = isHeld ? false : true;
+    case MENU_YESNO:
+      strcpy_P(val, dlg->value ? P_Yes : P_No);
+      break;
+    case MENU_HILO:
+      strcpy_P(val, dlg->value ? P_High : P_Low);
+      break;
+    default:
+      fmtInt(val, dlg->value);
       break;
-    }
-    if(turn != 0) {
-      if(turn < 0) {
-        if(*val > min)
-          *val += turn;
-        else beep(1);
-      }
-      else if(turn > 0) {
-        if(*val < max)
-          *val += turn;
-        else beep(1);
-      }
-      drawValue(title, message, String(*val));
-      if(cb != NULL) {
-        cb(*val);
-      }
-    }
   }
-  //__debug(PSTR("Stopped %d"),stat);
-  encoder.setAccelerationEnabled(false);
-  return stat;
+  drawValue(dlg->title, dlg->prompt, String(val));
 }
 
-bool showInputDialog(const char* title, const char* PROGMEM message, bool* val, bCallback cb) {
-  bool stat = true;
-  int turn, btn;
-  bool isHeld, isClicked;
-  char _yes[10], _no[10];
-  
-  sprintf_P(_yes, P_Yes);
-  sprintf_P(_no, P_No);
-
-  debounceButton();
-  drawValue(title, message, String(*val ? _yes : _no));
-  if(cb != NULL) {
-    cb(*val);
-  }
- 
-  while(1) {
-    getEncoderButton(&turn, &btn, &isHeld, &isClicked);
-    if(isHeld || isClicked) {
-      stat = isHeld ? false : true;
-      break;
-    }
-    if(turn == 0)
-      continue;
-    *val = !*val;
-    drawValue(title, message, String(*val ? _yes : _no));
-    if(cb != NULL) {
-        cb(*val);
+/*
+  Shows the input dialog given. The dialog gets serviced by 
+  serviceInput() with the encoder events as they come in.
+*/
+void beginInput(InputDialog* dlg) {
+  if(dlg->type == MENU_BAUDRATE) {
+    dlg->option = 0;
+    long baud;
+    for(uint8_t i=0; (baud = getBaudrateOption(i)) != -1; i++) {
+      if(baud == dlg->value)
+        dlg->option = i;
+      dlg->max = i;
     }
-
+    dlg->value = getBaudrateOption(dlg->option);
   }
-  return stat;
+  encoder.setAccelerationEnabled(dlg->type != MENU_YESNO && dlg->type != MENU_HILO && dlg->type != MENU_BAUDRATE);
+  drawInput(dlg);
+  if(dlg->preview != NULL)
+    dlg->preview(dlg->value);
 }
 
-bool showInputDialog(const char* title, const char* PROGMEM message, unsigned long* val, String list) {
-  bool stat = true;
-  int turn, btn;
-  bool isHeld, isClicked;
-  int opt = 0;
-  char* options[10];
-
-  debounceButton();
-  int lineCnt = splitStringLines(options, 10, list.c_str());
-
-  if(lineCnt==0)
-    return false;
-  
-  for(int i=0; i< lineCnt; i++) {
-    if(String(options[i]) == String(*val)) {
-        opt = i;
-        //__debug(PSTR("Current selection: %s"), options[i]);
-    }
+/*
+  Handles the encoder events for the input dialog given.
+  Returns INPUT_OK if the value got confirmed (button clicked), 
+  INPUT_CANCELED if the button was held or INPUT_PENDING otherwise.
+*/
+uint8_t serviceInput(InputDialog* dlg, int turn, int button) {
+  if(button == ClickEncoder::Clicked || button == ClickEncoder::DoubleClicked || button == ClickEncoder::Held) {
+    encoder.setAccelerationEnabled(false);
+    return button == ClickEncoder::Held ? INPUT_CANCELED : INPUT_OK;
   }
-  drawValue(title, message, String(options[opt]));
+  if(turn == 0)
+    return INPUT_PENDING;
 
-  while(1) {
-    getEncoderButton(&turn, &btn, &isHeld, &isClicked);
-    if(isHeld || isClicked) {
-      stat = isHeld ? false : true;
+  switch(dlg->type) {
+    case MENU_YESNO:
+    case MENU_HILO:
+      dlg->value = !dlg->value;
       break;
-    }
-    if(turn != 0) {
-      if(turn == -1) {
-        if(opt > 0)
-          opt--;
-        else opt = lineCnt-1;
+
+    case MENU_BAUDRATE:
+      if(turn < 0)
+        dlg->option = dlg->option > 0 ? dlg->option-1 : dlg->max;
+      else
+        dlg->option = dlg->option < dlg->max ? dlg->option+1 : 0;
+      dlg->value = getBaudrateOption(dlg->option);
+      break;
+
+    case MENU_FLOAT:
+      dlg->fValue += turn;
+      if(dlg->fValue < dlg->min || dlg->fValue > dlg->max) {
+        beep(1);
+        dlg->fValue = constrain(dlg->fValue, (float)dlg->min, (float)dlg->max);
       }
-      else if(turn == 1) {
-        if(opt < lineCnt-1)
-          opt++;
-        else opt = 0;
+      break;
+
+    default:
+      dlg->value += turn;
+      if(dlg->value < dlg->min || dlg->value > dlg->max) {
+        beep(1);
+        dlg->value = constrain(dlg->value, dlg->min, dlg->max);
       }
-      drawValue(title, message, String(options[opt]));
-    }
+      break;
   }
-  *val = strtol(options[opt], NULL, 10);
-  return stat;
+  drawInput(dlg);
+  if(dlg->preview != NULL)
+    dlg->preview(dlg->value);
+  return INPUT_PENDING;
 }
 
+#endif
@@ -0,0 +1,278 @@
+/**
+ * SMuFF Firmware
+ * Copyright (C) 2019 Technik Gegg
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Module for running G-code macros stored on the SD-Card (MACRO_FOLDER).
+ * A macro gets read from the card only once and compiled into the macro
+ * cache: comments, blanks and line ends are stripped and the placeholders
+ * {A}..{Z} become single bytes, which get replaced by the parameters of
+ * the call when the macro runs. Macros not found are remembered as well,
+ * so hooks without a macro cost neither a card access nor any parsing.
+ * The cache gets cleared when it's full or the card has been changed.
+ */
+
+#include "SMuFF.h"
+
+typedef struct {
+  char      name[MACRO_NAME_LEN];
+  uint16_t  offset;                 // start of the compiled macro in macroCache
+  uint16_t  len;                    // 0 if there's no such macro
+} MacroEntry;
+
+static char       macroCache[MACRO_CACHE_SIZE];
+static uint16_t   macroCacheUsed = 0;
+static MacroEntry macroEntries[MACRO_CACHE_ENTRIES];
+static uint8_t    macroEntryCnt = 0;
+static uint8_t    macroDepth = 0;   // nesting level of the macro running
+static bool       macroStale = false; // cache must be cleared as soon as no macro is running
+
+void clearMacros() {
+  if(macroDepth) {
+    macroStale = true;
+    return;
+  }
+  macroCacheUsed = 0;
+  macroEntryCnt = 0;
+  macroStale = false;
+}
+
+/*
+  Compiles one line of a macro into the cache at pos.
+  Returns the length of the compiled line (0 if it's empty)
+  or -1 if it doesn't fit into the space left.
+*/
+static int compileLine(const char* line, uint16_t pos) {
+  bool quoted = false;
+  uint16_t start = pos;
+
+  for(; *line; line++) {
+    char ch = *line;
+    if(!quoted) {
+      if(ch == ';')
+        break;
+      if(ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n')
+        continue;
+      if(ch == '{' && isalpha(line[1]) && line[2] == '}') {
+        ch = MACRO_PARAM | (toupper(line[1]) - 'A');
+        line += 2;
+      }
+      else if(ch & MACRO_PARAM)
+        ch = '?';
+    }
+    else if(ch & MACRO_PARAM)
+      ch = '?';                   // non ASCII characters would be taken as placeholders
+    if(ch == '"')
+      quoted = !quoted;
+    if(pos >= MACRO_CACHE_SIZE-2)
+      return -1;
+    macroCache[pos++] = ch;
+  }
+  if(pos == start)
+    return 0;
+  macroCache[pos++] = 0;
+  return pos - start;
+}
+
+/*
+  Reads the macro from the card and compiles it into the cache.
+  Returns false if the macro doesn't fit into the cache.
+*/
+static bool compileMacro(MacroEntry* entry) {
+  char line[MAX_LINE_LENGTH];
+  char delimiter[] = { "\n" };
+  FsFile file;
+
+  entry->offset = macroCacheUsed;
+  entry->len = 0;
+  sprintf_P(line, PSTR("%s/%s%s"), MACRO_FOLDER, entry->name, MACRO_EXT);
+  if(!file.open(line, O_READ))
+    return true;                  // remembered as macro not found
+  uint16_t pos = macroCacheUsed;
+  bool stat = true;
+  while(file.fgets(line, sizeof(line)-1, delimiter) > 0) {
+    int len = compileLine(line, pos);
+    if(len == -1) {
+      stat = false;
+      break;
+    }
+    pos += len;
+  }
+  file.close();
+  if(stat) {
+    macroCache[pos++] = 0;        // end of the macro
+    entry->len = pos - entry->offset;
+    macroCacheUsed = pos;
+  }
+  return stat;
+}
+
+/*
+  Returns the cache entry of the macro, reads and compiles the macro
+  if it's not in the cache yet. Returns NULL if the cache is full
+  or the name is too long.
+*/
+static MacroEntry* getMacro(const char* name) {
+  if(strlen(name) >= MACRO_NAME_LEN)
+    return NULL;
+  for(uint8_t i=0; i < macroEntryCnt; i++) {
+    if(strcasecmp(macroEntries[i].name, name) == 0)
+      return &macroEntries[i];
+  }
+  if(!mountSD())
+    return NULL;
+  for(uint8_t retry=0; retry < 2; retry++) {
+    if(macroEntryCnt < MACRO_CACHE_ENTRIES) {
+      MacroEntry* entry = &macroEntries[macroEntryCnt];
+      strcpy(entry->name, name);
+      if(compileMacro(entry)) {
+        macroEntryCnt++;
+        return entry;
+      }
+    }
+    // make room, unless a macro is running (its code is in the cache)
+    if(macroDepth)
+      break;
+    clearMacros();
+  }
+  return NULL;
+}
+
+/*
+  Reads the parameters A..Z (except P, the name of the macro) from text.
+*/
+void parseMacroParams(const char* text, MacroParams* params) {
+  uint8_t len = 0;
+
+  memset(params->pos, -1, sizeof(params->pos));
+  while(*text) {
+    char letter = toupper(*text++);
+    if(letter < 'A' || letter > 'Z')
+      continue;
+    if(letter == 'P' && *text == '"') {
+      const char* end = strchr(text+1, '"');
+      if(end == NULL)
+        break;
+      text = end+1;
+      continue;
+    }
+    params->pos[letter-'A'] = len;
+    while(*text && *text != ' ' && !isalpha(*text) && len < sizeof(params->values)-1)
+      params->values[len++] = *text++;
+    params->values[len++] = 0;
+    if(len >= sizeof(params->values)-1)
+      break;
+  }
+}
+
+/*
+  Runs a G-code given as compiled line, the placeholders get replaced
+  by the parameters. The responses of the G-codes are discarded.
+*/
+static bool runMacroLine(const char* code, MacroParams* params) {
+  char line[MAX_LINE_LENGTH];
+  uint8_t len = 0;
+
+  for(; *code && len < sizeof(line)-1; code++) {
+    if(!(*code & MACRO_PARAM)) {
+      line[len++] = *code;
+      continue;
+    }
+    int8_t pos = params != NULL ? params->pos[(uint8_t)*code - MACRO_PARAM] : -1;
+    if(pos == -1)
+      return false;
+    for(const char* val = params->values + pos; *val && len < sizeof(line)-1; val++)
+      line[len++] = *val;
+  }
+  line[len] = 0;
+  String gcode = String(line+1);
+  switch(*line) {
+    case 'G': return parse_G(gcode, -1);
+    case 'M': return parse_M(gcode, -1);
+    case 'T': return parse_T(gcode, -1);
+  }
+  return false;
+}
+
+bool macroExists(const char* name) {
+  MacroEntry* entry = getMacro(name);
+  return entry != NULL && entry->len > 0;
+}
+
+/*
+  Runs the macro, stops at the first G-code failed.
+*/
+bool runMacro(const char* name, MacroParams* params, int serial) {
+  char tmp[60];
+  MacroEntry* entry;
+
+  if(strlen(name) >= MACRO_NAME_LEN) {
+    sprintf_P(tmp, P_MacroNameTooLong, MACRO_NAME_LEN-1);
+    printResponse(tmp, serial);
+    return false;
+  }
+  if(macroDepth >= MACRO_MAX_DEPTH || (entry = getMacro(name)) == NULL || entry->len == 0) {
+    sprintf_P(tmp, P_MacroNotFound, name);
+    printResponse(tmp, serial);
+    return false;
+  }
+  macroDepth++;
+  bool stat = true;
+  int lineCnt = 1;
+  for(const char* code = macroCache + entry->offset; *code; code += strlen(code)+1, lineCnt++) {
+    if(!runMacroLine(code, params)) {
+      sprintf_P(tmp, P_MacroFailed, name, lineCnt);
+      printResponse(tmp, serial);
+      stat = false;
+      break;
+    }
+  }
+  if(--macroDepth == 0 && macroStale)
+    clearMacros();
+  return stat;
+}
+
+/*
+  Runs the macro named as the event, if there's one. Not while a macro
+  is running, since the macro is supposed to handle the event itself.
+*/
+void runMacroHook(const char* name, int tool) {
+  MacroParams params;
+  char hook[MACRO_NAME_LEN];
+  char args[10];
+
+  if(macroDepth)
+    return;
+  strncpy_P(hook, name, sizeof(hook)-1);
+  hook[sizeof(hook)-1] = 0;
+  if(!macroExists(hook))
+    return;
+  sprintf_P(args, PSTR("T%d"), tool);
+  parseMacroParams(args, &params);
+  runMacro(hook, &params, 0);
+}
+
+void printMacros(int serial) {
+  char tmp[FILE_INDEX_NAME_LEN+1];
+
+  int cnt = indexFiles(MACRO_FOLDER, MACRO_EXT);
+  for(int i=0; i < cnt; i++) {
+    sprintf_P(tmp, PSTR("%s\n"), getIndexedFile(MACRO_FOLDER, MACRO_EXT, i));
+    printResponse(tmp, serial);
+  }
+}
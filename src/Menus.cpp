@@ -21,866 +21,815 @@
 #include "ZStepperLib.h"
 #include "InputDialogs.h"
 
+#ifndef HEADLESS
+
 extern int      swapTools[];
 extern ZStepper steppers[];
 extern int      toolSelections[]; 
 
-char* extractTitle(const char* menu PROGMEM, int index) {
-  char* tok = strtok((char*)menu, "\n");
-  int cnt = -1;
-  while(tok != NULL) {
-    if(++cnt == index)
-      break;
-    tok = strtok(NULL, "\n");
-  }
-  
-  if(tok != NULL) {
-    char* tok2 = tok+strlen(tok)-1;
-    if(tok2 != NULL) {
-      while(*--tok2 != ' ')
-        *tok2 = 0;
-      while(*--tok2 == ' ')
-        *tok2 = 0;
-    }
-    //__debug(PSTR("Menu: %s tok:%s"), menu, tok);
-    return tok;
-  }
-  return NULL;
-}
-
-void setupToolsMenu(char* menu) {
-  char tmp[50];
-  sprintf_P(menu, P_MenuItemBack);
-  memset(toolSelections, 0, sizeof(int)*MAX_TOOLS);
-  int n = 0;
-  for(int i=0; i< smuffConfig.toolCount; i++) {
-    if(i == toolSelected)
-      continue;
-    toolSelections[n] = i;
-    sprintf_P(tmp, P_ToolMenu, i);
-    strcat(menu, tmp);
-    strcat(menu, (char*)"\n");
-    n++;
-  }
-  menu[strlen(menu)-1] = '\0';
-}
-
-void setupMainMenu(char* menu) {
-    char items[450];
+enum {
+  MNU_NONE = 0,
+  MNU_BACK,
+  MNU_SEPARATOR,
+  // Main menu
+  MNU_HOME_ALL,
+  MNU_MOTORS,
+  MNU_RESET_JAM,
+  MNU_SWAP_TOOLS,
+  MNU_LOAD,
+  MNU_UNLOAD,
+  MNU_LOAD_NOZZLE,
+  MNU_OFFSETS,
+  MNU_SETTINGS,
+  MNU_TESTRUN,
+  MNU_DIAGNOSTICS,
+  // Settings menu
+  MNU_TOOL_COUNT,
+  MNU_BOWDEN_LEN,
+  MNU_SELECTOR_DIST,
+  MNU_AUTO_CLOSE,
+  MNU_FAN_SPEED,
+  MNU_PWRSAVE_TIME,
+  MNU_PMMU_EMUL,
+  MNU_BAUDRATES,
+  MNU_STEPPERS,
+  MNU_PROFILES,
+  MNU_SAVE_CONFIG,
+  // Offsets menu
+  MNU_OFS_SELECTOR,
+  MNU_OFS_REVOLVER,
+  // Baudrates menu
+  MNU_BAUD_USB,
+  MNU_BAUD_2ND,
+  // Steppers menu
+  MNU_SELECTOR,
+  MNU_REVOLVER,
+  MNU_FEEDER,
+  // Selector, Revolver and Feeder menus
+  MNU_INVERT_DIR,
+  MNU_ENDSTOP_TRIGGER,
+  MNU_STEP_DELAY,
+  MNU_MAX_SPEED,
+  MNU_MAX_SPEED_HS,
+  MNU_ACCELERATION,
+  MNU_STEPS_PER_MM,
+  MNU_STEPS_PER_REV,
+  MNU_HOME_AFTER_FEED,
+  MNU_RESET_BEF_FEED,
+  MNU_WIGGLE,
+  MNU_USE_SERVO,
+  MNU_SERVO_OPEN,
+  MNU_SERVO_CLOSED,
+  MNU_SERVO_CYCLES,
+  MNU_ENABLE_CHUNKS,
+  MNU_FEED_CHUNKS,
+  MNU_INSERT_LEN,
+  MNU_INSERT_SPEED,
+  MNU_REINFORCE_LEN
+};
+
+static bool isPmmuMode() {
+  return smuffConfig.prusaMMU2;
+}
+
+static void formatMotors(char* buf) {
+  strcpy_P(buf, steppers[SELECTOR].getEnabled() ? P_Off : P_On);
+}
+
+static void handleMainMenu(uint8_t id, uint8_t event);
+static void handleSettingsMenu(uint8_t id, uint8_t event);
+static void handleOffsetsMenu(uint8_t id, uint8_t event);
+static void handleSteppersMenu(uint8_t id, uint8_t event);
+static void handleToolsMenu(uint8_t index, uint8_t event);
+static void handleSwapMenu(uint8_t index, uint8_t event);
+static uint8_t getToolsCount();
+static void getToolsLine(uint8_t index, char* label, char* value);
+static uint8_t getSwapCount();
+static void getSwapLine(uint8_t index, char* label, char* value);
+static void handleProfilesMenu(uint8_t index, uint8_t event);
+static uint8_t getProfilesCount();
+static void getProfilesLine(uint8_t index, char* label, char* value);
 #ifdef __STM32F1__
-    char items2[150];
+static void handleTestrunMenu(uint8_t index, uint8_t event);
+static uint8_t getTestrunCount();
+static void getTestrunLine(uint8_t index, char* label, char* value);
 #endif
-    char stat[45];
-    char opt[30] = "";
-    
-    steppers[SELECTOR].getEnabled() ? sprintf_P(stat, P_Off) : sprintf_P(stat, P_On);
-    if(smuffConfig.prusaMMU2) {
-      sprintf_P(opt, P_MenuItemsPMMU);
-    }
-    sprintf_P(menu, P_MenuItemBack);
+
+extern const MenuDef settingsMenuDef, offsetsMenuDef, baudratesMenuDef, steppersMenuDef;
+extern const MenuDef selectorMenuDef, revolverMenuDef, feederMenuDef, swapMenuDef, testrunMenuDef, profilesMenuDef;
+
+#define MENU_BACK                           { P_MnuBack, MNU_BACK, MENU_NONE, NULL, NULL, NULL, NULL, NULL, 0, 0 }
+#define MENU_SEPARATOR                      { P_MnuSeparator, MNU_SEPARATOR, MENU_NONE, NULL, NULL, NULL, NULL, NULL, 0, 0 }
+#define MENU_ACTION(label, id)              { label, id, MENU_NONE, NULL, NULL, NULL, NULL, NULL, 0, 0 }
+#define MENU_SUB(label, id, menu)           { label, id, MENU_SUBMENU, NULL, NULL, NULL, &menu, NULL, 0, 0 }
+#define MENU_SHOW(label, id, type, var)     { label, id, type, &var, NULL, NULL, NULL, NULL, 0, 0 }
+#define MENU_EDIT(label, id, type, var, prompt, min, max) \
+                                            { label, id, type, &smuffConfig.var, NULL, NULL, NULL, prompt, min, max }
+
+const MenuItem mainMenu[] PROGMEM = {
+  MENU_BACK,
+  MENU_ACTION(P_MnuHomeAll,     MNU_HOME_ALL),
+  { P_MnuMotors, MNU_MOTORS, MENU_FUNC, NULL, formatMotors, NULL, NULL, NULL, 0, 0 },
+  MENU_ACTION(P_MnuResetJam,    MNU_RESET_JAM),
+  MENU_SUB(P_MnuSwapTools,      MNU_SWAP_TOOLS,   swapMenuDef),
+  MENU_ACTION(P_MnuLoad,        MNU_LOAD),
+  MENU_ACTION(P_MnuUnload,      MNU_UNLOAD),
 #ifdef __STM32F1__
-    sprintf_P(items2, P_MenuItemsDefault, P_MenuItemSeparator);
-    sprintf_P(items, P_MenuItems, stat, opt, P_MenuItemSeparator, items2);
+  { P_MnuLoadNozzle, MNU_LOAD_NOZZLE, MENU_NONE, NULL, NULL, isPmmuMode, NULL, NULL, 0, 0 },
+  MENU_SEPARATOR,
+  MENU_SUB(P_MnuSettings,       MNU_SETTINGS,     settingsMenuDef),
+  MENU_SEPARATOR,
+  MENU_SUB(P_MnuTestrun,        MNU_TESTRUN,      testrunMenuDef),
 #else
-    // need two different menus because of low memory issues on the ATMEGA
-    sprintf_P(items, P_MenuItems, stat, opt);
+  // the ATMEGA has a different menu because of low memory issues
+  MENU_SUB(P_MnuOffsets,        MNU_OFFSETS,      offsetsMenuDef),
+#endif
+  MENU_SHOW(P_MnuDiagnostics,   MNU_DIAGNOSTICS,  MENU_YESNO, showDiagnostics),
+};
+
+const MenuItem settingsMenu[] PROGMEM = {
+  MENU_BACK,
+  MENU_EDIT(P_MnuToolCount,     MNU_TOOL_COUNT,     MENU_INT,   toolCount,        P_ToolCount,    MIN_TOOLS, MAX_TOOLS),
+  MENU_EDIT(P_MnuBowdenLen,     MNU_BOWDEN_LEN,     MENU_FLOAT, bowdenLength,     P_InMillimeter, 20, 2000),
+  MENU_EDIT(P_MnuSelectorDist,  MNU_SELECTOR_DIST,  MENU_FLOAT, selectorDistance, P_InMillimeter, 10, 50),
+  MENU_EDIT(P_MnuAutoClose,     MNU_AUTO_CLOSE,     MENU_INT,   menuAutoClose,    P_InSeconds,    0, 300),
+  MENU_EDIT(P_MnuFanSpeed,      MNU_FAN_SPEED,      MENU_INT,   fanSpeed,         P_InPercent,    0, 100),
+  MENU_EDIT(P_MnuPwrSaveTime,   MNU_PWRSAVE_TIME,   MENU_LONG,  powerSaveTimeout, P_InSeconds,    0, 240),
+  MENU_EDIT(P_MnuPmmuEmul,      MNU_PMMU_EMUL,      MENU_YESNO, prusaMMU2,        P_YesNo,        0, 1),
+  MENU_SUB(P_MnuBaudrates,      MNU_BAUDRATES,      baudratesMenuDef),
+  MENU_SUB(P_MnuOffsets,        MNU_OFFSETS,        offsetsMenuDef),
+  MENU_SUB(P_MnuSteppers,       MNU_STEPPERS,       steppersMenuDef),
+  MENU_SUB(P_MnuProfiles,       MNU_PROFILES,       profilesMenuDef),
+  MENU_SEPARATOR,
+  MENU_ACTION(P_MnuSaveConfig,  MNU_SAVE_CONFIG),
+};
+
+const MenuItem offsetsMenu[] PROGMEM = {
+  MENU_BACK,
+  MENU_SHOW(P_MnuSelector,      MNU_OFS_SELECTOR,   MENU_FLOAT, smuffConfig.firstToolOffset),
+  MENU_SHOW(P_MnuRevolver,      MNU_OFS_REVOLVER,   MENU_INT,   smuffConfig.firstRevolverOffset),
+};
+
+const MenuItem baudratesMenu[] PROGMEM = {
+  MENU_BACK,
+  MENU_EDIT(P_MnuBaudUsb,       MNU_BAUD_USB,       MENU_BAUDRATE, serial1Baudrate, P_Baud, 0, 0),
+  MENU_EDIT(P_MnuBaud2nd,       MNU_BAUD_2ND,       MENU_BAUDRATE, serial2Baudrate, P_Baud, 0, 0),
+};
+
+const MenuItem steppersMenu[] PROGMEM = {
+  MENU_BACK,
+  MENU_SUB(P_MnuSelector,       MNU_SELECTOR,       selectorMenuDef),
+  MENU_SUB(P_MnuRevolver,       MNU_REVOLVER,       revolverMenuDef),
+  MENU_SUB(P_MnuFeeder,         MNU_FEEDER,         feederMenuDef),
+};
+
+const MenuItem selectorMenu[] PROGMEM = {
+  MENU_BACK,
+  MENU_EDIT(P_MnuInvertDir,     MNU_INVERT_DIR,     MENU_YESNO, invertDir_X,      P_YesNo,          0, 1),
+  MENU_EDIT(P_MnuEndstopTrigger,MNU_ENDSTOP_TRIGGER,MENU_HILO,  endstopTrigger_X, P_TriggerOn,      0, 1),
+  MENU_EDIT(P_MnuStepDelay,     MNU_STEP_DELAY,     MENU_INT,   stepDelay_X,      P_InMicroseconds, 0, 100),
+  MENU_EDIT(P_MnuMaxSpeed,      MNU_MAX_SPEED,      MENU_UINT,  maxSpeed_X,       P_InTicks,        1, 50000),
+  MENU_EDIT(P_MnuMaxSpeedHS,    MNU_MAX_SPEED_HS,   MENU_UINT,  maxSpeedHS_X,     P_InTicks,        1, 50000),
+  MENU_EDIT(P_MnuAcceleration,  MNU_ACCELERATION,   MENU_UINT,  acceleration_X,   P_InTicks,        1, 60000),
+  MENU_EDIT(P_MnuStepsPerMM,    MNU_STEPS_PER_MM,   MENU_LONG,  stepsPerMM_X,     P_InSteps,        1, 10000),
+};
+
+const MenuItem revolverMenu[] PROGMEM = {
+  MENU_BACK,
+  MENU_EDIT(P_MnuInvertDir,     MNU_INVERT_DIR,     MENU_YESNO, invertDir_Y,      P_YesNo,          0, 1),
+  MENU_EDIT(P_MnuEndstopTrigger,MNU_ENDSTOP_TRIGGER,MENU_HILO,  endstopTrigger_Y, P_TriggerOn,      0, 1),
+  MENU_EDIT(P_MnuStepDelay,     MNU_STEP_DELAY,     MENU_INT,   stepDelay_Y,      P_InMicroseconds, 0, 100),
+  MENU_EDIT(P_MnuMaxSpeed,      MNU_MAX_SPEED,      MENU_UINT,  maxSpeed_Y,       P_InTicks,        1, 50000),
+  MENU_EDIT(P_MnuMaxSpeedHS,    MNU_MAX_SPEED_HS,   MENU_UINT,  maxSpeedHS_Y,     P_InTicks,        1, 50000),
+  MENU_EDIT(P_MnuAcceleration,  MNU_ACCELERATION,   MENU_UINT,  acceleration_Y,   P_InTicks,        1, 60000),
+  MENU_EDIT(P_MnuStepsPerRev,   MNU_STEPS_PER_REV,  MENU_LONG,  stepsPerRevolution_Y, P_InSteps,    1, 10000),
+  MENU_EDIT(P_MnuHomeAfterFeed, MNU_HOME_AFTER_FEED,MENU_YESNO, homeAfterFeed,    P_YesNo,          0, 1),
+  MENU_EDIT(P_MnuResetBefFeed,  MNU_RESET_BEF_FEED, MENU_YESNO, resetBeforeFeed_Y,P_YesNo,          0, 1),
+  MENU_EDIT(P_MnuWiggle,        MNU_WIGGLE,         MENU_YESNO, wiggleRevolver,   P_YesNo,          0, 1),
+  MENU_EDIT(P_MnuUseServo,      MNU_USE_SERVO,      MENU_YESNO, revolverIsServo,  P_YesNo,          0, 1),
+  MENU_EDIT(P_MnuServoOpen,     MNU_SERVO_OPEN,     MENU_INT,   revolverOffPos,   P_OpenPos,        0, 2400),
+  MENU_EDIT(P_MnuServoClosed,   MNU_SERVO_CLOSED,   MENU_INT,   revolverOnPos,    P_ClosedPos,      0, 2400),
+  MENU_EDIT(P_MnuServoCycles,   MNU_SERVO_CYCLES,   MENU_INT,   servoCycles,      P_ServoCycles,    0, 50),
+};
+
+const MenuItem feederMenu[] PROGMEM = {
+  MENU_BACK,
+  MENU_EDIT(P_MnuInvertDir,     MNU_INVERT_DIR,     MENU_YESNO, invertDir_Z,      P_YesNo,          0, 1),
+  MENU_EDIT(P_MnuEndstopTrigger,MNU_ENDSTOP_TRIGGER,MENU_HILO,  endstopTrigger_Z, P_TriggerOn,      0, 1),
+  MENU_EDIT(P_MnuStepDelay,     MNU_STEP_DELAY,     MENU_INT,   stepDelay_Z,      P_InMicroseconds, 0, 100),
+  MENU_EDIT(P_MnuMaxSpeed,      MNU_MAX_SPEED,      MENU_UINT,  maxSpeed_Z,       P_InTicks,        1, 50000),
+  MENU_EDIT(P_MnuMaxSpeedHS,    MNU_MAX_SPEED_HS,   MENU_UINT,  maxSpeedHS_Z,     P_InTicks,        1, 50000),
+  MENU_EDIT(P_MnuAcceleration,  MNU_ACCELERATION,   MENU_UINT,  acceleration_Z,   P_InTicks,        1, 60000),
+  MENU_EDIT(P_MnuStepsPerMM,    MNU_STEPS_PER_MM,   MENU_LONG,  stepsPerMM_Z,     P_InSteps,        1, 10000),
+  MENU_EDIT(P_MnuEnableChunks,  MNU_ENABLE_CHUNKS,  MENU_YESNO, enableChunks,     P_YesNo,          0, 1),
+  MENU_EDIT(P_MnuFeedChunks,    MNU_FEED_CHUNKS,    MENU_INT,   feedChunks,       P_NoOfChunks,     0, 100),
+  MENU_EDIT(P_MnuInsertLen,     MNU_INSERT_LEN,     MENU_FLOAT, insertLength,     P_InMillimeter,   1, 50),
+  MENU_EDIT(P_MnuInsertSpeed,   MNU_INSERT_SPEED,   MENU_UINT,  insertSpeed_Z,    P_InTicks,        1, 60000),
+  MENU_EDIT(P_MnuReinforceLen,  MNU_REINFORCE_LEN,  MENU_FLOAT, reinforceLength,  P_InMillimeter,   0, 10),
+};
+
+const MenuDef mainMenuDef       PROGMEM = { mainMenu,      MENU_COUNT(mainMenu),      NULL, NULL, handleMainMenu };
+const MenuDef settingsMenuDef   PROGMEM = { settingsMenu,  MENU_COUNT(settingsMenu),  NULL, NULL, handleSettingsMenu };
+const MenuDef offsetsMenuDef    PROGMEM = { offsetsMenu,   MENU_COUNT(offsetsMenu),   NULL, NULL, handleOffsetsMenu };
+const MenuDef baudratesMenuDef  PROGMEM = { baudratesMenu, MENU_COUNT(baudratesMenu), NULL, NULL, handleSettingsMenu };
+const MenuDef steppersMenuDef   PROGMEM = { steppersMenu,  MENU_COUNT(steppersMenu),  NULL, NULL, NULL };
+const MenuDef selectorMenuDef   PROGMEM = { selectorMenu,  MENU_COUNT(selectorMenu),  NULL, NULL, NULL };
+const MenuDef revolverMenuDef   PROGMEM = { revolverMenu,  MENU_COUNT(revolverMenu),  NULL, NULL, handleSteppersMenu };
+const MenuDef feederMenuDef     PROGMEM = { feederMenu,    MENU_COUNT(feederMenu),    NULL, NULL, handleSteppersMenu };
+const MenuDef toolsMenuDef      PROGMEM = { NULL, 0, getToolsCount, getToolsLine, handleToolsMenu };
+const MenuDef swapMenuDef       PROGMEM = { NULL, 0, getSwapCount,  getSwapLine,  handleSwapMenu };
+const MenuDef profilesMenuDef   PROGMEM = { NULL, 0, getProfilesCount, getProfilesLine, handleProfilesMenu };
+#ifdef __STM32F1__
+const MenuDef testrunMenuDef    PROGMEM = { NULL, 0, getTestrunCount, getTestrunLine, handleTestrunMenu };
 #endif
-    strcat(menu, items);
-}
 
-void setupOffsetMenu(char* menu) {
-  char items[120];
-  sprintf_P(menu, P_MenuItemBack);
-  sprintf_P(items, P_OfsMenuItems, String(smuffConfig.firstToolOffset).c_str(), String(smuffConfig.firstRevolverOffset).c_str());
-  strcat(menu, items);
+/*
+  Menu engine:
+  The menus currently open are kept on a stack. uiTick() gets called
+  from the main loop, consumes the encoder events and redraws the
+  menu (or input dialog) only if something has changed. Thus, the
+  main loop keeps on serving the serial ports while a menu is open.
+*/
+typedef enum {
+  UI_IDLE,
+  UI_MENU,
+  UI_INPUT
+} UiState;
+
+typedef struct {
+  const MenuDef*  menu;                   // PROGMEM
+  uint8_t         current;                // index of the line selected
+  uint8_t         first;                  // index of the first line visible
+  char            title[MENU_LABEL_LEN];
+} MenuFrame;
+
+static MenuFrame    menuStack[MENU_STACK_DEPTH];
+static int8_t       menuDepth = -1;
+static uint8_t      uiState = UI_IDLE;
+static bool         uiRedraw = false;
+static MenuDef      uiMenu;               // copy of the current menu description
+static uint8_t      uiVisible[MAX_MENU_ITEMS];  // table index of the visible items
+static uint8_t      uiEditItem;           // table index of the item being edited
+static InputDialog  uiInput;
+
+/*
+  Reads the description of the current menu and determines which 
+  items are visible. Returns the number of lines of the menu.
+*/
+static uint8_t loadMenu(MenuFrame* frame) {
+  memcpy_P(&uiMenu, frame->menu, sizeof(MenuDef));
+  if(uiMenu.items == NULL)
+    return uiMenu.getCount();
+
+  MenuItem item;
+  uint8_t cnt = 0;
+  for(uint8_t i=0; i < uiMenu.count && cnt < MAX_MENU_ITEMS; i++) {
+    memcpy_P(&item, &uiMenu.items[i], sizeof(MenuItem));
+    if(item.isEnabled != NULL && !item.isEnabled())
+      continue;
+    uiVisible[cnt++] = i;
+  }
+  return cnt;
 }
 
-void setupSwapMenu(char* menu) {
-  char tmp[128];
-  sprintf_P(menu, P_MenuItemBack);
-  sprintf_P(tmp, P_SwapReset);
-  strcat(menu, tmp);
-  for(int i=0; i< smuffConfig.toolCount; i++) {
-    sprintf_P(tmp, P_SwapMenu, i, swapTools[i]);
-    strcat(menu, tmp);
-    strcat(menu, (char*)"\n");
+static void formatMenuValue(const MenuItem* item, char* buf) {
+  *buf = 0;
+  switch(item->type) {
+    case MENU_SUBMENU:
+      strcpy_P(buf, P_MnuSubmenu);
+      break;
+    case MENU_INT:
+      fmtInt(buf, *(int*)item->value);
+      break;
+    case MENU_UINT:
+      fmtInt(buf, *(unsigned*)item->value);
+      break;
+    case MENU_LONG:
+      fmtInt(buf, *(long*)item->value);
+      break;
+    case MENU_ULONG:
+    case MENU_BAUDRATE:
+      fmtInt(buf, (long)*(unsigned long*)item->value);
+      break;
+    case MENU_FLOAT:
+      fmtFloat(buf, *(float*)item->value);
+      break;
+    case MENU_YESNO:
+      strcpy_P(buf, *(bool*)item->value ? P_Yes : P_No);
+      break;
+    case MENU_HILO:
+      strcpy_P(buf, *(int*)item->value ? P_High : P_Low);
+      break;
+    case MENU_FUNC:
+      item->format(buf);
+      break;
   }
-  menu[strlen(menu)-1] = '\0';
 }
 
-void setupSettingsMenu(char* menu) {
-  char items[400];
-  sprintf_P(menu, P_MenuItemBack);
-  sprintf_P(items, P_SettingsMenuItems, 
-    String(smuffConfig.toolCount).c_str(),
-    String(smuffConfig.bowdenLength).c_str(),
-    String(smuffConfig.selectorDistance).c_str(),
-    String(smuffConfig.menuAutoClose).c_str(),
-    String(smuffConfig.fanSpeed).c_str(),
-    String(smuffConfig.powerSaveTimeout).c_str(),
-    smuffConfig.prusaMMU2 ? P_Yes : P_No,
-#ifdef __STM32F1__
-    "\u25b8",
-    "\u25b8",
-    "\u25b8",
-#else
-    ">",
-    ">",
-    ">",
-#endif
-    P_MenuItemSeparator);
-  strcat(menu, items);
+static void getMenuLine(uint8_t index, char* label, char* value) {
+  if(uiMenu.items == NULL) {
+    uiMenu.getLine(index, label, value);
+    return;
+  }
+  MenuItem item;
+  memcpy_P(&item, &uiMenu.items[uiVisible[index]], sizeof(MenuItem));
+  strncpy_P(label, item.label, MENU_LABEL_LEN-1);
+  label[MENU_LABEL_LEN-1] = 0;
+  formatMenuValue(&item, value);
+}
+
+/*
+  Draws the current menu, the line selected being inverted. 
+  The lines are fetched one by one while drawing, so the menu
+  never needs to be assembled in memory.
+*/
+static void drawMenu(MenuFrame* frame, uint8_t count) {
+  char label[MENU_LABEL_LEN];
+  char value[MENU_VALUE_LEN];
+
+  display.setFont(BASE_FONT);
+  display.setFontMode(1);
+  display.setFontPosBaseline();
+  int ascent = display.getAscent();
+  int descent = display.getDescent();
+  int lineHeight = ascent - descent + 1;
+  int width = display.getDisplayWidth();
+  uint8_t visible = (display.getDisplayHeight()-3) / lineHeight - 1;
+
+  if(frame->current < frame->first)
+    frame->first = frame->current;
+  else if(frame->current >= frame->first+visible)
+    frame->first = frame->current-visible+1;
+
+  display.firstPage();
+  do {
+    int y = ascent;
+    display.setDrawColor(1);
+    display.drawUTF8((width - display.getUTF8Width(frame->title))/2, y, frame->title);
+    display.drawHLine(0, y - descent + 1, width);
+    y += lineHeight + 3;
+    for(uint8_t i = frame->first; i < count && i < frame->first+visible; i++) {
+      getMenuLine(i, label, value);
+      display.setDrawColor(1);
+      if(i == frame->current)
+        display.drawBox(0, y - ascent, width, ascent - descent);
+      display.setDrawColor(i == frame->current ? 0 : 1);
+      display.drawUTF8(1, y, label);
+      if(*value)
+        display.drawUTF8(width - display.getUTF8Width(value) - 1, y, value);
+      y += lineHeight;
+    }
+    display.setDrawColor(1);
+  } while(display.nextPage());
+  display.setFontMode(0);
+}
+
+static void pushMenu(const MenuDef* menu, PGM_P title) {
+  if(menuDepth >= MENU_STACK_DEPTH-1)
+    return;
+  MenuFrame* frame = &menuStack[++menuDepth];
+  frame->menu = menu;
+  frame->current = 0;
+  frame->first = 0;
+  strncpy_P(frame->title, title, MENU_LABEL_LEN-1);
+  frame->title[MENU_LABEL_LEN-1] = 0;
+  if(uiState == UI_IDLE) {
+    showMenu = true;
+    displayingUserMessage = false;
+    resetAutoClose();
+  }
+  uiState = UI_MENU;
+  uiRedraw = true;
+}
+
+static void popMenu() {
+  MenuDef def;
+  memcpy_P(&def, menuStack[menuDepth].menu, sizeof(MenuDef));
+  if(def.handler != NULL)
+    def.handler(MNU_NONE, MENU_EV_CLOSE);
+  if(--menuDepth < 0) {
+    uiState = UI_IDLE;
+    showMenu = false;
+    invalidateStatus();
+  }
+  uiRedraw = true;
 }
 
-void setupBaudrateMenu(char* menu) {
-  char items[128];
-  sprintf_P(menu, P_MenuItemBack);
-  sprintf_P(items, P_BaudMenuItems,
-    String(smuffConfig.serial1Baudrate).c_str(),
-    String(smuffConfig.serial2Baudrate).c_str());
-  strcat(menu, items);
+void uiClose() {
+  while(menuDepth >= 0)
+    popMenu();
 }
 
-void setupSteppersMenu(char *menu) {
-  char items[128];
-  sprintf_P(menu, P_MenuItemBack);
-  sprintf_P(items, P_SteppersMenuItems,
-#ifdef __STM32F1__
-    "\u25b8",
-    "\u25b8",
-    "\u25b8");
-#else
-    ">",
-    ">",
-    ">");
-#endif
-  strcat(menu, items);
+void openMainMenu() {
+  pushMenu(&mainMenuDef, P_TitleMainMenu);
 }
 
-void setupRevolverMenu(char* menu) {
-  char items1[150];
-  char items2[240];
-  sprintf_P(menu, P_MenuItemBack);
-  sprintf_P(items1, P_AllSteppersMenuItems,
-    smuffConfig.invertDir_Y ? P_Yes : P_No,
-    smuffConfig.endstopTrigger_Y ? P_High : P_Low,
-    String(smuffConfig.stepDelay_Y).c_str(),
-    String(smuffConfig.maxSpeed_Y).c_str(),
-    String(smuffConfig.maxSpeedHS_Y).c_str(),
-    String(smuffConfig.acceleration_Y).c_str());
-  sprintf_P(items2, P_RevolverMenuItems,
-    String(smuffConfig.stepsPerRevolution_Y).c_str(),
-    smuffConfig.homeAfterFeed ? P_Yes : P_No,
-    smuffConfig.resetBeforeFeed_Y ? P_Yes : P_No,
-    smuffConfig.wiggleRevolver ? P_Yes : P_No,
-    smuffConfig.revolverIsServo ? P_Yes : P_No,
-    String(smuffConfig.revolverOffPos).c_str(),
-    String(smuffConfig.revolverOnPos).c_str(),
-    String(smuffConfig.servoCycles).c_str());
-  strcat(menu, items1);
-  strcat(menu, items2);
+void openToolsMenu() {
+  pushMenu(&toolsMenuDef, P_TitleToolsMenu);
+  menuStack[menuDepth].current = toolSelected == 255 ? 0 : toolSelected+1;
 }
 
-void setupFeederMenu(char* menu) {
-  char items1[256];
-  char items2[256];
-  sprintf_P(menu, P_MenuItemBack);
-  sprintf_P(items1, P_AllSteppersMenuItems,
-    smuffConfig.invertDir_Z ? P_Yes : P_No,
-    smuffConfig.endstopTrigger_Z ? P_High : P_Low,
-    String(smuffConfig.stepDelay_Z).c_str(),
-    String(smuffConfig.maxSpeed_Z).c_str(),
-    String(smuffConfig.maxSpeedHS_Z).c_str(),
-    String(smuffConfig.acceleration_Z).c_str());
-  sprintf_P(items2, P_FeederMenuItems,
-    String(smuffConfig.stepsPerMM_Z).c_str(),
-    smuffConfig.enableChunks ? P_Yes : P_No,
-    String(smuffConfig.feedChunks).c_str(),
-    String(smuffConfig.insertLength).c_str(),
-    String(smuffConfig.insertSpeed_Z).c_str(),
-    String(smuffConfig.reinforceLength).c_str());
-  strcat(menu, items1);
-  strcat(menu, items2);
+void openSettingsMenu() {
+  pushMenu(&settingsMenuDef, P_MnuSettings);
 }
 
-void setupSelectorMenu(char* menu) {
-  char items1[150];
-  char items2[56];
-  sprintf_P(menu, P_MenuItemBack);
-  sprintf_P(items1, P_AllSteppersMenuItems,
-    smuffConfig.invertDir_X ? P_Yes : P_No,
-    smuffConfig.endstopTrigger_X ? P_High : P_Low,
-    String(smuffConfig.stepDelay_X).c_str(),
-    String(smuffConfig.maxSpeed_X).c_str(),
-    String(smuffConfig.maxSpeedHS_X).c_str(),
-    String(smuffConfig.acceleration_X).c_str());
-  sprintf_P(items2, P_SelectorMenuItems,
-    String(smuffConfig.stepsPerMM_X).c_str());
-  strcat(menu, items1);
-  strcat(menu, items2);
+/*
+  Starts editing the value of the item given.
+*/
+static void editItem(const MenuItem* item) {
+  uiInput.type = item->type;
+  uiInput.prompt = item->prompt;
+  uiInput.min = item->min;
+  uiInput.max = item->max;
+  uiInput.preview = NULL;
+  strncpy_P(uiInput.title, item->label, MENU_LABEL_LEN-1);
+  uiInput.title[MENU_LABEL_LEN-1] = 0;
+  switch(item->type) {
+    case MENU_INT:
+    case MENU_HILO:     uiInput.value = *(int*)item->value; break;
+    case MENU_UINT:     uiInput.value = *(unsigned*)item->value; break;
+    case MENU_LONG:     uiInput.value = *(long*)item->value; break;
+    case MENU_ULONG:
+    case MENU_BAUDRATE: uiInput.value = *(unsigned long*)item->value; break;
+    case MENU_FLOAT:    uiInput.fValue = *(float*)item->value; break;
+    case MENU_YESNO:    uiInput.value = *(bool*)item->value; break;
+  }
+  if(uiMenu.handler != NULL)
+    uiMenu.handler(item->id, MENU_EV_EDIT);
+  uiState = UI_INPUT;
+  beginInput(&uiInput);
+}
+
+/*
+  Stores the value edited into the item given.
+*/
+static void storeItem(const MenuItem* item) {
+  switch(item->type) {
+    case MENU_INT:
+    case MENU_HILO:     *(int*)item->value = uiInput.value; break;
+    case MENU_UINT:     *(unsigned*)item->value = uiInput.value; break;
+    case MENU_LONG:     *(long*)item->value = uiInput.value; break;
+    case MENU_ULONG:
+    case MENU_BAUDRATE: *(unsigned long*)item->value = uiInput.value; break;
+    case MENU_FLOAT:    *(float*)item->value = uiInput.fValue; break;
+    case MENU_YESNO:    *(bool*)item->value = uiInput.value != 0; break;
+  }
+  if(uiMenu.handler != NULL)
+    uiMenu.handler(item->id, MENU_EV_CHANGED);
 }
 
+static void selectLine(MenuFrame* frame) {
+  if(uiMenu.items == NULL) {
+    if(frame->current == 0)
+      popMenu();
+    else
+      uiMenu.handler(frame->current, MENU_EV_SELECT);
+    uiRedraw = true;
+    return;
+  }
+  MenuItem item;
+  uiEditItem = uiVisible[frame->current];
+  memcpy_P(&item, &uiMenu.items[uiEditItem], sizeof(MenuItem));
+  if(item.id == MNU_BACK)
+    popMenu();
+  else if(item.id == MNU_SEPARATOR)
+    return;
+  else if(item.type == MENU_SUBMENU)
+    pushMenu(item.submenu, item.label);
+  else if(item.prompt != NULL)
+    editItem(&item);
+  else if(uiMenu.handler != NULL)
+    uiMenu.handler(item.id, MENU_EV_SELECT);
+  uiRedraw = true;
+}
+
+/*
+  Services the menus, called from the main loop.
+*/
+void uiTick() {
+  if(uiState == UI_IDLE)
+    return;
+
+  int turn, button;
+  bool isHeld, isClicked;
+  if(getEncoderButton(&turn, &button, &isHeld, &isClicked))
+    resetAutoClose();
 
-void setupTestrunMenu(char* menu) {
-  char items[410];
+  if(uiState == UI_INPUT) {
+    uint8_t stat = serviceInput(&uiInput, turn, button);
+    if(stat == INPUT_PENDING)
+      return;
+    uiState = UI_MENU;
+    if(stat == INPUT_OK) {
+      MenuItem item;
+      memcpy_P(&item, &uiMenu.items[uiEditItem], sizeof(MenuItem));
+      storeItem(&item);
+    }
+    turn = 0;
+    isClicked = isHeld = false;
+    uiRedraw = true;
+  }
+  else if(checkAutoClose()) {
+    uiClose();
+    return;
+  }
 
-  sprintf_P(menu, P_MenuItemBack);
-  memset(items, 0, sizeof(items));
-  if(getFiles("/", ".gcode", 20, true, items)) {
-    strcat(menu, items);
+  MenuFrame* frame = &menuStack[menuDepth];
+  uint8_t count = loadMenu(frame);
+  if(count == 0) {
+    popMenu();
+    return;
+  }
+  if(frame->current >= count) {
+    frame->current = count-1;
+    uiRedraw = true;
+  }
+  if(turn != 0) {
+    if(turn > 0)
+      frame->current = (frame->current < count-1) ? frame->current+1 : 0;
+    else
+      frame->current = (frame->current > 0) ? frame->current-1 : count-1;
+    uiRedraw = true;
+  }
+  if(isClicked)
+    selectLine(frame);
+  else if(isHeld)
+    popMenu();
+
+  // the menu may have been changed by the selection
+  if(uiState == UI_MENU && uiRedraw) {
+    uiRedraw = false;
+    frame = &menuStack[menuDepth];
+    drawMenu(frame, loadMenu(frame));
   }
 }
 
-void showMainMenu() {
-  bool stopMenu = false;
-  unsigned int startTime = millis();
-  uint8_t current_selection = 0;
+static void handleMainMenu(uint8_t id, uint8_t event) {
   char tmp[128];
-  char _title[40];
-  char _menu[512];
-
-  do {
-    setupMainMenu(_menu);
-    //__debug(PSTR("MainList: %s %d"), _menu, strlen(_menu));
-    sprintf_P(_title, P_TitleMainMenu, NULL);
-    resetAutoClose();
-    stopMenu = checkStopMenu(startTime);
 
-    current_selection = display.userInterfaceSelectionList(_title, current_selection, _menu);
-
-    if(current_selection == 0)
-      return;
-    else {
-      char* title = extractTitle(_menu, current_selection-1);
-      bool enabled = steppers[SELECTOR].getEnabled();
-
-      switch(current_selection) {
-        case 1:
-          stopMenu = true;
-          break;
-        
-        case 2:
-          moveHome(SELECTOR);
-          moveHome(REVOLVER, true, false);
-          startTime = millis();
-          break;
-        
-        case 3: 
-          steppers[SELECTOR].setEnabled(!enabled);
-          steppers[REVOLVER].setEnabled(!enabled);
-          steppers[FEEDER].setEnabled(!enabled);
-          startTime = millis();
-          break;
-
-        case 4:
-          feederJammed = false;
-          beep(2);
-          sprintf_P(tmp, P_JamCleared);
-          drawUserMessage(tmp);
-          startTime = millis();
-          break;
-
-        case 5:
-          showSwapMenu(title);
-          startTime = millis();
-          break;
-          
-        case 6:
-          if(smuffConfig.prusaMMU2)
-              loadFilamentPMMU2();
-          else
-              loadFilament();
-          startTime = millis();
-          break;
-        
-        case 7:
-          unloadFilament();
-          startTime = millis();
-          break;
-
-        case 8:
-#ifdef __STM32F1__
-          if(smuffConfig.prusaMMU2)
-              loadFilament();
-#else
-          showOffsetsMenu(title);
-#endif
-          startTime = millis();
-          break;
-        case 9:
-          if(!smuffConfig.prusaMMU2)
-              showSettingsMenu(title);
-          current_selection = 1;
-          startTime = millis();
-          break;
-        case 10:
-          if(smuffConfig.prusaMMU2)
-              showSettingsMenu(title);
-          current_selection = 1;
-          startTime = millis();
-          break;
-        case 11:
-          if(!smuffConfig.prusaMMU2)
-              showTestrunMenu(title);
-          current_selection = 1;
-          startTime = millis();
-          break;
-        case 12:
-          if(smuffConfig.prusaMMU2)
-              showTestrunMenu(title);
-          current_selection = 1;
-          startTime = millis();
-          break;
-      }
-    }
-    debounceButton();
-  } while(!stopMenu);
-}
+  if(event != MENU_EV_SELECT)
+    return;
+  bool enabled = steppers[SELECTOR].getEnabled();
+  switch(id) {
+    case MNU_HOME_ALL:
+      moveHome(SELECTOR);
+      moveHome(REVOLVER, true, false);
+      break;
+    
+    case MNU_MOTORS: 
+      steppers[SELECTOR].setEnabled(!enabled);
+      steppers[REVOLVER].setEnabled(!enabled);
+      steppers[FEEDER].setEnabled(!enabled);
+      break;
 
-void showTestrunMenu(char* menuTitle) {
-  bool stopMenu = false;
-  uint8_t current_selection = 0;
-  char _menu[400];
-  char* fnames[16];
-  String _file;
+    case MNU_RESET_JAM:
+      feederJammed = false;
+      beep(2);
+      drawUserMessageP(P_JamCleared);
+      break;
 
-  do {
-    setupTestrunMenu(_menu);
-    resetAutoClose();
+    case MNU_LOAD:
+      if(smuffConfig.prusaMMU2)
+          loadFilamentPMMU2();
+      else
+          loadFilament();
+      break;
+    
+    case MNU_UNLOAD:
+      unloadFilament();
+      break;
 
-    current_selection = display.userInterfaceSelectionList(menuTitle, current_selection, _menu);
+    case MNU_LOAD_NOZZLE:
+      loadFilament();
+      break;
 
-    if(current_selection == 0)
-      return;
-    else if(current_selection == 1) {
-      stopMenu = true;
-    }
-    else if(current_selection >= 2) {
-      splitStringLines(fnames, sizeof(fnames), (const char*)_menu);
-      _file = String(fnames[current_selection-1]);
-      _file.trim();
-      //__debug(PSTR("Selected file: %s"), _file.c_str());
-      testRun(_file);
-    }
-  } while(!stopMenu);
+    case MNU_DIAGNOSTICS:
+      showDiagnostics = !showDiagnostics;
+      uiClose();
+      break;
+  }
 }
 
+static void handleSettingsMenu(uint8_t id, uint8_t event) {
 
-bool selectBaudrate(int port, char* menuTitle) {
-    unsigned long val;
-    char tmp[128];
-    sprintf_P(tmp, P_Baudrates);
-    if(port == 1) {
-        val = smuffConfig.serial1Baudrate;
-        if(showInputDialog(menuTitle, P_Baud, &val, tmp))
-          smuffConfig.serial1Baudrate = val;
+  if(event == MENU_EV_CHANGED) {
+    switch(id) {
+      case MNU_FAN_SPEED:
+        analogWrite(FAN_PIN, map(smuffConfig.fanSpeed, 0, 100, 0, 255));
+        break;
+      case MNU_BAUD_USB:
+        requestBaudrate(1, smuffConfig.serial1Baudrate);
+        break;
+      case MNU_BAUD_2ND:
+        requestBaudrate(2, smuffConfig.serial2Baudrate);
+        break;
+    }
+  }
+  else if(event == MENU_EV_SELECT && id == MNU_SAVE_CONFIG) {
+    if(writeConfig()) {
+      beep(1);
+      drawUserMessageP(P_ConfigWriteSuccess);
     }
     else {
-        val = smuffConfig.serial2Baudrate;
-        if(showInputDialog(menuTitle, P_Baud, &val, tmp))
-          smuffConfig.serial2Baudrate = val;
+      beep(3);
+      drawUserMessageP(P_ConfigWriteFail);
     }
-    return true;
+    delay(3000);
+  }
 }
 
-void positionServoCallback(int val) {
-  setServoPos(1, val);
+static void handleOffsetsMenu(uint8_t id, uint8_t event) {
+  if(event != MENU_EV_SELECT)
+    return;
+  if(id == MNU_OFS_SELECTOR)
+    changeOffset(SELECTOR);
+  else if(id == MNU_OFS_REVOLVER)
+    changeOffset(REVOLVER);
 }
 
-void showRevolverMenu(char* menuTitle) {
-  bool stopMenu = false;
-  unsigned int startTime = millis();
-  uint8_t current_selection = 0;
-  char* title;
-  bool bVal;
-  int iVal;
-  char _menu[350];
-
-  do {
-    setupRevolverMenu(_menu);
-    //__debug(PSTR("Revolver Menu: %s %d"), _menu, strlen(_menu));
-    resetAutoClose();
-    stopMenu = checkStopMenu(startTime);
-
-    current_selection = display.userInterfaceSelectionList(menuTitle, current_selection, _menu);
+static void positionServoCallback(long val) {
+  setServoPos(1, val);
+}
 
-    if(current_selection == 0)
-      return;
-    else {
-      title = extractTitle(_menu, current_selection-1);
-      switch(current_selection) {
-        case 1:
-            stopMenu = true;
-            break;
-
-        case 2: // Invert dir
-            bVal = smuffConfig.invertDir_Y;
-            if(showInputDialog(title, P_YesNo, &bVal))
-              smuffConfig.invertDir_Y = bVal;
-            startTime = millis();
-            break;
-
-        case 3: // Endstop trigger
-            iVal = smuffConfig.endstopTrigger_Y;
-            if(showInputDialog(title, P_TriggerOn, &iVal, 0, 1))
-              smuffConfig.endstopTrigger_Y = iVal;
-            startTime = millis();
-            break;
-
-        case 4: // Step Delay
-            iVal = smuffConfig.stepDelay_Y;
-            if(showInputDialog(title, P_InMicroseconds, &iVal, 0, 100))
-              smuffConfig.stepDelay_Y = iVal;
-            startTime = millis();
-            break;
-
-        case 5: // Max. Speed
-            iVal = smuffConfig.maxSpeed_Y;
-            if(showInputDialog(title, P_InTicks, &iVal, 1, 50000))
-              smuffConfig.maxSpeed_Y = iVal;
-            startTime = millis();
-            break;
-
-        case 6: // Max. Speed HS
-            iVal = smuffConfig.maxSpeedHS_Y;
-            if(showInputDialog(title, P_InTicks, &iVal, 1, 50000))
-              smuffConfig.maxSpeedHS_Y = iVal;
-            startTime = millis();
-            break;
-
-        case 7: // Acceleration
-            iVal = smuffConfig.acceleration_Y;
-            if(showInputDialog(title, P_InTicks, &iVal, 1, 60000))
-              smuffConfig.acceleration_Y = iVal;
-            startTime = millis();
-            break;
-
-        case 8: // Steps Per Rev
-            iVal = smuffConfig.stepsPerRevolution_Y;
-            if(showInputDialog(title, P_InSteps, &iVal, 1, 10000))
-              smuffConfig.stepsPerRevolution_Y = iVal;
-            startTime = millis();
-            break;
-
-        case 9: // Home after feed
-            bVal = smuffConfig.homeAfterFeed;
-            if(showInputDialog(title, P_YesNo, &bVal))
-              smuffConfig.homeAfterFeed = bVal;
-            startTime = millis();
-            break;
-
-        case 10: // Reset before feed
-            bVal = smuffConfig.resetBeforeFeed_Y;
-            if(showInputDialog(title, P_YesNo, &bVal))
-              smuffConfig.resetBeforeFeed_Y = bVal;
-            startTime = millis();
-            break;
-
-        case 11: // Wiggle
-            bVal = smuffConfig.wiggleRevolver;
-            if(showInputDialog(title, P_YesNo, &bVal))
-              smuffConfig.wiggleRevolver = bVal;
-            startTime = millis();
-            break;
-
-        case 12: // Use Servo
-            bVal = smuffConfig.revolverIsServo;
-            if(showInputDialog(title, P_YesNo, &bVal))
-              smuffConfig.revolverIsServo = bVal;
-            startTime = millis();
-            break;
-
-        case 13: // Servo open
-            iVal = smuffConfig.revolverOffPos;
-            if(showInputDialog(title, P_OpenPos, &iVal, 0, 2400, positionServoCallback))
-              smuffConfig.revolverOffPos = iVal;
-            startTime = millis();
-            break;
-
-        case 14: // Servo closed
-            iVal = smuffConfig.revolverOnPos;
-            if(showInputDialog(title, P_ClosedPos, &iVal, 0, 2400, positionServoCallback))
-              smuffConfig.revolverOnPos = iVal;
-            startTime = millis();
-            break;
-
-        case 15: // Servo cycles
-            iVal = smuffConfig.servoCycles;
-            if(showInputDialog(title, P_ServoCycles, &iVal, 0, 50))
-              smuffConfig.servoCycles = iVal;
-            startTime = millis();
-            break;
-      }
+/*
+  Handles the dependencies between the settings of the Revolver
+  and Feeder menus.
+*/
+static void handleSteppersMenu(uint8_t id, uint8_t event) {
+  if(event == MENU_EV_EDIT) {
+    switch(id) {
+      case MNU_SERVO_OPEN:
+      case MNU_SERVO_CLOSED:
+        uiInput.preview = positionServoCallback;
+        break;
+      case MNU_INSERT_LEN:
+        uiInput.max = smuffConfig.selectorDistance;
+        break;
     }
-  } while(!stopMenu);
+  }
+  else if(event == MENU_EV_CHANGED) {
+    switch(id) {
+      case MNU_ACCELERATION:
+      case MNU_INSERT_SPEED:
+        if(smuffConfig.insertSpeed_Z > smuffConfig.acceleration_Z)
+          smuffConfig.acceleration_Z = smuffConfig.insertSpeed_Z;
+        break;
+      case MNU_FEED_CHUNKS:
+        if(smuffConfig.feedChunks == 0)
+          smuffConfig.enableChunks = false;
+        break;
+    }
+  }
 }
 
-void showSelectorMenu(char* menuTitle) {
-  bool stopMenu = false;
-  unsigned int startTime = millis();
-  uint8_t current_selection = 0;
-  char* title;
-  bool bVal;
-  int iVal;
-  char _menu[300];
-
-  do {
-    setupSelectorMenu(_menu);
-    //__debug(PSTR("Selector Menu: %s %d"), _menu, strlen(_menu));
-    resetAutoClose();
-    stopMenu = checkStopMenu(startTime);
-
-    current_selection = display.userInterfaceSelectionList(menuTitle, current_selection, _menu);
+/*
+  Collects the tools which can be selected (all but the current one).
+*/
+static uint8_t getToolsCount() {
+  memset(toolSelections, 0, sizeof(int)*MAX_TOOLS);
+  int n = 0;
+  for(int i=0; i< smuffConfig.toolCount; i++) {
+    if(i == toolSelected)
+      continue;
+    toolSelections[n++] = i;
+  }
+  return n+1;
+}
 
-    if(current_selection == 0)
-      return;
-    else {
-      title = extractTitle(_menu, current_selection-1);
-      switch(current_selection) {
-        case 1:
-            stopMenu = true;
-            break;
-
-        case 2: // Invert dir
-            bVal = smuffConfig.invertDir_X;
-            if(showInputDialog(title, P_YesNo, &bVal))
-              smuffConfig.invertDir_X = bVal;
-            startTime = millis();
-            break;
-
-        case 3: // Endstop trigger
-            iVal = smuffConfig.endstopTrigger_X;
-            if(showInputDialog(title, P_TriggerOn, &iVal, 0, 1))
-              smuffConfig.endstopTrigger_X = iVal;
-            startTime = millis();
-            break;
-
-        case 4: // Step Delay
-            iVal = smuffConfig.stepDelay_X;
-            if(showInputDialog(title, P_InMicroseconds, &iVal, 0, 100))
-              smuffConfig.stepDelay_X = iVal;
-            startTime = millis();
-            break;
-
-        case 5: // Max. Speed
-            iVal = smuffConfig.maxSpeed_X;
-            if(showInputDialog(title, P_InTicks, &iVal, 1, 50000))
-              smuffConfig.maxSpeed_X = iVal;
-            startTime = millis();
-            break;
-
-        case 6: // Max. Speed HS
-            iVal = smuffConfig.maxSpeedHS_X;
-            if(showInputDialog(title, P_InTicks, &iVal, 1, 50000))
-              smuffConfig.maxSpeedHS_X = iVal;
-            startTime = millis();
-            break;
-
-        case 7: // Acceleration
-            iVal = smuffConfig.acceleration_X;
-            if(showInputDialog(title, P_InTicks, &iVal, 1, 60000))
-              smuffConfig.acceleration_X = iVal;
-            startTime = millis();
-            break;
-        
-        case 8: // Steps Per MM
-            iVal = smuffConfig.stepsPerMM_X;
-            if(showInputDialog(title, P_InSteps, &iVal, 1, 10000))
-              smuffConfig.stepsPerMM_X = iVal;
-            startTime = millis();
-            break;
-      }
-    }
-  } while(!stopMenu);
+static void getToolsLine(uint8_t index, char* label, char* value) {
+  *value = 0;
+  if(index == 0)
+    strcpy_P(label, P_MnuBack);
+  else
+    sprintf_P(label, P_ToolMenu, toolSelections[index-1]);
 }
 
-void showFeederMenu(char* menuTitle) {
-  bool stopMenu = false;
-  unsigned int startTime = millis();
-  uint8_t current_selection = 0;
-  char* title;
-  bool bVal;
-  int iVal;
-  float fVal;
-  char _menu[300];
+static void handleToolsMenu(uint8_t index, uint8_t event) {
+  if(event != MENU_EV_SELECT)
+    return;
+  int tool = toolSelections[index-1];
+  if(!smuffConfig.duetDirect) {
+    selectTool(tool);
+  }
+  else {
+    selectTool(tool);
+    // TODO: do tool change using Duet3D 
+    // not yet possible due to Duet3D is being blocked waiting for endstop
+    /*
+    sprintf_P(tmp, PSTR("T%d\n"), tool); 
+    Serial2.print(tmp);
+    */
+  }
+}
 
-  do {
-    setupFeederMenu(_menu);
-    //__debug(PSTR("Feeder Menu: %s %d"), _menu, strlen(_menu));
-    resetAutoClose();
-    stopMenu = checkStopMenu(startTime);
+static uint8_t getSwapCount() {
+  return smuffConfig.toolCount+2;
+}
 
-    current_selection = display.userInterfaceSelectionList(menuTitle, current_selection, _menu);
+static void getSwapLine(uint8_t index, char* label, char* value) {
+  *value = 0;
+  if(index == 0)
+    strcpy_P(label, P_MnuBack);
+  else if(index == 1)
+    strcpy_P(label, P_MnuResetSwaps);
+  else
+    sprintf_P(label, P_SwapMenu, index-2, swapTools[index-2]);
+}
 
-    if(current_selection == 0)
-      return;
-    else {
-      title = extractTitle(_menu, current_selection-1);
-      switch(current_selection) {
-        case 1:
-            stopMenu = true;
-            break;
-
-        case 2: // Invert dir
-            bVal = smuffConfig.invertDir_Z;
-            if(showInputDialog(title, P_YesNo, &bVal))
-              smuffConfig.invertDir_Z = bVal;
-            startTime = millis();
-            break;
-
-        case 3: // Endstop trigger
-            iVal = smuffConfig.endstopTrigger_Z;
-            if(showInputDialog(title, P_TriggerOn, &iVal, 0, 1))
-              smuffConfig.endstopTrigger_Z = iVal;
-            startTime = millis();
-            break;
-
-        case 4: // Step Delay
-            iVal = smuffConfig.stepDelay_Z;
-            if(showInputDialog(title, P_InMicroseconds, &iVal, 0, 100))
-              smuffConfig.stepDelay_Z = iVal;
-            startTime = millis();
-            break;
-
-        case 5: // Max. Speed
-            iVal = smuffConfig.maxSpeed_Z;
-            if(showInputDialog(title, P_InTicks, &iVal, 1, 50000))
-              smuffConfig.maxSpeed_Z = iVal;
-            startTime = millis();
-            break;
-
-        case 6: // Max. Speed HS
-            iVal = smuffConfig.maxSpeedHS_Z;
-            if(showInputDialog(title, P_InTicks, &iVal, 1, 50000))
-              smuffConfig.maxSpeedHS_Z = iVal;
-            startTime = millis();
-            break;
-
-        case 7: // Acceleration
-            iVal = smuffConfig.acceleration_Z;
-            if(showInputDialog(title, P_InTicks, &iVal, 1, 60000)) {
-              smuffConfig.acceleration_Z = iVal;
-              if(smuffConfig.insertSpeed_Z > smuffConfig.acceleration_Z)
-                smuffConfig.acceleration_Z = smuffConfig.insertSpeed_Z;
-            }
-            startTime = millis();
-            break;
-
-        case 8: // Steps Per MM
-            iVal = smuffConfig.stepsPerMM_Z;
-            if(showInputDialog(title, P_InSteps, &iVal, 1, 10000))
-              smuffConfig.stepsPerMM_Z = iVal;
-            startTime = millis();
-            break;
-
-        case 9: // Enable chunks
-            bVal = smuffConfig.enableChunks;
-            if(showInputDialog(title, P_YesNo, &bVal))
-              smuffConfig.enableChunks = bVal;
-            startTime = millis();
-            break;
-
-        case 10: // Feed chunks
-            iVal = smuffConfig.feedChunks;
-            if(showInputDialog(title, P_NoOfChunks, &iVal, 0, 100))
-              smuffConfig.feedChunks = iVal;
-            if(iVal == 0)
-                smuffConfig.enableChunks = false;
-            startTime = millis();
-            break;
-
-        case 11: // Insert length
-            fVal = smuffConfig.insertLength;
-            if(showInputDialog(title, P_InMillimeter, &fVal, 1, smuffConfig.selectorDistance))
-              smuffConfig.insertLength = fVal;
-            startTime = millis();
-            break;
-
-        case 12: // Insert Speed
-            iVal = smuffConfig.insertSpeed_Z;
-            if(showInputDialog(title, P_InTicks, &iVal, 1, 60000)) {
-              smuffConfig.insertSpeed_Z = iVal;
-              if(smuffConfig.insertSpeed_Z > smuffConfig.acceleration_Z)
-                smuffConfig.acceleration_Z = smuffConfig.insertSpeed_Z;
-            }
-            startTime = millis();
-            break;
-
-        case 13: // Reinforce length
-            fVal = smuffConfig.reinforceLength;
-            if(showInputDialog(title, P_InMillimeter, &fVal, 0, 10))
-              smuffConfig.reinforceLength = fVal;
-            startTime = millis();
-            break;
-      }
+static void handleSwapMenu(uint8_t index, uint8_t event) {
+  if(event == MENU_EV_CLOSE) {
+    saveStore();
+    return;
+  }
+  if(index == 1) {
+    for(int i=0; i < MAX_TOOLS; i++) {
+      swapTools[i] = i;
     }
-  } while(!stopMenu);
+  }
+  else {
+    uint8_t tool = swapTool(index-2);
+    uint8_t tmp = swapTools[index-2];
+    swapTools[index-2] = tool;
+    swapTools[tool] = tmp;
+  }
 }
 
-void showSteppersMenu(char* menuTitle) {
-  bool stopMenu = false;
-  unsigned int startTime = millis();
-  uint8_t current_selection = 0;
-  char* title;
-  char _menu[128];
-
-  do {
-    setupSteppersMenu(_menu);
-    resetAutoClose();
-    stopMenu = checkStopMenu(startTime);
+static int    profilesCnt = -1;
 
-    current_selection = display.userInterfaceSelectionList(menuTitle, current_selection, _menu);
+static uint8_t getProfilesCount() {
+  if(profilesCnt == -1) {
+    profilesCnt = indexFiles(PROFILE_FOLDER, PROFILE_EXT);
+    if(profilesCnt < 0)
+      profilesCnt = 0;
+  }
+  return profilesCnt+2;
+}
 
-    if(current_selection == 0)
-      return;
+static void getProfilesLine(uint8_t index, char* label, char* value) {
+  const char* name = index > 1 ? getIndexedFile(PROFILE_FOLDER, PROFILE_EXT, index-2) : "";
+  *value = 0;
+  if(index == 0)
+    strcpy_P(label, P_MnuBack);
+  else {
+    if(index == 1)
+      strcpy_P(label, P_MnuBaseConfig);
     else {
-      title = extractTitle(_menu, current_selection-1);
-      switch(current_selection) {
-        case 1:
-            stopMenu = true;
-            break;
-
-        case 2: // Selector
-            showSelectorMenu(title);
-            current_selection = 1;
-            startTime = millis();
-            break;
-
-        case 3: // Revolver
-            showRevolverMenu(title);
-            current_selection = 1;
-            startTime = millis();
-            break;
-
-        case 4: // Feeder
-            showFeederMenu(title);
-            current_selection = 1;
-            startTime = millis();
-            break;
-      }
+      strncpy(label, name, MENU_LABEL_LEN-1);
+      label[MENU_LABEL_LEN-1] = 0;
     }
-  } while(!stopMenu);
+    if(strcmp(name, activeProfile) == 0)
+      strcpy(value, "*");
+  }
 }
 
-void showSettingsMenu(char* menuTitle) {
-  bool stopMenu = false;
-  unsigned int startTime = millis();
-  uint8_t current_selection = 0;
-  float fVal;
-  int iVal;
-  bool bVal;
-  char *title;
-  char msg[128];
-  char _menu[300];
+static void handleProfilesMenu(uint8_t index, uint8_t event) {
+  if(event == MENU_EV_CLOSE) {
+    profilesCnt = -1;         // ask the directory index again next time
+    return;
+  }
+  char name[FILE_INDEX_NAME_LEN];
+  strcpy(name, index > 1 ? getIndexedFile(PROFILE_FOLDER, PROFILE_EXT, index-2) : "");
+  if(loadProfile(name, -1))
+    beep(1);
+  else {
+    beep(3);
+    drawUserMessageP(P_ProfileLoadFail);
+  }
+}
 
-  do {
-    setupSettingsMenu(_menu);
-    //__debug(PSTR("Settings Menu: %d %d"), strlen(_menu), 0 /*freeMemory()*/);
-    resetAutoClose();
-    stopMenu = checkStopMenu(startTime);
+#ifdef __STM32F1__
+static int    testrunFileCnt = -1;
 
-    current_selection = display.userInterfaceSelectionList(menuTitle, current_selection, _menu);
+static uint8_t getTestrunCount() {
+  if(testrunFileCnt == -1) {
+    testrunFileCnt = indexFiles("/", ".gcode");
+    if(testrunFileCnt < 0)
+      testrunFileCnt = 0;
+  }
+  return testrunFileCnt+1;
+}
 
-    if(current_selection == 0)
-      return;
-    else {
-      title = extractTitle(_menu, current_selection-1);
-      switch(current_selection) {
-        case 1:
-            stopMenu = true;
-            break;
-
-        case 2: // Tool count
-            iVal = smuffConfig.toolCount;
-            if(showInputDialog(title, P_ToolCount, &iVal, MIN_TOOLS, MAX_TOOLS))
-              smuffConfig.toolCount = iVal;
-            startTime = millis();
-            break;
-
-        case 3: // Bowden length
-            fVal = smuffConfig.bowdenLength;
-            if(showInputDialog(title, P_InMillimeter, &fVal, 20, 2000))
-            smuffConfig.bowdenLength = fVal;
-            startTime = millis();
-            break;
-
-        case 4: // Selector distance
-            fVal = smuffConfig.selectorDistance;
-            if(showInputDialog(title, P_InMillimeter, &fVal, 10, 50))
-              smuffConfig.selectorDistance = fVal;
-            startTime = millis();
-            break;
-
-        case 5: // Menu auto close
-            iVal = smuffConfig.menuAutoClose;
-            if(showInputDialog(title, P_InSeconds, &iVal, 0, 300))
-              smuffConfig.menuAutoClose = iVal;
-            startTime = millis();
-            break;
-
-        case 6: // Fan speed 
-            iVal = smuffConfig.fanSpeed;
-            if(showInputDialog(title, P_InPercent, &iVal, 0, 100)) {
-              smuffConfig.fanSpeed = iVal;
-              analogWrite(FAN_PIN, map(smuffConfig.fanSpeed, 0, 100, 0, 255));
-            }
-            startTime = millis();
-            break;
-
-        case 7: // Power save timeout
-            iVal = smuffConfig.powerSaveTimeout;
-            if(showInputDialog(title, P_InSeconds, &iVal, 0, 240))
-              smuffConfig.powerSaveTimeout = iVal;
-            startTime = millis();
-            break;
-
-        case 8: // Prusa Emulation
-            bVal = smuffConfig.prusaMMU2;
-            if(showInputDialog(title, P_YesNo, &bVal))
-              smuffConfig.prusaMMU2 = bVal;
-            startTime = millis();
-            break;
-
-        case 9: // Baudrates
-            showBaudratesMenu(title);
-            current_selection = 1;
-            startTime = millis();
-            break;
-
-        case 10: // Offsets
-            showOffsetsMenu(title);
-            current_selection = 1;
-            startTime = millis();
-            break;
-
-        case 11: // Steppers
-            showSteppersMenu(title);
-            current_selection = 1;
-            startTime = millis();
-            break;
-        
-        case 12: // Separator
-            break;
-        
-        case 13: // STORE CONFIG
-            if(writeConfig()) {
-              beep(1);
-              sprintf_P(msg, P_ConfigWriteSuccess);
-            }
-            else {
-              beep(3);
-              sprintf_P(msg, P_ConfigWriteFail);
-            }
-            drawUserMessage(msg);
-            delay(3000);
-            current_selection = 1;
-            startTime = millis();
-            break;
-      }
-    }
-  } while(!stopMenu);
+static void getTestrunLine(uint8_t index, char* label, char* value) {
+  *value = 0;
+  if(index == 0)
+    strcpy_P(label, P_MnuBack);
+  else {
+    strncpy(label, getIndexedFile("/", ".gcode", index-1), MENU_LABEL_LEN-1);
+    label[MENU_LABEL_LEN-1] = 0;
+  }
 }
 
+static void handleTestrunMenu(uint8_t index, uint8_t event) {
+  if(event == MENU_EV_CLOSE) {
+    testrunFileCnt = -1;      // ask the directory index again next time
+    return;
+  }
+  String file = String(getIndexedFile("/", ".gcode", index-1));
+  //__debug(PSTR("Selected file: %s"), file.c_str());
+  testRun(file);
+}
+#endif
+
 void drawSwapTool(int from, int with) {
   char tmp[256];
   sprintf_P(tmp, P_SwapToolDialog, from, with);
@@ -889,17 +838,16 @@ void drawSwapTool(int from, int with) {
 
 uint8_t swapTool(uint8_t index) {
   uint8_t ndx = 0;
+  int turn, btn;
+  bool isHeld, isClicked;
 
-  debounceButton();
-  delay(250);
-  
   drawSwapTool(index, ndx);
 
   while(1) {
-    if(digitalRead(ENCODER_BUTTON_PIN) == LOW) {
+    getEncoderButton(&turn, &btn, &isHeld, &isClicked);
+    if(isClicked) {
       break;
     }
-    int turn = encoder.getValue();
     if(turn == 0)
       continue;
     ndx += turn;
@@ -913,115 +861,6 @@ uint8_t swapTool(uint8_t index) {
   return ndx;
 }
 
-void showSwapMenu(char* menuTitle) {
-  bool stopMenu = false;
-  uint8_t current_selection = 0;
-  char _menu[128];
-
-  do {
-    setupSwapMenu(_menu);
-    resetAutoClose();
-
-    current_selection = display.userInterfaceSelectionList(menuTitle, current_selection, _menu);
-
-    if(current_selection == 0)
-      return;
-    else if(current_selection == 1) {
-      stopMenu = true;
-    }
-    else if(current_selection == 2) {
-      for(int i=0; i < MAX_TOOLS; i++) {
-        swapTools[i] = i;
-      }
-    }
-    else {
-      uint8_t tool = swapTool(current_selection-3);
-      uint8_t tmp = swapTools[current_selection-3];
-      swapTools[current_selection-3] = tool;
-      swapTools[tool] = tmp;
-      current_selection = 1;
-    }
-  } while(!stopMenu);
-  saveStore();
-}
-
-void showBaudratesMenu(char* menuTitle) {
-  bool stopMenu = false;
-  unsigned int startTime = millis();
-  uint8_t current_selection = 0;
-  char* title;
-  char _menu[128];
-
-  do {
-    setupBaudrateMenu(_menu);
-    resetAutoClose();
-    stopMenu = checkStopMenu(startTime);
-
-    current_selection = display.userInterfaceSelectionList(menuTitle, current_selection, _menu);
-
-    if(current_selection == 0)
-      return;
-    else {
-      title = extractTitle(_menu, current_selection-1);
-      switch(current_selection) {
-        case 1:
-          stopMenu = true;
-          break;
-        
-        case 2:
-          selectBaudrate(1, title);
-          current_selection = 1;
-          startTime = millis();
-          break;
-        
-        case 3:
-          selectBaudrate(2, title);
-          current_selection = 1;
-          startTime = millis();
-          break;
-      }
-    }
-  } while(!stopMenu);  
-}
-
-void showOffsetsMenu(char* menuTitle) {
-  bool stopMenu = false;
-  unsigned int startTime = millis();
-  uint8_t current_selection = 0;
-  char _menu[120];
-
-  do {
-    setupOffsetMenu(_menu);
-    //__debug(PSTR("Offsets Menu: %s %d %d"), _menu, strlen(_menu), 0 /*freeMemory()*/);
-    resetAutoClose();
-    stopMenu = checkStopMenu(startTime);
-
-    current_selection = display.userInterfaceSelectionList(menuTitle, current_selection, _menu);
-
-    if(current_selection == 0)
-      return;
-    else {
-      switch(current_selection) {
-        case 1:
-          stopMenu = true;
-          break;
-        
-        case 2:
-          changeOffset(SELECTOR);
-          current_selection = 1;
-          startTime = millis();
-          break;
-        
-        case 3:
-          changeOffset(REVOLVER);
-          current_selection = 1;
-          startTime = millis();
-          break;
-      }
-    }
-  } while(!stopMenu);  
-}
-
 void changeOffset(int index) {
   int steps = smuffConfig.stepsPerRevolution_Y/360;
   float stepsF = 0.1f;
@@ -1030,8 +869,6 @@ void changeOffset(int index) {
   int turn, btn;
   bool stat = true, isHeld, isClicked;
 
-  debounceButton();
-  
   moveHome(index);
   if(index == REVOLVER) {
     prepSteppingRel(REVOLVER, smuffConfig.firstRevolverOffset, true);
@@ -1096,51 +933,6 @@ void changeOffset(int index) {
 }
 
 
-void showToolsMenu() {
-
-  bool stopMenu = false;
-  unsigned int startTime = millis();
-  uint8_t current_selection = 0;
-  char _title[60];
-  char _menu[128];
-
-  do {
-    sprintf_P(_title, P_TitleToolsMenu);
-    setupToolsMenu(_menu);
-    resetAutoClose();
-    stopMenu = checkStopMenu(startTime);
-
-    uint8_t startPos = toolSelected == 255 ? 0 : toolSelected+1;
-    current_selection = display.userInterfaceSelectionList(_title, startPos, _menu);
-
-    if(current_selection <= 1)
-      stopMenu = true;
-    else {
-      int tool = toolSelections[current_selection-2];
-      if(!smuffConfig.duetDirect) {
-        selectTool(tool);
-      }
-      else {
-        selectTool(tool);
-        // TODO: do tool change using Duet3D 
-        // not yet possible due to Duet3D is being blocked waiting for endstop
-        /*
-        sprintf_P(tmp, PSTR("T%d\n"), tool); 
-        Serial2.print(tmp);
-        */
-      }
-      startTime = millis();
-    }
-  } while(!stopMenu);
-}
-
-bool checkStopMenu(unsigned startTime) {
-    if(millis() - startTime > (unsigned long)smuffConfig.menuAutoClose * 1000) {
-      return true;
-    }
-    return false;
-}
-
 void resetAutoClose() {
   lastEncoderButtonTime = millis();
 }
@@ -1152,11 +944,4 @@ bool checkAutoClose() {
   return false;
 }
 
-void debounceButton() {
-  delay(150);
-  while(digitalRead(ENCODER_BUTTON_PIN) == LOW) {
-      delay(20);
-  }
-  encoder.resetButton();
-}
-
+#endif
@@ -18,21 +18,28 @@
  */
 #include "SMuFF.h"
 #include "Config.h"
+#include "ConfigSchema.h"
 #include "ZTimerLib.h"
 #include "ZStepperLib.h"
 #include "ZServo.h"
 #include "DuetLaserSensor.h"
 
+#ifndef HEADLESS
 #ifdef __BRD_I3_MINI
-U8G2_ST7565_64128N_F_4W_HW_SPI  display(U8G2_R2, /* cs=*/ DSP_CS_PIN, /* dc=*/ DSP_DC_PIN, /* reset=*/ DSP_RESET_PIN);
+  #ifdef DSP_PAGE_MODE
+  U8G2_ST7565_64128N_2_4W_HW_SPI  display(U8G2_R2, /* cs=*/ DSP_CS_PIN, /* dc=*/ DSP_DC_PIN, /* reset=*/ DSP_RESET_PIN);
+  #else
+  U8G2_ST7565_64128N_F_4W_HW_SPI  display(U8G2_R2, /* cs=*/ DSP_CS_PIN, /* dc=*/ DSP_DC_PIN, /* reset=*/ DSP_RESET_PIN);
+  #endif
 #endif
 #ifdef __BRD_SKR_MINI
   #ifdef USE_TWI_DISPLAY
   U8G2_SSD1306_128X64_NONAME_F_HW_I2C display(U8G2_R0, /* reset=*/ U8X8_PIN_NONE); 
   #else
-  U8G2_UC1701_MINI12864_1_2ND_4W_HW_SPI display(U8G2_R0, /* cs=*/ DSP_CS_PIN, /* dc=*/ DSP_DC_PIN, /* reset=*/ DSP_RESET_PIN);
+  U8G2_UC1701_MINI12864_F_2ND_4W_HW_SPI display(U8G2_R0, /* cs=*/ DSP_CS_PIN, /* dc=*/ DSP_DC_PIN, /* reset=*/ DSP_RESET_PIN);
   #endif
 #endif
+#endif
 
 ZStepper                steppers[NUM_STEPPERS];
 ZTimer                  stepperTimer;
@@ -40,7 +47,9 @@ ZTimer                  encoderTimer;
 ZServo                  servo;
 ZServo                  servoRevolver;
 DuetLaserSensor         duetLS;
+#ifndef HEADLESS
 ClickEncoder            encoder(ENCODER1_PIN, ENCODER2_PIN, ENCODER_BUTTON_PIN, 4);
+#endif
 //CRGB                    leds[NUM_LEDS];
 
 volatile byte           nextStepperFlag = 0;
@@ -53,12 +62,25 @@ volatile bool           isPwrSave = false;
 volatile bool           showMenu = false; 
 volatile bool           lastZEndstopState = false;
 volatile bool           lastZEndstop2State = false;
+volatile bool           cachedFeederEndstop = false;  // feeder endstop state, sampled every 1 ms
 unsigned long           endstopZ2HitCnt = 0;
 static unsigned long    lastDisplayRefresh = 0;
 volatile unsigned long  generalCounter = 0;
+volatile unsigned long  stepperIsrTime = 0;   // time (us) spent in the stepper interrupt during the current period
+volatile unsigned long  stepperIsrSteps[NUM_STEPPERS];  // steps done during the current period
+volatile unsigned int   stepperLoad = 0;      // stepper interrupt load (per mille) of the last period
+volatile unsigned long  stepRate = 0;         // steps per second of the last period (all steppers)
+volatile unsigned long  stepRates[NUM_STEPPERS];  // steps per second of the last period (each stepper)
+volatile unsigned long  loopCounter = 0;      // main loop iterations during the current second
+volatile unsigned long  loopsPerSecond = 0;
+unsigned long           lastFrameTime = 0;    // time (us) it took to draw and send the last screen
+bool                    showDiagnostics = false;
+unsigned long           bootTimes[BOOT_STAGES];   // millis() at the end of each stage of setup()
 
 String serialBuffer0, serialBuffer2, serialBuffer9; 
 String traceSerial2;
+uint8_t rxChecksum[NUM_SERIALS];          // running checksum of the line currently being received
+bool rxChecksumEnd[NUM_SERIALS];          // set when the '*' of the line has been received
 
 extern int  swapTools[MAX_TOOLS];
 extern void setToneTimerChannel(uint8_t ntimer, uint8_t channel);    // defined in tone library
@@ -139,7 +161,13 @@ void duetLSHandler() {
 unsigned long lastTick;
 unsigned gcInterval;
 void isrEncoderHandler() {
+#ifndef HEADLESS
   encoder.service();
+#endif
+  if(Z_END_PIN != -1)
+    cachedFeederEndstop = digitalRead(Z_END_PIN) == smuffConfig.endstopTrigger_Z;
+  pollRxBuffers();              // read the printer ports and answer FINDA requests
+  serviceTxBuffers(true);       // push pending output to the serial ports
   generalCounter++;
   if(generalCounter % 20 == 0) { // every 20 ms
     // do the servos interrupt routines so we save one timer 
@@ -149,6 +177,16 @@ void isrEncoderHandler() {
       servoRevolver.setServo();
   }
   if(generalCounter % 100 == 0) { // every 100 ms
+    // stepper interrupt statistics for the display refresh governor
+    stepperLoad = stepperIsrTime / 100;
+    stepperIsrTime = 0;
+    unsigned long rate = 0;
+    for(int i=0; i < NUM_STEPPERS; i++) {
+      stepRates[i] = stepperIsrSteps[i] * 10;
+      rate += stepRates[i];
+      stepperIsrSteps[i] = 0;
+    }
+    stepRate = rate;
   }
   if(generalCounter % 250 == 0) { // every 250 ms
   }
@@ -158,6 +196,8 @@ void isrEncoderHandler() {
     unsigned long tmp = millis();
     gcInterval = tmp-lastTick;
     lastTick = tmp;
+    loopsPerSecond = loopCounter;
+    loopCounter = 0;
   }
   //duetLSHandler();
 }
@@ -170,6 +210,7 @@ bool checkDuetEndstop() {
 }
 
 void setup() {
+  bootTimes[BOOT_START] = millis();
 
 #ifdef __STM32F1__
   #ifndef USE_TWI_DISPLAY
@@ -190,7 +231,8 @@ void setup() {
   #endif
 #endif
 
-  delay(1000);
+  delay(STARTUP_DELAY);
+  bootTimes[BOOT_DELAY] = millis();
   
   serialBuffer0.reserve(40);
   serialBuffer2.reserve(40);
@@ -202,8 +244,11 @@ void setup() {
   */
 
   Serial.begin(57600);        // set fixed baudrate until config file was read
+  setupTxBuffers();
   setupDisplay(); 
+  bootTimes[BOOT_DISPLAY] = millis();
   readConfig();
+  bootTimes[BOOT_CONFIG] = millis();
   // special case: 
   // if the baudrate is set to 0, the board is running out of working memory
   if(smuffConfig.serial1Baudrate != 0) { 
@@ -223,10 +268,13 @@ void setup() {
 #else
   Serial2.begin(smuffConfig.serial2Baudrate);
 #endif
+  setupRxBuffers();
+  bootTimes[BOOT_SERIAL] = millis();
   //__debug(PSTR("DONE init SERIAL"));
 
   setupSteppers();
   setupTimers();
+  bootTimes[BOOT_STEPPERS] = millis();
   
   servo.attach(SERVO1_PIN, true, 0);
   servo.setMaxCycles(smuffConfig.servoCycles);
@@ -236,9 +284,11 @@ void setup() {
   servoRevolver.attach(SERVO2_PIN, true, 1);  
   servoRevolver.setMaxCycles(smuffConfig.servoCycles);
   setServoPos(1, smuffConfig.revolverOffPos);
+  bootTimes[BOOT_SERVOS] = millis();
 
   // this call must happen after setupSteppers()
   getStoredData();
+  bootTimes[BOOT_DATA] = millis();
 
   // Duet Laser Sensor is not being used yet because the 
   // measurements are somewhat unreliable. Not sure if it's the 
@@ -322,29 +372,30 @@ void setup() {
   pwrSaveTime = millis();
   
   initBeep();
-  
+  bootTimes[BOOT_DONE] = millis();
+}
+
+/*
+  Prints how long each stage of setup() took (see BootStage).
+*/
+void printBootTimes(int serial) {
+  char tmp[150];
+  unsigned long t[BOOT_STAGES];
+  for(int i=BOOT_STAGES-1; i > BOOT_START; i--)
+    t[i] = bootTimes[i] - bootTimes[i-1];
+  const char* src = configSource == CONFIG_CACHED ? "cached" : configSource == CONFIG_PARSED ? "parsed" : configSource == CONFIG_FAILED ? "failed" : "none";
+  sprintf_P(tmp, P_BootTimes, bootTimes[BOOT_START], t[BOOT_DELAY], t[BOOT_DISPLAY], t[BOOT_CONFIG], src, t[BOOT_SERIAL], t[BOOT_STEPPERS], t[BOOT_SERVOS], t[BOOT_DATA], t[BOOT_DONE], bootTimes[BOOT_DONE]);
+  printResponse(tmp, serial);
 }
 
 void setupSteppers() {
 
   steppers[SELECTOR] = ZStepper(SELECTOR, (char*)"Selector", X_STEP_PIN, X_DIR_PIN, X_ENABLE_PIN, smuffConfig.acceleration_X, smuffConfig.maxSpeed_X);
-  steppers[SELECTOR].setEndstop(X_END_PIN, smuffConfig.endstopTrigger_X, ZStepper::MIN);
   steppers[SELECTOR].stepFunc = overrideStepX;
-  steppers[SELECTOR].setMaxStepCount(smuffConfig.maxSteps_X);
-  steppers[SELECTOR].setStepsPerMM(smuffConfig.stepsPerMM_X);
-  steppers[SELECTOR].setInvertDir(smuffConfig.invertDir_X);
-  steppers[SELECTOR].setMaxHSpeed(smuffConfig.maxSpeedHS_X);
-  steppers[SELECTOR].setAccelDistance(smuffConfig.accelDistance_X);
   
   steppers[REVOLVER] = ZStepper(REVOLVER, (char*)"Revolver", Y_STEP_PIN, Y_DIR_PIN, Y_ENABLE_PIN, smuffConfig.acceleration_Y, smuffConfig.maxSpeed_Y);
-  steppers[REVOLVER].setEndstop(Y_END_PIN, smuffConfig.endstopTrigger_Y, ZStepper::ORBITAL);
   steppers[REVOLVER].stepFunc = overrideStepY;
-  steppers[REVOLVER].setMaxStepCount(smuffConfig.stepsPerRevolution_Y);
-  steppers[REVOLVER].setStepsPerDegree(smuffConfig.stepsPerRevolution_Y/360);
   steppers[REVOLVER].endstopFunc = endstopYevent;
-  steppers[REVOLVER].setInvertDir(smuffConfig.invertDir_Y);
-  steppers[REVOLVER].setMaxHSpeed(smuffConfig.maxSpeedHS_Y);
-  steppers[REVOLVER].setAccelDistance(smuffConfig.accelDistance_Y);
   
   steppers[FEEDER] = ZStepper(FEEDER, (char*)"Feeder", Z_STEP_PIN, Z_DIR_PIN, Z_ENABLE_PIN, smuffConfig.acceleration_Z, smuffConfig.maxSpeed_Z);
   /*
@@ -354,16 +405,10 @@ void setupSteppers() {
   }
   else
   */
-  steppers[FEEDER].setEndstop(Z_END_PIN, smuffConfig.endstopTrigger_Z, ZStepper::MIN);
-  if(Z_END2_PIN != -1)
-    steppers[FEEDER].setEndstop(Z_END2_PIN, smuffConfig.endstopTrigger_Z, ZStepper::MIN, 2); // optional; used for testing only
   steppers[FEEDER].stepFunc = overrideStepZ;
-  steppers[FEEDER].setStepsPerMM(smuffConfig.stepsPerMM_Z);
   steppers[FEEDER].endstopFunc = endstopZevent;
   steppers[FEEDER].endstop2Func = endstopZ2event;
-  steppers[FEEDER].setInvertDir(smuffConfig.invertDir_Z);
-  steppers[FEEDER].setMaxHSpeed(smuffConfig.maxSpeedHS_Z);
-  steppers[FEEDER].setAccelDistance(smuffConfig.accelDistance_Z);
+  setupStepperConfig();
 
   for(int i=0; i < NUM_STEPPERS; i++) {
       steppers[i].runAndWaitFunc = runAndWait;
@@ -378,6 +423,92 @@ void setupSteppers() {
   //__debug(PSTR("DONE initializing swaps"));
 }
 
+/*
+  Sets all the stepper parameters which are taken from the config.
+  Doesn't touch the stepper positions, hence can be called at any
+  time the steppers are not moving.
+*/
+void setupStepperConfig() {
+  steppers[SELECTOR].setAcceleration(smuffConfig.acceleration_X);
+  steppers[SELECTOR].setMaxSpeed(smuffConfig.maxSpeed_X);
+  steppers[SELECTOR].setEndstop(X_END_PIN, smuffConfig.endstopTrigger_X, ZStepper::MIN);
+  steppers[SELECTOR].setMaxStepCount(smuffConfig.maxSteps_X);
+  steppers[SELECTOR].setStepsPerMM(smuffConfig.stepsPerMM_X);
+  steppers[SELECTOR].setInvertDir(smuffConfig.invertDir_X);
+  steppers[SELECTOR].setMaxHSpeed(smuffConfig.maxSpeedHS_X);
+  steppers[SELECTOR].setAccelDistance(smuffConfig.accelDistance_X);
+
+  steppers[REVOLVER].setAcceleration(smuffConfig.acceleration_Y);
+  steppers[REVOLVER].setMaxSpeed(smuffConfig.maxSpeed_Y);
+  steppers[REVOLVER].setEndstop(Y_END_PIN, smuffConfig.endstopTrigger_Y, ZStepper::ORBITAL);
+  steppers[REVOLVER].setMaxStepCount(smuffConfig.stepsPerRevolution_Y);
+  steppers[REVOLVER].setStepsPerDegree(smuffConfig.stepsPerRevolution_Y/360);
+  steppers[REVOLVER].setInvertDir(smuffConfig.invertDir_Y);
+  steppers[REVOLVER].setMaxHSpeed(smuffConfig.maxSpeedHS_Y);
+  steppers[REVOLVER].setAccelDistance(smuffConfig.accelDistance_Y);
+
+  steppers[FEEDER].setAcceleration(smuffConfig.acceleration_Z);
+  steppers[FEEDER].setMaxSpeed(smuffConfig.maxSpeed_Z);
+  steppers[FEEDER].setEndstop(Z_END_PIN, smuffConfig.endstopTrigger_Z, ZStepper::MIN);
+  if(Z_END2_PIN != -1)
+    steppers[FEEDER].setEndstop(Z_END2_PIN, smuffConfig.endstopTrigger_Z, ZStepper::MIN, 2); // optional; used for testing only
+  steppers[FEEDER].setStepsPerMM(smuffConfig.stepsPerMM_Z);
+  steppers[FEEDER].setInvertDir(smuffConfig.invertDir_Z);
+  steppers[FEEDER].setMaxHSpeed(smuffConfig.maxSpeedHS_Z);
+  steppers[FEEDER].setAccelDistance(smuffConfig.accelDistance_Z);
+}
+
+#define CFG_CHANGED(field)    (prev->field != smuffConfig.field)
+
+/*
+  Applies the values of smuffConfig which differ from the ones in prev
+  to the subsystems using them, without resetting anything else
+  (i.e. the positions of the steppers and the tool selected stay valid).
+  Returns the subsystems changed (CFG_APPLY_xxx flags).
+*/
+uint8_t applyConfig(const SMuFFConfig* prev) {
+  uint8_t changed = 0;
+
+  if(CFG_CHANGED(acceleration_X) || CFG_CHANGED(maxSpeed_X) || CFG_CHANGED(maxSpeedHS_X) || CFG_CHANGED(accelDistance_X) ||
+     CFG_CHANGED(maxSteps_X) || CFG_CHANGED(stepsPerMM_X) || CFG_CHANGED(invertDir_X) || CFG_CHANGED(endstopTrigger_X) ||
+     CFG_CHANGED(acceleration_Y) || CFG_CHANGED(maxSpeed_Y) || CFG_CHANGED(maxSpeedHS_Y) || CFG_CHANGED(accelDistance_Y) ||
+     CFG_CHANGED(stepsPerRevolution_Y) || CFG_CHANGED(invertDir_Y) || CFG_CHANGED(endstopTrigger_Y) ||
+     CFG_CHANGED(acceleration_Z) || CFG_CHANGED(maxSpeed_Z) || CFG_CHANGED(maxSpeedHS_Z) || CFG_CHANGED(accelDistance_Z) ||
+     CFG_CHANGED(stepsPerMM_Z) || CFG_CHANGED(invertDir_Z) || CFG_CHANGED(endstopTrigger_Z)) {
+    setupStepperConfig();
+    changed |= CFG_APPLY_STEPPERS;
+  }
+  if(CFG_CHANGED(servoCycles)) {
+    servo.setMaxCycles(smuffConfig.servoCycles);
+    servoRevolver.setMaxCycles(smuffConfig.servoCycles);
+    changed |= CFG_APPLY_SERVOS;
+  }
+  if(CFG_CHANGED(fanSpeed) && FAN_PIN != -1) {
+    if(smuffConfig.fanSpeed >= 0 && smuffConfig.fanSpeed <= 100)
+      analogWrite(FAN_PIN, map(smuffConfig.fanSpeed, 0, 100, 0, 255));
+    changed |= CFG_APPLY_FAN;
+  }
+  if(CFG_CHANGED(lcdContrast)) {
+#ifndef HEADLESS
+    display.setContrast(smuffConfig.lcdContrast);
+#endif
+    changed |= CFG_APPLY_DISPLAY;
+  }
+  // the new rates get applied as soon as the response has been sent (see M575)
+  if(CFG_CHANGED(serial1Baudrate) && smuffConfig.serial1Baudrate != 0) {
+    requestBaudrate(1, smuffConfig.serial1Baudrate);
+    changed |= CFG_APPLY_SERIAL;
+  }
+  if(CFG_CHANGED(serial2Baudrate)) {
+    requestBaudrate(2, smuffConfig.serial2Baudrate);
+    changed |= CFG_APPLY_SERIAL;
+  }
+  if(isConfigChanged(prev))
+    changed |= CFG_APPLY_ANY;
+  invalidateStatus();
+  return changed;
+}
+
 void setupTimers() {
 #ifdef __BRD_I3_MINI
   // *****
@@ -400,7 +531,9 @@ void setupTimers() {
 
   stepperTimer.setupTimerHook(isrStepperHandler);
   encoderTimer.setupTimerHook(isrEncoderHandler);
+#ifndef HEADLESS
   encoder.setDoubleClickEnabled(true);
+#endif
 #ifdef __BRD_I3_MINI
   encoderTimer.setNextInterruptInterval(63);    // run encoder timer
 #else
@@ -434,6 +567,7 @@ void startStepperInterval() {
 }
 
 void isrStepperHandler() {
+  unsigned long isrStart = micros();
   stepperTimer.stopTimer();
   unsigned int tmp = stepperTimer.getOverflow(); 
   stepperTimer.setOverflow(65534);
@@ -448,11 +582,29 @@ void isrStepperHandler() {
     }
     
     steppers[i].handleISR();
+    stepperIsrSteps[i]++;
     if(steppers[i].getMovementDone())
       remainingSteppersFlag &= ~_BV(i); 
   }
   //__debug(PSTR("ISR(): %d"), remainingSteppersFlag);
   startStepperInterval();
+  stepperIsrTime += micros() - isrStart;
+}
+
+/*
+  Display refresh governor.
+  Returns the display refresh interval in ms depending on the
+  steppers' activity, or 0 if refreshing is suspended, so the
+  stepper interrupt gets all the CPU time needed.
+*/
+unsigned long getRefreshInterval() {
+  if(remainingSteppersFlag == 0)
+    return DSP_REFRESH_IDLE;
+  if(stepperLoad >= GOVERNOR_LOAD_SUSPEND || stepRate >= GOVERNOR_RATE_SUSPEND)
+    return 0;
+  if(stepperLoad >= GOVERNOR_LOAD_SLOW)
+    return DSP_REFRESH_SLOW;
+  return DSP_REFRESH_MOVING;
 }
 
 void runNoWait(volatile int index) {
@@ -465,30 +617,100 @@ void runAndWait(volatile int index) {
   runNoWait(index);
   while(remainingSteppersFlag) {
     checkSerialPending(); // not a really nice solution but needed to check serials for "Abort" command in PMMU mode
-#ifdef __STM32F1__
-    if(!showMenu)
-      refreshStatus(true);
+#if defined(__STM32F1__) && !defined(HEADLESS)
+    if(!showMenu) {
+      unsigned long interval = getRefreshInterval();
+      if(interval != 0) {
+        if(millis()-lastDisplayRefresh >= interval)
+          refreshStatus(true);
+        serviceDisplay();
+      }
+    }
 #endif
   }
+#if defined(__STM32F1__) && !defined(HEADLESS)
+  // make sure the display shows the final state of the move
+  if(!showMenu)
+    refreshStatus(true);
+#endif
   //if(index==FEEDER) __debug(PSTR("Fed: %smm"), String(steppers[index].getStepsTakenMM()).c_str());
 }
 
-void refreshStatus(bool withLogo) {
-  display.firstPage();
-  do {
+#ifndef HEADLESS
+static void drawStatusScreen(bool withLogo) {
+  if(showDiagnostics)
+    drawDiagnostics();
+  else {
     if(withLogo) 
       drawLogo();
     drawStatus();
-  } while(display.nextPage());
+  }
+}
+
+/*
+  Redraws the status screen if any of the values shown has changed.
+  In full buffer mode only the tile rows affected get transferred to
+  the display (on STM32 in background), in page mode (DSP_PAGE_MODE) 
+  only the pages containing those tile rows get redrawn and sent.
+*/
+void refreshStatus(bool withLogo) {
+  uint8_t dirty = showDiagnostics ? STATUS_ROWS_ALL : updateStatusModel();
   lastDisplayRefresh = millis();
+  if(dirty == 0)
+    return;
+  unsigned long frameStart = micros();
+  uint8_t tileRows = display.getU8x8()->display_info->tile_height;
+  if(display.getBufferTileHeight() >= tileRows) {
+    display.clearBuffer();
+    drawStatusScreen(withLogo);
+#ifdef __STM32F1__
+    queueDisplayRows(dirty);        // will be sent in background by serviceDisplay()
+#else
+    if(dirty == STATUS_ROWS_ALL) {
+      display.sendBuffer();
+    }
+    else {
+      uint8_t tw = display.getBufferTileWidth();
+      for(uint8_t row=0; row < 8; row++) {
+        if(!(dirty & _BV(row)))
+          continue;
+        uint8_t cnt = 1;
+        while(row+cnt < 8 && (dirty & _BV(row+cnt)))
+          cnt++;
+        display.updateDisplayArea(0, row, tw, cnt);
+        row += cnt;
+      }
+    }
+#endif
+  }
+  else {
+    uint8_t pageRows = display.getBufferTileHeight();
+    uint8_t pageMask = (1 << pageRows) - 1;
+    for(uint8_t row=0; row < tileRows; row += pageRows) {
+      if(!(dirty & (pageMask << row)))
+        continue;
+      display.setBufferCurrTileRow(row);    // sets the clip window to this page
+      display.clearBuffer();
+      drawStatusScreen(withLogo);
+      display.sendBuffer();
+    }
+  }
+  lastFrameTime = micros() - frameStart;
+  validateStatus();
 }
+#endif
 
 void loop() {
 
   //__debug(PSTR("gcInterval: %ld"), gcInterval);
-#ifdef __STM32F1__
-  if(Serial1.available()) serialEvent1();
-  if(Serial3.available()) serialEvent3();
+  loopCounter++;
+  serviceTxBuffers();
+  serviceBaudrates();
+  checkRxBuffers();
+  serviceStatusReport();
+  serviceStore();
+#if defined(__STM32F1__) && !defined(HEADLESS)
+  serviceDisplay();
 #endif
   if(feederEndstop() != lastZEndstopState) {
     lastZEndstopState = feederEndstop();
@@ -507,56 +729,46 @@ void loop() {
   //__debug(PSTR("Mem: %d"), freeMemory());
 
   checkUserMessage();
+#ifndef HEADLESS
   if(!displayingUserMessage) {
     if(!isPwrSave && !showMenu) {
-#ifdef __STM32F1__
-      if(millis()-lastDisplayRefresh > 250) { // refresh display every 100ms
-#else
-      if(millis()-lastDisplayRefresh > 500) { // refresh display every 500ms
-#endif  
+      unsigned long interval = getRefreshInterval();
+      if(interval != 0 && millis()-lastDisplayRefresh > interval) {
         refreshStatus(true);
       }
     }
   }
 
   if(!showMenu) {
-    int button = encoder.getButton();
+    int turn, button;
+    bool isHeld, isClicked;
+    getEncoderButton(&turn, &button, &isHeld, &isClicked);
     if(button == ClickEncoder::Pressed && isPwrSave) {
       setPwrSave(0);
     }
-    else if(button == ClickEncoder::Held) {
+    else if(isHeld) {
       setPwrSave(0);
-      showMenu = true;
-      char title[] = {"Settings"};
-      showSettingsMenu(title);
-      showMenu = false;
-      debounceButton();
-#ifdef __STM32F1__
-#endif
+      openSettingsMenu();
     }
-    else {
-      int turn = encoder.getValue();
-      if(turn != 0) {
-        if(isPwrSave) {
-          setPwrSave(0);
-        }
-        else {
-          displayingUserMessage = false;
-          showMenu = true;
-          if(turn == -1) {
-            showMainMenu();
-          }
-          else {
-            showToolsMenu();
-          }
-          showMenu = false;
-        }
+    else if(turn != 0) {
+      if(isPwrSave) {
+        setPwrSave(0);
+      }
+      else if(turn < 0) {
+        openMainMenu();
+      }
+      else {
+        openToolsMenu();
       }
     }
   }
+  else {
+    uiTick();
+  }
+#endif
   
   //delay(10);
-  if((millis() - pwrSaveTime)/1000 >= (unsigned long)smuffConfig.powerSaveTimeout && !isPwrSave) {
+  if((millis() - pwrSaveTime)/1000 >= (unsigned long)smuffConfig.powerSaveTimeout && !isPwrSave && !showMenu) {
     //PSTR("Power save mode after %d seconds (%d)"), (millis() - pwrSaveTime)/1000, smuffConfig.powerSaveTimeout);
     setPwrSave(1);
   }
@@ -584,7 +796,9 @@ void loop() {
 }
 
 void setPwrSave(int state) {
+#ifndef HEADLESS
   display.setPowerSave(state);
+#endif
   isPwrSave = state == 1;
   if(!isPwrSave) {
     delay(1200);
@@ -593,10 +807,11 @@ void setPwrSave(int state) {
 }
 
 bool checkUserMessage() {
-  int button = digitalRead(ENCODER_BUTTON_PIN);
-  if(button == LOW && displayingUserMessage) {
+#ifndef HEADLESS
+  if(encoder.isButtonDown() && displayingUserMessage) {
     displayingUserMessage = false;
   }
+#endif
   //__debug(PSTR("%ld"), (millis()-userMessageTime)/1000);
   if(millis()-userMessageTime > USER_MESSAGE_RESET*1000) {
     displayingUserMessage = false;
@@ -608,17 +823,34 @@ bool checkUserMessage() {
 #ifdef __STM32F1__
 void serialEventRun() {
   if(Serial.available()) serialEvent();
-  if(Serial1.available()) serialEvent1();
   if(Serial2.available()) serialEvent2();
-  if(Serial3.available()) serialEvent3();
 }
 #endif
 
+/*
+  Processes the input of the serial ports which are read by
+  the timer interrupt (see RxBuffer).
+*/
+void checkRxBuffers() {
+#ifdef __STM32F1__
+  if(rxBuffer[1].available()) serialEvent1();
+  if(rxBuffer[3].available()) serialEvent3();
+#else
+  if(rxBuffer[2].available()) serialEvent2();
+#endif
+}
+
 void checkSerialPending() {
+  serviceTxBuffers();
   serialEventRun(); 
+  checkRxBuffers();
 }
 
 void resetSerialBuffer(int serial) {
+  if(serial >= 0 && serial < NUM_SERIALS) {
+    rxChecksum[serial] = 0;
+    rxChecksumEnd[serial] = false;
+  }
   switch(serial) {
     case 0: serialBuffer0 = ""; break;
     case 1: serialBuffer0 = ""; break;
@@ -628,6 +860,17 @@ void resetSerialBuffer(int serial) {
   }
 }
 
+/*
+  Calculates the checksum of the raw line being received (XOR of all
+  characters up to the '*'), before the input gets filtered.
+*/
+void updateChecksum(int serial, char in) {
+  if(in == '*')
+    rxChecksumEnd[serial] = true;
+  if(!rxChecksumEnd[serial])
+    rxChecksum[serial] ^= (uint8_t)in;
+}
+
 bool isQuote = false;
 void filterSerialInput(String& buffer, char in) {
   if(in >= 'a' && in <='z') {
@@ -659,26 +902,37 @@ void filterSerialInput(String& buffer, char in) {
 void serialEvent() {
   while(Serial.available()) {
     char in = (char)Serial.read();
+    if(checkAutobaud(0, in))
+      continue;
     if (in == '\n') {
       //__debug(PSTR("Received-0: %s"), serialBuffer0.c_str());
       parseGcode(serialBuffer0, 0);
       isQuote = false;
     }
     else {
+      updateChecksum(0, in);
       filterSerialInput(serialBuffer0, in);
     }
   }
 }
 
 void serialEvent2() {
+#ifdef __STM32F1__
   while(Serial2.available()) {
     char in = (char)Serial2.read();
+#else
+  while(rxBuffer[2].available()) {
+    char in = (char)rxBuffer[2].read();
+#endif
+    if(checkAutobaud(2, in))
+      continue;
     if (in == '\n') {
       //__debug(PSTR("Received-2: %s"), serialBuffer2.c_str());
       parseGcode(serialBuffer2, 2);
       isQuote = false;
     }
     else {
+      updateChecksum(2, in);
       filterSerialInput(serialBuffer2, in);
     }
   }
@@ -686,8 +940,10 @@ void serialEvent2() {
 
 #ifdef __STM32F1__
 void serialEvent1() {
-  while(Serial1.available()) {
-    char in = (char)Serial1.read();
+  while(rxBuffer[1].available()) {
+    char in = (char)rxBuffer[1].read();
+    if(checkAutobaud(1, in))
+      continue;
     //Serial1.write(in);
     if (in == '\n') {
       //__debug(PSTR("Received-1: %s"), serialBuffer0.c_str());
@@ -695,14 +951,17 @@ void serialEvent1() {
       isQuote = false;
     }
     else {
+      updateChecksum(1, in);
       filterSerialInput(serialBuffer0, in);
     }
   }
 }
 
 void serialEvent3() {
-  while(Serial3.available()) {
-    char in = (char)Serial3.read();
+  while(rxBuffer[3].available()) {
+    char in = (char)rxBuffer[3].read();
+    if(checkAutobaud(3, in))
+      continue;
     //Serial3.write(in);
     if (in == '\n') {
       //__debug(PSTR("Received-3: %s"), serialBuffer2.c_str());
@@ -710,6 +969,7 @@ void serialEvent3() {
       isQuote = false;
     }
     else {
+      updateChecksum(3, in);
       filterSerialInput(serialBuffer2, in);
     }
   }
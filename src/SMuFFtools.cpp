@@ -30,6 +30,8 @@
 #include "ZServo.h"
 #ifdef __STM32F1__
 #include "libmaple/libmaple.h"
+#include "libmaple/dma.h"
+#include "libmaple/spi.h"
 SPIClass SPI_3(3);
 #define _tone(p, d, f)  playTone(p,d,f)
 #define _noTone(p)      muteTone(p)
@@ -56,9 +58,18 @@ int                   swapTools[MAX_TOOLS];
 bool                  isWarning;
 unsigned long         feederErrors = 0;
 bool                  ignoreHoming = false;
+StatusModel           statusModel;
+bool                  statusValid = false;
+unsigned long         lastToolChangeTime = 0;   // duration (ms) of the last tool change
+unsigned long         inputLatency = 0;         // time (ms) the last encoder event was queued before it got handled
+volatile int          promptResponse = -1;      // button picked by the host (M876), -1 if none
+static int            statusReportSerial = -1;  // serial port the status gets reported to (M155)
+static unsigned long  statusReportInterval = 0; // ms, 0 = off
+static unsigned long  lastStatusReport = 0;
 
 const char brand[] = VERSION_STRING;
 
+#ifndef HEADLESS
 void setupDisplay() {
   display.begin(/*Select=*/ ENCODER_BUTTON_PIN,  /* menu_next_pin= */ U8X8_PIN_NONE, /* menu_prev_pin= */ U8X8_PIN_NONE, /* menu_home_pin= */ U8X8_PIN_NONE);
   display.enableUTF8Print();
@@ -78,7 +89,67 @@ void drawLogo() {
   display.print(brand);
   //__debug(PSTR("drawLogo end..."));
 }
+#endif
+
+/*
+  Takes a snapshot of all the values shown on the status screen.
+  Returns a bit mask of the display tile rows (8 pixel each) affected
+  by the values that have changed since the last call.
+*/
+uint8_t updateStatusModel() {
+  StatusModel current;
+  uint8_t dirty = 0;
+
+  memset(&current, 0, sizeof(current));
+  current.tool = (toolSelected >= 0 && toolSelected < smuffConfig.toolCount) ? toolSelected : -1;
+  current.feed = (steppers[FEEDER].getStepsPerMM() == 0) ? 0 : steppers[FEEDER].getStepsTaken() * 100 / (long)steppers[FEEDER].getStepsPerMM();
+  current.endstop = feederEndstop();
+  current.moving = !steppers[FEEDER].getMovementDone();
+  current.busy = parserBusy;
+  current.pmmu = smuffConfig.prusaMMU2;
+  strncpy(current.trace, traceSerial2.c_str(), sizeof(current.trace)-1);
+#ifdef __AVR__
+  current.mem = freeMemory();
+#endif
 
+  if(current.tool != statusModel.tool)
+    dirty |= STATUS_ROWS_TOOL;
+  if(current.endstop != statusModel.endstop || current.moving != statusModel.moving)
+    dirty |= STATUS_ROWS_FEED;
+  if(current.feed != statusModel.feed)
+#ifdef __AVR__
+    dirty |= STATUS_ROWS_FEED;
+#else
+    dirty |= STATUS_ROWS_FEED | STATUS_ROWS_BAR;   // feed is shown in the status bar as well
+#endif
+  if(current.busy != statusModel.busy || current.pmmu != statusModel.pmmu || strcmp(current.trace, statusModel.trace) != 0)
+    dirty |= STATUS_ROWS_BAR;
+#ifdef __AVR__
+  if(current.mem != statusModel.mem)
+    dirty |= STATUS_ROWS_BAR;
+#endif
+  if(!statusValid)
+    dirty = STATUS_ROWS_ALL;
+  memcpy(&statusModel, &current, sizeof(statusModel));
+  return dirty;
+}
+
+/*
+  Must be called whenever something else than the status screen
+  has been drawn, so the next refresh will redraw the whole screen.
+*/
+void invalidateStatus() {
+  statusValid = false;
+#if defined(__STM32F1__) && !defined(HEADLESS)
+  cancelDisplayRows();
+#endif
+}
+
+void validateStatus() {
+  statusValid = true;
+}
+
+#ifndef HEADLESS
 void drawStatus() {
   char _wait[128];
   //__debug(PSTR("drawStatus start..."));
@@ -87,25 +158,27 @@ void drawStatus() {
   display.setDrawColor(1);
   sprintf_P(tmp, P_CurrentTool);
   display.drawStr(display.getDisplayWidth() - display.getStrWidth(tmp) - 10, 14, tmp);
-  display.drawStr(display.getDisplayWidth() - display.getStrWidth("X") - 10, 14, (toolSelected >= 0 && toolSelected < smuffConfig.toolCount) ? String(toolSelected).c_str() : "-");
+  char tool[14];
+  display.drawStr(display.getDisplayWidth() - display.getStrWidth("X") - 10, 14, (statusModel.tool != -1) ? fmtInt(tool, statusModel.tool) : "-");
   sprintf_P(tmp, P_Feed);
   display.drawStr(display.getDisplayWidth() - display.getStrWidth(tmp) - 10, 34, tmp);
   display.setFontMode(1);
   display.setFont(SMALL_FONT);
   display.setDrawColor(2);
   display.drawBox(0, display.getDisplayHeight()-display.getMaxCharHeight()+2, display.getDisplayWidth(), display.getMaxCharHeight());
-  sprintf_P(_wait, parserBusy ? P_Busy : (smuffConfig.prusaMMU2) ? P_Pemu : P_Ready);
+  sprintf_P(_wait, statusModel.busy ? P_Busy : (statusModel.pmmu) ? P_Pemu : P_Ready);
 #ifdef __AVR__
-  sprintf_P(tmp, PSTR("M:%d | %-4s | %-5s "), freeMemory(), traceSerial2.c_str(), _wait);
+  sprintf_P(tmp, PSTR("M:%d | %-4s | %-5s "), statusModel.mem, statusModel.trace, _wait);
 #else
-  sprintf_P(tmp, PSTR("%-4s| %-4s | %-5s "), String(steppers[FEEDER].getStepsTakenMM()).c_str(), traceSerial2.c_str(), _wait);
+  char feed[14];
+  sprintf_P(tmp, PSTR("%-4s| %-4s | %-5s "), fmtFixed(feed, statusModel.feed, 2), statusModel.trace, _wait);
 #endif
   display.drawStr(1, display.getDisplayHeight(), tmp);
   display.setFontMode(0);
   display.setDrawColor(1);
-  if(steppers[FEEDER].getMovementDone()) {
+  if(!statusModel.moving) {
     display.setFont(ICONIC_FONT);
-    display.drawGlyph(110, 38, feederEndstop() ? 0x41 : 0x42);
+    display.drawGlyph(110, 38, statusModel.endstop ? 0x41 : 0x42);
     display.setFont(BASE_FONT);
   }
   else {
@@ -115,7 +188,8 @@ void drawStatus() {
 }
 
 void drawFeed() {
-  sprintf_P(tmp, PSTR("%-7s"), String(steppers[FEEDER].getStepsTakenMM()).c_str());
+  char feed[14];
+  sprintf_P(tmp, PSTR("%-7s"), fmtFixed(feed, statusModel.feed, 2));
 #ifdef __STM32F1__
   display.setFont(SMALL_FONT);
   display.setFontMode(0);
@@ -131,28 +205,140 @@ void drawFeed() {
   display.drawStr(62, 34, tmp);
 #endif
 }
+#endif
 
-void resetDisplay() {
-  display.clearDisplay();
+/*
+  Sums up the bytes waiting in the serial receive and transmit buffers.
+*/
+void getSerialQueueDepths(unsigned int* rx, unsigned int* tx) {
+  *rx = 0;
+  *tx = 0;
+  for(int i=0; i < NUM_SERIALS; i++) {
+    if(rxBuffer[i].isAttached())
+      *rx += rxBuffer[i].available();
+    *tx += txBuffer[i].getUsed();
+  }
+}
+
+#ifndef HEADLESS
+/*
+  Diagnostics screen, shown instead of the status screen
+  if showDiagnostics is set (see M2003 and the main menu).
+*/
+void drawDiagnostics() {
+  char line[30];
+  char secs[14];
+  unsigned int rx, tx;
+
+  getSerialQueueDepths(&rx, &tx);
+  display.setFont(SMALL_FONT);
+  display.setFontMode(0);
+  display.setDrawColor(1);
+  int y = display.getAscent()+1;
+  int lh = display.getMaxCharHeight();
+  sprintf_P(line, P_DiagLoops, loopsPerSecond, (stepperLoad+5)/10);
+  display.drawStr(1, y, line);
+  sprintf_P(line, P_DiagStepsXY, stepRates[SELECTOR], stepRates[REVOLVER]);
+  display.drawStr(1, y += lh, line);
+  sprintf_P(line, P_DiagStepsZ, stepRates[FEEDER]);
+  display.drawStr(1, y += lh, line);
+  sprintf_P(line, P_DiagQueues, rx, tx);
+  display.drawStr(1, y += lh, line);
+  sprintf_P(line, P_DiagFrame, lastFrameTime);
+  display.drawStr(1, y += lh, line);
+  sprintf_P(line, P_DiagToolChange, fmtFixed(secs, lastToolChangeTime/100, 1));
+  display.drawStr(1, y += lh, line);
+}
+
+#endif
+
+void printDiagnostics(int serial) {
+  unsigned int rx, tx;
+
+  getSerialQueueDepths(&rx, &tx);
+  sprintf_P(tmp, P_Diagnostics, 
+    loopsPerSecond, 
+    stepperLoad/10, stepperLoad%10,
+    stepRates[SELECTOR], stepRates[REVOLVER], stepRates[FEEDER],
+    rx, tx,
+    lastFrameTime,
+    lastToolChangeTime,
+#ifndef HEADLESS
+    inputLatency, encoder.getEventsLost());
+#else
+    0UL, 0);
+#endif
+  printResponse(tmp, serial);
+}
+
+/*
+  Reports the state of the unit in one line, so a host can keep
+  track of it without having a display (see M155).
+*/
+void printStatusReport(int serial) {
+  char selector[14], revolver[14], feeder[14];
+  sprintf_P(tmp, P_StatusReport,
+    (toolSelected >= 0 && toolSelected < smuffConfig.toolCount) ? toolSelected : -1,
+    fmtMM(selector, steppers[SELECTOR].getStepPosition(), steppers[SELECTOR].getStepsPerMM()),
+    fmtInt(revolver, steppers[REVOLVER].getStepPosition()),
+    fmtMM(feeder, steppers[FEEDER].getStepPosition(), steppers[FEEDER].getStepsPerMM()),
+    selectorEndstop(), revolverEndstop(), feederEndstop(), feederEndstop(2),
+    steppers[SELECTOR].getEnabled(),
+    feederJammed,
+    parserBusy,
+    isPwrSave);
+  printResponse(tmp, serial);
+}
+
+/*
+  Sets the interval (in seconds) the status gets reported
+  to the serial port given. 0 turns the report off.
+*/
+void setStatusReport(int serial, int interval) {
+  statusReportSerial = interval > 0 ? serial : -1;
+  statusReportInterval = interval > 0 ? (unsigned long)interval*1000 : 0;
+  lastStatusReport = millis();
+}
+
+void serviceStatusReport() {
+  if(statusReportInterval == 0 || millis()-lastStatusReport < statusReportInterval)
+    return;
+  lastStatusReport = millis();
+  printStatusReport(statusReportSerial);
+}
+
+#ifndef HEADLESS
+/*
+  Sets the font and colors the screens start drawing with.
+  Unlike resetDisplay(), this may be called within a page loop.
+*/
+static void resetDrawState() {
   display.setFont(BASE_FONT);
   display.setFontMode(0);
   display.setDrawColor(1);
 }
 
+void resetDisplay() {
+  invalidateStatus();
+  display.clearDisplay();
+  resetDrawState();
+}
+
 void drawSelectingMessage(int tool) {
   char _sel[128];
   char _wait[128];
+  invalidateStatus();
+  sprintf_P(_sel, P_Selecting);
+  sprintf_P(_wait, P_Wait);
+  if(*smuffConfig.materials[tool] != 0) {
+    sprintf(tmp,"%s", smuffConfig.materials[tool]);
+  }
+  else {
+    sprintf_P(tmp, P_ToolMenu, tool);
+  }
   display.firstPage();
   do {
-    resetDisplay();
-    sprintf_P(_sel, P_Selecting);
-    sprintf_P(_wait, P_Wait);
-    if(*smuffConfig.materials[tool] != 0) {
-      sprintf(tmp,"%s", smuffConfig.materials[tool]);
-    }
-    else {
-      sprintf_P(tmp, P_ToolMenu, tool);
-    }
+    resetDrawState();
     display.drawStr((display.getDisplayWidth() - display.getStrWidth(_sel))/2, (display.getDisplayHeight() - display.getMaxCharHeight())/2-10, _sel);
     display.setFont(BASE_FONT_BIG);
     display.drawStr((display.getDisplayWidth() - display.getStrWidth(tmp))/2, (display.getDisplayHeight() - display.getMaxCharHeight())/2+9, tmp);
@@ -164,11 +350,12 @@ void drawSelectingMessage(int tool) {
 void drawTestrunMessage(unsigned long loop, char* msg) {
   char _sel[128];
   char _wait[128];
+  invalidateStatus();
+  sprintf_P(_sel, P_RunningCmd, loop);
+  sprintf_P(_wait, P_ButtonToStop);
   display.firstPage();
   do {
-    resetDisplay();
-    sprintf_P(_sel, P_RunningCmd, loop);
-    sprintf_P(_wait, P_ButtonToStop);
+    resetDrawState();
     display.drawStr((display.getDisplayWidth() - display.getStrWidth(_sel))/2, (display.getDisplayHeight() - display.getMaxCharHeight())/2-10, _sel);
     display.setFont(BASE_FONT_BIG);
     display.drawStr((display.getDisplayWidth() - display.getStrWidth(msg))/2, (display.getDisplayHeight() - display.getMaxCharHeight())/2+12, msg);
@@ -177,6 +364,8 @@ void drawTestrunMessage(unsigned long loop, char* msg) {
   } while(display.nextPage());
 }
 
+#endif
+
 int splitStringLines(char* lines[], int maxLines, const char* message) {
 
   char* tok = strtok((char*)message, "\n");
@@ -199,39 +388,113 @@ int splitStringLines(char* lines[], int maxLines, const char* message) {
   return cnt;
 }
 
-void drawUserMessage(String message) {
+#ifndef HEADLESS
+/*
+  Dialog renderer:
+  Messages and dialogs are drawn straight from the strings given (in RAM
+  or in flash), which get wrapped to the display width line by line while
+  drawing. Thus, there's no need to copy the texts into buffers first;
+  the only buffer needed is the one for the line currently drawn.
+*/
+#define TEXT_DRAW         1   // draw the lines (otherwise just count them)
+#define TEXT_SKIP_EMPTY   2   // ignore empty lines
+#define TEXT_TITLE_LINE   4   // underline the first line if the second one is a blank
 
-  char* lines[6];
-  int lineCnt = splitStringLines(lines, 6, message.c_str());
-  
+/*
+  Reads the next line of the text into line, wrapped at the last blank 
+  which fits into width pixels in the current font. 
+  Returns the start of the following line or NULL at the end of the text.
+*/
+static const char* fetchLine(const char* text, bool pgm, char* line, int width) {
+  const char* breakAt = NULL;
+  uint8_t len = 0, breakLen = 0;
+  char c;
+
+  line[0] = 0;
+  while((c = pgm ? pgm_read_byte(text) : *text) != 0 && c != '\n' && len < DLG_LINE_LEN-1) {
+    line[len] = c;
+    line[len+1] = 0;
+    if(len > 0 && display.getStrWidth(line) > width) {
+      if(breakAt != NULL) {
+        line[breakLen] = 0;
+        return breakAt+1;
+      }
+      line[len] = 0;
+      return text;
+    }
+    if(c == ' ') {
+      breakAt = text;
+      breakLen = len;
+    }
+    len++;
+    text++;
+  }
+  if(c == '\n')
+    text++;
+  return ((pgm ? pgm_read_byte(text) : *text) == 0) ? NULL : text;
+}
+
+/*
+  Draws the text horizontally centered, starting with the baseline y.
+  Returns the number of lines (drawn or not, see flags).
+*/
+static uint8_t drawTextLines(const char* text, bool pgm, int y, uint8_t flags) {
+  char line[DLG_LINE_LEN];
+  uint8_t cnt = 0;
+  int width = display.getDisplayWidth();
+  int lineHeight = display.getMaxCharHeight();
+
+  if(text == NULL || (pgm ? pgm_read_byte(text) : *text) == 0)
+    return 0;
+  while(text != NULL) {
+    text = fetchLine(text, pgm, line, width-4);
+    if(*line == 0 && (flags & TEXT_SKIP_EMPTY))
+      continue;
+    if(flags & TEXT_DRAW) {
+      display.drawStr((width - display.getStrWidth(line))/2, y, line);
+      if(cnt == 1 && (flags & TEXT_TITLE_LINE) && strcmp(line, " ") == 0)
+        display.drawHLine(0, y-lineHeight+3, width);
+    }
+    y += lineHeight;
+    cnt++;
+  }
+  return cnt;
+}
+
+static void drawMessage(const char* message, bool pgm, PGM_P addMessage) {
   if(isPwrSave) {
     setPwrSave(0);
   }
-  display.setDrawColor(0);
-  display.drawBox(1, 1, display.getDisplayWidth()-2, display.getDisplayHeight()-2);
-  display.setDrawColor(1);
-  display.drawFrame(0, 0, display.getDisplayWidth(), display.getDisplayHeight());
+  invalidateStatus();
+  display.setFont(BASE_FONT_BIG);
+  int lineHeight = display.getMaxCharHeight();
+  int lineCnt = drawTextLines(message, pgm, 0, TEXT_SKIP_EMPTY) + drawTextLines(addMessage, true, 0, TEXT_SKIP_EMPTY);
+  int y = (display.getDisplayHeight()-(lineCnt-1)*lineHeight)/2;
   display.firstPage();
   do {
     display.setFont(BASE_FONT_BIG);
-    int y = (display.getDisplayHeight()-(lineCnt-1)*display.getMaxCharHeight())/2;
-    display.firstPage();
-    do {
-      for(int i=0; i< lineCnt; i++) {
-        display.drawStr((display.getDisplayWidth() - display.getStrWidth(lines[i]))/2, y, lines[i]);
-        if(i==0) {
-          if(strcmp(lines[1]," ")==0)
-            display.drawHLine(0, y+3, display.getDisplayWidth());
-        }
-        y += display.getMaxCharHeight();
-      }
-    } while(display.nextPage());
-    display.setFont(BASE_FONT);
-  } while(display.nextPage());  
+    display.setFontMode(0);
+    display.setDrawColor(1);
+    display.drawFrame(0, 0, display.getDisplayWidth(), display.getDisplayHeight());
+    int cnt = drawTextLines(message, pgm, y, TEXT_DRAW | TEXT_SKIP_EMPTY | TEXT_TITLE_LINE);
+    drawTextLines(addMessage, true, y+cnt*lineHeight, TEXT_DRAW | TEXT_SKIP_EMPTY);
+  } while(display.nextPage());
+  display.setFont(BASE_FONT);
   displayingUserMessage  = true;
   userMessageTime = millis();
 }
 
+void drawUserMessage(String message) {
+  drawMessage(message.c_str(), false, NULL);
+}
+
+/*
+  Same as drawUserMessage() but for messages in flash. The additional 
+  message (if any) starts on a new line.
+*/
+void drawUserMessageP(PGM_P message, PGM_P addMessage) {
+  drawMessage(message, true, addMessage);
+}
 
 void drawSDStatus(int stat) {
   resetDisplay();
@@ -256,6 +519,8 @@ void drawSDStatus(int stat) {
   } while(display.nextPage());
 }
 
+#endif
+
 bool selectorEndstop() {
   return steppers[SELECTOR].getEndstopHit();
 }
@@ -272,46 +537,120 @@ void setAbortRequested(bool state) {
   steppers[FEEDER].setAbort(state);  // stop any ongoing stepper movements
 }
 
-uint8_t u8x8_GetMenuEvent(u8x8_t *u8x8)
-{
-  int stat = 0;
-  int button = digitalRead(ENCODER_BUTTON_PIN);
-  int turn = encoder.getValue();
-  
-  if (button == LOW) {
-    delay(20);
-    button = digitalRead(ENCODER_BUTTON_PIN);
-    if (button == LOW && u8x8->debounce_state == HIGH) {
-      stat = U8X8_MSG_GPIO_MENU_SELECT;
-      resetAutoClose();
-      turn = encoder.getValue();
+#ifndef HEADLESS
+/*
+  Fetches the encoder events queued by the encoder interrupt.
+  Turns get summed up until a button event comes along, which ends 
+  the fetch, so that the events are handled in the order they occurred.
+  Returns true if there was any event.
+*/
+bool getEncoderButton(int* turn, int* button, bool* isHeld, bool* isClicked) {
+  ClickEncoder::Event ev;
+  bool stat = false;
+
+  *turn = 0;
+  *button = ClickEncoder::Open;
+  while(encoder.getEvent(&ev)) {
+    stat = true;
+    inputLatency = millis() - ev.time;
+    if(ev.button == ClickEncoder::Open) {
+      *turn += ev.turn;
+      continue;
     }
+    *button = ev.button;
+    break;
   }
-  else {
-    if (turn != 0) {
-      resetAutoClose();
-      switch (turn)
-      {
-        case 1:
-          stat = U8X8_MSG_GPIO_MENU_NEXT;
-          break;
-        case -1:
-          stat =  U8X8_MSG_GPIO_MENU_PREV;
-          break;
-      }
-    }
+  *isHeld = *button == ClickEncoder::Held;
+  *isClicked = *button == ClickEncoder::Clicked || *button == ClickEncoder::DoubleClicked;
+  return stat;
+}
+#endif
+
+#if defined(__STM32F1__) && !defined(HEADLESS)
+/*
+  Background display transfer:
+  The status screen gets copied into a back buffer, which is sent
+  to the display one tile row per call of serviceDisplay(), so the
+  main loop never stalls on a complete frame. On SPI displays the
+  rows are sent by DMA, which runs while the main program continues.
+*/
+static uint8_t          displayBackBuffer[DSP_BUFFER_SIZE];
+static volatile uint8_t displayPendingRows = 0;
+
+  #ifndef USE_TWI_DISPLAY
+static volatile bool    dmaBusy = false;          // DMA transfer to the display is running
+static volatile bool    dmaEndPending = false;    // end of SPI transfer is due when DMA has finished
+static u8x8_t*          dmaU8x8 = NULL;
+
+static void waitDisplayTransfer() {
+  while(dmaBusy);
+}
+
+/*
+  DMA transfer complete interrupt
+*/
+static void displayDmaComplete() {
+  dma_disable(DMA2, DMA_CH2);
+  spi_tx_dma_disable(SPI3);
+  while(!spi_is_tx_empty(SPI3));
+  while(spi_is_busy(SPI3));
+  spi_rx_reg(SPI3);             // clear overrun caused by the data not being read
+  if(dmaEndPending) {
+    u8x8_gpio_SetCS(dmaU8x8, dmaU8x8->display_info->chip_disable_level);
+    SPI_3.endTransaction();
+    dmaEndPending = false;
   }
-  u8x8->debounce_state = button;
-  if(!isWarning) {
-    checkSerialPending();
-    if(checkAutoClose()) {
-      stat = U8X8_MSG_GPIO_MENU_HOME;
+  dmaBusy = false;
+}
+
+static void startDisplayDma(uint8_t* data, uint16_t len) {
+  dmaBusy = true;
+  dma_setup_transfer(DMA2, DMA_CH2, &SPI3->regs->DR, DMA_SIZE_8BITS, data, DMA_SIZE_8BITS, (DMA_MINC_MODE | DMA_FROM_MEM | DMA_TRNS_CMPLT));
+  dma_set_num_transfers(DMA2, DMA_CH2, len);
+  dma_clear_isr_bits(DMA2, DMA_CH2);
+  spi_tx_dma_enable(SPI3);
+  dma_enable(DMA2, DMA_CH2);
+}
+  #else
+static void waitDisplayTransfer() {
+}
+  #endif
+
+/*
+  Queues the tile rows given (bit mask) of the current frame buffer
+  to be sent in background.
+*/
+void queueDisplayRows(uint8_t rows) {
+  uint8_t* buf = display.getBufferPtr();
+  uint16_t rowSize = display.getBufferTileWidth()*8;
+  waitDisplayTransfer();
+  for(uint8_t row=0; row < 8; row++) {
+    if(rows & _BV(row))
+      memcpy(&displayBackBuffer[row*rowSize], &buf[row*rowSize], rowSize);
+  }
+  displayPendingRows |= rows;
+}
+
+void cancelDisplayRows() {
+  displayPendingRows = 0;
+}
+
+/*
+  Sends the next pending tile row to the display.
+*/
+void serviceDisplay() {
+  if(displayPendingRows == 0)
+    return;
+  uint8_t tw = display.getBufferTileWidth();
+  for(uint8_t row=0; row < 8; row++) {
+    if(displayPendingRows & _BV(row)) {
+      displayPendingRows &= ~_BV(row);
+      u8x8_DrawTile(display.getU8x8(), 0, row, tw, &displayBackBuffer[row*tw*8]);
+      break;
     }
   }
-  return stat;
 }
 
-#ifdef __STM32F1__
   #ifndef USE_TWI_DISPLAY
 
 /* =========================================
@@ -331,6 +670,10 @@ Otherwise the linker will throw an error message.
 
 This function is a copy of the above mentioned
 and it sends data to SPI3 instead of SPI1.
+Blocks of data are sent by DMA. If the data comes from the
+back buffer, the function returns without waiting for the
+transfer to complete; the transfer gets finished by the DMA
+interrupt.
 =========================================== */
 uint8_t u8x8_byte_arduino_2nd_hw_spi(U8X8_UNUSED u8x8_t *u8x8, U8X8_UNUSED uint8_t msg, U8X8_UNUSED uint8_t arg_int, U8X8_UNUSED void *arg_ptr)
 {
@@ -346,7 +689,15 @@ uint8_t u8x8_byte_arduino_2nd_hw_spi(U8X8_UNUSED u8x8_t *u8x8, U8X8_UNUSED uint8
       // so it can not be used...
       // SPI.transfer((uint8_t *)arg_ptr, arg_int);
       
+      waitDisplayTransfer();
       data = (uint8_t *)arg_ptr;
+      if(arg_int >= DSP_DMA_MIN_LEN) {
+        startDisplayDma(data, arg_int);
+        // any other buffer may be modified as soon as we return
+        if(data < displayBackBuffer || data >= displayBackBuffer + sizeof(displayBackBuffer))
+          waitDisplayTransfer();
+        break;
+      }
       while( arg_int > 0 )
       {
         SPI_3.transfer((uint8_t)*data);
@@ -369,14 +720,19 @@ uint8_t u8x8_byte_arduino_2nd_hw_spi(U8X8_UNUSED u8x8_t *u8x8, U8X8_UNUSED uint8
       
       /* setup hardware with SPI.begin() instead of previous digitalWrite() and pinMode() calls */
       SPI_3.begin();	
+      dmaU8x8 = u8x8;
+      dma_init(DMA2);
+      dma_attach_interrupt(DMA2, DMA_CH2, displayDmaComplete);
 
       break;
       
     case U8X8_MSG_BYTE_SET_DC:
+      waitDisplayTransfer();
       u8x8_gpio_SetDC(u8x8, arg_int);
       break;
       
     case U8X8_MSG_BYTE_START_TRANSFER:
+      waitDisplayTransfer();
       /* SPI1 mode has to be mapped to the mode of the current controller, at least Uno, Due, 101 have different SPI_MODEx values */
       internal_spi_mode =  0;
       switch(u8x8->display_info->spi_mode)
@@ -407,6 +763,14 @@ uint8_t u8x8_byte_arduino_2nd_hw_spi(U8X8_UNUSED u8x8_t *u8x8, U8X8_UNUSED uint8
       break;
       
     case U8X8_MSG_BYTE_END_TRANSFER:      
+      noInterrupts();
+      if(dmaBusy) {
+        // leave it up to the DMA interrupt
+        dmaEndPending = true;
+        interrupts();
+        break;
+      }
+      interrupts();
       u8x8->gpio_and_delay_cb(u8x8, U8X8_MSG_DELAY_NANO, u8x8->display_info->pre_chip_disable_wait_ns, NULL);
       u8x8_gpio_SetCS(u8x8, u8x8->display_info->chip_disable_level);
 
@@ -482,7 +846,7 @@ bool showFeederLoadedMessage() {
     unloadFilament();
     state = true;
   }
-  display.clearDisplay();
+  resetDisplay();
   return state;
 }
 
@@ -499,7 +863,7 @@ bool showFeederLoadMessage() {
       loadFilament();
     state = true;
   }
-  display.clearDisplay();
+  resetDisplay();
   return state;
 }
 
@@ -512,32 +876,121 @@ bool showFeederFailedMessage(int state) {
     button = showDialog(P_TitleWarning, state == 1 ? P_CantLoad : P_CantUnload, P_CheckUnit, P_CancelRetryButtons);
   } while(button != 1 && button != 2);
   isWarning = false;
-  display.clearDisplay();
-  debounceButton();
+  resetDisplay();
   return button == 1 ? false : true;
 }
 
+#ifndef HEADLESS
+static uint8_t countButtons(PGM_P buttons) {
+  uint8_t cnt = (pgm_read_byte(buttons) != 0) ? 1 : 0;
+  char c;
+  while((c = pgm_read_byte(buttons++)) != 0) {
+    if(c == '\n')
+      cnt++;
+  }
+  return cnt;
+}
+
+/*
+  Draws the buttons side by side on the baseline y, the one 
+  selected being inverted.
+*/
+static void drawButtons(PGM_P buttons, uint8_t selected, int y) {
+  char label[DLG_LINE_LEN];
+  const char* p;
+  uint8_t i;
+  int width = display.getDisplayWidth();
+  int ascent = display.getAscent();
+  int height = ascent - display.getDescent() + 2;
+  int x = 0;
+
+  for(p = buttons; p != NULL; ) {
+    p = fetchLine(p, true, label, width);
+    x += display.getStrWidth(label) + 4;
+  }
+  x = (width - x)/2 + 2;
+  for(p = buttons, i = 0; p != NULL; i++) {
+    p = fetchLine(p, true, label, width);
+    int w = display.getStrWidth(label);
+    display.setDrawColor(1);
+    if(i == selected) {
+      display.drawBox(x-1, y-ascent-1, w+2, height);
+      display.setDrawColor(0);
+    }
+    else
+      display.drawFrame(x-1, y-ascent-1, w+2, height);
+    display.drawStr(x, y, label);
+    x += w + 4;
+  }
+  display.setDrawColor(1);
+}
+
+static void drawDialog(PGM_P title, PGM_P message, PGM_P addMessage, PGM_P buttons, uint8_t selected) {
+  display.setFont(BASE_FONT);
+  int width = display.getDisplayWidth();
+  int lineHeight = display.getMaxCharHeight();
+  int titleCnt = drawTextLines(title, true, 0, 0);
+  int lineCnt = titleCnt + drawTextLines(message, true, 0, 0) + drawTextLines(addMessage, true, 0, 0) + 1;
+  int top = (display.getDisplayHeight() - lineCnt*lineHeight - (titleCnt > 0 ? 3 : 0))/2;
+  if(top < 0)
+    top = 0;
+  display.firstPage();
+  do {
+    display.setFont(BASE_FONT);
+    display.setFontMode(1);
+    display.setDrawColor(1);
+    int y = top + display.getAscent();
+    y += drawTextLines(title, true, y, TEXT_DRAW)*lineHeight;
+    if(titleCnt > 0) {
+      display.drawHLine(0, y-lineHeight-display.getDescent()+1, width);
+      y += 3;
+    }
+    y += drawTextLines(message, true, y, TEXT_DRAW)*lineHeight;
+    y += drawTextLines(addMessage, true, y, TEXT_DRAW)*lineHeight;
+    drawButtons(buttons, selected, y);
+  } while(display.nextPage());
+  display.setFontMode(0);
+}
+
+/*
+  Shows a dialog and waits for one of the buttons to be picked.
+  Returns the button number (1..n) or 0 if the dialog closed 
+  automatically after menuAutoClose seconds (not for warnings).
+*/
 int showDialog(PGM_P title, PGM_P message, PGM_P addMessage, PGM_P buttons) {
+  uint8_t count = countButtons(buttons);
+  uint8_t selected = 0;
+  int turn, button;
+  bool isHeld, isClicked;
+
   if(isPwrSave) {
     setPwrSave(0);
   }
-  char _title[80];
-  char msg1[256];
-  char msg2[80];
-  char btn[60];
-  sprintf_P(_title, title);
-  sprintf_P(msg1, message);
-  sprintf_P(msg2, addMessage);
-  sprintf_P(btn, buttons);
-  return display.userInterfaceMessage(_title, msg1, msg2, btn);
+  invalidateStatus();
+  resetAutoClose();
+  drawDialog(title, message, addMessage, buttons, selected);
+  while(1) {
+    if(getEncoderButton(&turn, &button, &isHeld, &isClicked)) {
+      resetAutoClose();
+      if(isClicked)
+        return selected+1;
+      if(turn != 0 && count > 1) {
+        selected = (selected + count + (turn > 0 ? 1 : -1)) % count;
+        drawDialog(title, message, addMessage, buttons, selected);
+      }
+    }
+    if(!isWarning) {
+      checkSerialPending();
+      if(checkAutoClose())
+        return 0;
+    }
+  }
 }
+#endif
 
 void signalNoTool() {
-  char _msg1[256];
   userBeep();
-  sprintf_P(_msg1, P_NoTool);
-  strcat_P(_msg1, P_Aborting);
-  drawUserMessage(_msg1);
+  drawUserMessageP(P_NoTool, P_Aborting);
 }
 
 void positionRevolver() {
@@ -754,6 +1207,7 @@ bool loadFilament(bool showMessage) {
   steppers[FEEDER].setAbort(false);
 
   parserBusy = false;
+  runMacroHook(P_HookLoad, toolSelected);
   return true;
 }
 
@@ -807,6 +1261,7 @@ bool loadFilamentPMMU2(bool showMessage) {
   steppers[FEEDER].setAbort(false);
 
   parserBusy = false;
+  runMacroHook(P_HookLoad, toolSelected);
   return true;
 }
 
@@ -924,18 +1379,17 @@ bool unloadFilament() {
   }
 
   parserBusy = false;
+  runMacroHook(P_HookUnload, toolSelected);
   return true;
 }
 
 bool selectTool(int ndx, bool showMessage) {
 
-  char _msg1[256];
+  unsigned long startTime = millis();
   ndx = swapTools[ndx];
   if(feederJammed) {
     beep(4);
-    sprintf_P(_msg1, P_FeederJammed);
-    strcat_P(_msg1, P_Aborting);
-    drawUserMessage(_msg1);
+    drawUserMessageP(P_FeederJammed, P_Aborting);
     feederJammed = false;
     return false;
   }
@@ -944,8 +1398,7 @@ bool selectTool(int ndx, bool showMessage) {
   if(toolSelected == ndx) { // tool is the one we already have selected, do nothing
     if(!smuffConfig.externalControl_Z) {
       userBeep();
-      sprintf_P(_msg1, P_ToolAlreadySet);
-      drawUserMessage(_msg1);
+      drawUserMessageP(P_ToolAlreadySet);
     }
     if(smuffConfig.externalControl_Z) {
       signalSelectorReady();
@@ -973,8 +1426,8 @@ bool selectTool(int ndx, bool showMessage) {
         M18("M18", "", 0);   // motors off
         showFeederFailedMessage(0);
         if(smuffConfig.unloadCommand != NULL && strlen(smuffConfig.unloadCommand) > 0) {
-          Serial2.print(smuffConfig.unloadCommand);
-          Serial2.print("\n");
+          printResponse(smuffConfig.unloadCommand, 2);
+          printResponseP(PSTR("\n"), 2);
           //__debug(PSTR("Feeder jammed, sent unload command '%s'\n"), smuffConfig.unloadCommand);
         }
       }
@@ -1010,10 +1463,12 @@ bool selectTool(int ndx, bool showMessage) {
     signalSelectorReady();
   }
   if(testMode) {
-    Serial2.print("T");
-    Serial2.println(ndx); 
+    sprintf_P(tmp, PSTR("T%d\r\n"), ndx);
+    printResponse(tmp, 2); 
   }
+  lastToolChangeTime = millis() - startTime;
   parserBusy = false;
+  runMacroHook(P_HookToolChange, toolSelected);
   return true;
 }
 
@@ -1067,6 +1522,63 @@ void prepSteppingRelMillimeter(int index, float millimeter, bool ignoreEndstop)
   setStepperSteps(index, steps, ignoreEndstop);
 }
 
+/*
+  Allocation free number formatting for all the status output,
+  used instead of String(...). Each function returns the buffer passed,
+  which must be able to hold at least 14 characters.
+*/
+char* fmtInt(char* buf, long val) {
+  sprintf_P(buf, PSTR("%ld"), val);
+  return buf;
+}
+
+/*
+  Formats a fixed point value, i.e. fmtFixed(buf, 1234, 2) results in "12.34".
+*/
+char* fmtFixed(char* buf, long val, uint8_t decimals) {
+  static const long scale[] = { 1, 10, 100, 1000 };
+  char* p = buf;
+  if(val < 0) {
+    *p++ = '-';
+    val = -val;
+  }
+  if(decimals == 0 || decimals > 3)
+    sprintf_P(p, PSTR("%ld"), val);
+  else
+    sprintf_P(p, PSTR("%ld.%0*ld"), val / scale[decimals], (int)decimals, val % scale[decimals]);
+  return buf;
+}
+
+/*
+  Formats a stepper position given in steps as millimeter with 2 decimals.
+*/
+char* fmtMM(char* buf, long steps, long stepsPerMM) {
+  if(stepsPerMM == 0)
+    return fmtFixed(buf, 0, 2);
+  long val = steps * 100;
+  val += (val < 0) ? -stepsPerMM/2 : stepsPerMM/2;  // round
+  return fmtFixed(buf, val / stepsPerMM, 2);
+}
+
+char* fmtFloat(char* buf, float val, uint8_t decimals) {
+  long scale = 1;
+  for(uint8_t i=0; i < decimals; i++)
+    scale *= 10;
+  return fmtFixed(buf, (long)(val * scale + (val < 0 ? -0.5f : 0.5f)), decimals);
+}
+
+/*
+  CRC16 (CCITT) of the data given.
+*/
+uint16_t crc16(const uint8_t* data, uint16_t len, uint16_t crc) {
+  while(len--) {
+    crc ^= (uint16_t)*data++ << 8;
+    for(uint8_t i=0; i < 8; i++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
 void printEndstopState(int serial) {
   const char* _triggered = "triggered";
   const char* _open      = "open";
@@ -1078,31 +1590,34 @@ void printEndstopState(int serial) {
 }
 
 void printSpeeds(int serial) {
+  char feeder[14];
   sprintf_P(tmp, P_AccelSpeed,
-          String(steppers[SELECTOR].getMaxSpeed()).c_str(),
-          String(smuffConfig.stepDelay_X).c_str(),
-          String(steppers[REVOLVER].getMaxSpeed()).c_str(),
-          String(smuffConfig.stepDelay_Y).c_str(),
-          smuffConfig.externalControl_Z ? "external" : String(steppers[FEEDER].getMaxSpeed()).c_str(),
-          String(smuffConfig.stepDelay_Z).c_str());
+          steppers[SELECTOR].getMaxSpeed(),
+          smuffConfig.stepDelay_X,
+          steppers[REVOLVER].getMaxSpeed(),
+          smuffConfig.stepDelay_Y,
+          smuffConfig.externalControl_Z ? "external" : fmtInt(feeder, steppers[FEEDER].getMaxSpeed()),
+          smuffConfig.stepDelay_Z);
   printResponse(tmp, serial);
 }
 
 void printAcceleration(int serial) {
+  char feeder[14];
   sprintf_P(tmp, P_AccelSpeed,
-          String(steppers[SELECTOR].getAcceleration()).c_str(),
-          String(smuffConfig.stepDelay_X).c_str(),
-          String(steppers[REVOLVER].getAcceleration()).c_str(),
-          String(smuffConfig.stepDelay_Y).c_str(),
-          smuffConfig.externalControl_Z ? "external" : String(steppers[FEEDER].getAcceleration()).c_str(),
-          String(smuffConfig.stepDelay_Z).c_str());
+          steppers[SELECTOR].getAcceleration(),
+          smuffConfig.stepDelay_X,
+          steppers[REVOLVER].getAcceleration(),
+          smuffConfig.stepDelay_Y,
+          smuffConfig.externalControl_Z ? "external" : fmtInt(feeder, steppers[FEEDER].getAcceleration()),
+          smuffConfig.stepDelay_Z);
   printResponse(tmp, serial);
 }
 
 void printOffsets(int serial) {
+  char selector[14], revolver[14];
   sprintf_P(tmp, P_Positions,
-          String((int)(smuffConfig.firstToolOffset*10)).c_str(),
-          String(smuffConfig.firstRevolverOffset).c_str(),
+          fmtInt(selector, (int)(smuffConfig.firstToolOffset*10)),
+          fmtInt(revolver, smuffConfig.firstRevolverOffset),
           "--");
   printResponse(tmp, serial);
 }
@@ -1247,9 +1762,9 @@ void setSignalPort(int port, bool state) {
   if(!smuffConfig.prusaMMU2) {
     sprintf(tmp,"%c%c%s", 0x1b, port, state ? "1" : "0");
 #ifdef __STM32F1__
-    Serial1.write(tmp);
+    printResponse(tmp, 1);
 #else
-    Serial2.write(tmp);
+    printResponse(tmp, 2);
 #endif
   }
 }
@@ -1296,45 +1811,10 @@ void listDir(File root, int numTabs, int serial) {
   }
 }
 
-bool getFiles(const char* rootFolder, const char* pattern, int maxFiles, bool cutExtension, char* files) {
-  char fname[40];
-  char tmp[40];
-  int cnt = 0;
-  FsFile file;
-  FsFile root;
-  SdFat SD;
-
-  if(SD.begin()) {
-    root.open(rootFolder, O_READ);
-    while (file.openNext(&root, O_READ)) {
-      if (!file.isHidden()) {
-        file.getName(fname, sizeof(fname));
-        //__debug(PSTR("File: %s"), fname);
-        String lfn = String(fname);
-        if(pattern != NULL && !lfn.endsWith(pattern)) {
-          continue;
-        }
-        if(pattern != NULL && cutExtension)
-          lfn.replace(pattern,"");
-        sprintf(tmp,"%-20s\n", lfn.c_str());
-        strcat(files, tmp);
-      }
-      file.close();
-      if(cnt >= maxFiles)
-        break;
-    }
-    root.close();
-    files[strlen(files)-1] = '\0';
-    return true;
-  }
-  return false;
-}
-
 void testRun(String fname) {
   char line[80];
   char msg[256];
   char delimiter[] = { "\n" };
-  SdFat SD;
   FsFile file;
   String gCode;
   unsigned long loopCnt = 1L, cmdCnt = 1L;
@@ -1342,10 +1822,12 @@ void testRun(String fname) {
   int mode = 1, toolChanges = 0;
   unsigned long startTime = millis();
   unsigned long endstop2Miss = 0, endstop2Hit = 0;
-  
-  debounceButton();
+#ifndef HEADLESS
+  int turn, button;
+  bool isHeld, isClicked;
+#endif
 
-  if(SD.begin()) {
+  if(mountSD()) {
     steppers[REVOLVER].setEnabled(true);
     steppers[SELECTOR].setEnabled(true);
     steppers[FEEDER].setEnabled(true);
@@ -1359,11 +1841,15 @@ void testRun(String fname) {
     gCode.reserve(60);
     if(file.open(fname.c_str(), O_READ)) {
       file.rewind();
+#ifdef HEADLESS
+      beginHostPrompt(P_MnuTestrun, P_TestRunning, PSTR(""), P_StopButtonOnly);
+#endif
 
       while(1) {
-        if(encoder.getButton() == ClickEncoder::Clicked)
+#ifndef HEADLESS
+        getEncoderButton(&turn, &button, &isHeld, &isClicked);
+        if(isClicked)
           break;
-        int turn = encoder.getValue();
         if(turn < 0) { 
           mode--;
           if(mode < 0)
@@ -1374,6 +1860,11 @@ void testRun(String fname) {
           if(mode > 3)
             mode = 0;
         }
+#else
+        checkSerialPending();
+        if(promptResponse != -1)
+          break;
+#endif
         unsigned long secs = (millis()-startTime)/1000;
         if(file.fgets(line, sizeof(line)-1, delimiter) > 0) {
           gCode = line;
@@ -1433,6 +1924,9 @@ void testRun(String fname) {
         }
         drawTestrunMessage(loopCnt, msg);
       }
+#ifdef HEADLESS
+      endHostPrompt();
+#endif
       file.close();
     }
     else {
@@ -1446,14 +1940,21 @@ void testRun(String fname) {
 void __debug(const char* fmt, ...) {
 #ifdef DEBUG
   char _tmp[512];
+  int len;
+  // the message is assembled as a whole, so it's either sent or dropped completely
+  strcpy_P(_tmp, PSTR("echo: dbg: "));
+  len = strlen(_tmp);
   va_list arguments;
   va_start(arguments, fmt); 
-  vsnprintf_P(_tmp, 511, fmt, arguments);
+  vsnprintf_P(_tmp+len, sizeof(_tmp)-len-20, fmt, arguments);
   va_end (arguments); 
+  len = strlen(_tmp);
 #ifdef __AVR__
-  Serial.print(F("echo: dbg: "));  Serial.print(_tmp); Serial.print(" - Mem: "); Serial.println(freeMemory());
+  sprintf_P(_tmp+len, PSTR(" - Mem: %d\r\n"), freeMemory());
+  txBuffer[0].send(_tmp, false, TxBuffer::PRIO_DEBUG);
 #else
-  Serial1.print(F("echo: dbg: "));  Serial1.println(_tmp);
+  strcpy_P(_tmp+len, PSTR("\r\n"));
+  txBuffer[1].send(_tmp, false, TxBuffer::PRIO_DEBUG);
 #endif
 #endif
 }
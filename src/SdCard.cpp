@@ -0,0 +1,132 @@
+/**
+ * SMuFF Firmware
+ * Copyright (C) 2019 Technik Gegg
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Module for sharing the SD-Card between all the modules reading or writing
+ * files. The card gets initialized once and stays mounted. Since there's no
+ * card detect switch, the card's CID is read on each mountSD(), which is a
+ * single command to the card and reveals both, a card removed or swapped;
+ * in that case the card gets initialized again.
+ * All files are opened on the one volume SD, so file handles kept open
+ * (i.e. the data store journal) never refer to a volume gone.
+ */
+
+#include "SMuFF.h"
+
+SdFs            SD;
+
+static bool     sdMounted = false;
+static cid_t    sdCid;                          // CID of the card mounted
+
+/*
+  Directory index: the names of the files matching a pattern in a folder,
+  read once and kept until the card gets changed.
+*/
+static char     fileIndex[FILE_INDEX_MAX][FILE_INDEX_NAME_LEN];
+static int      fileIndexCnt = -1;              // -1 if the index isn't valid
+static char     fileIndexFolder[FILE_INDEX_NAME_LEN];
+static char     fileIndexPattern[10];
+
+/*
+  Makes sure the card is mounted, mounts it again if the card
+  has been changed in the meantime.
+  Returns false if there's no card to be used.
+*/
+bool mountSD() {
+  cid_t cid;
+
+  if(sdMounted) {
+    if(SD.card()->readCID(&cid) && memcmp(&cid, &sdCid, sizeof(cid)) == 0)
+      return true;
+    //__debug(PSTR("SD-Card changed"));
+    unmountSD();
+  }
+  if(!SD.begin() || !SD.card()->readCID(&sdCid))
+    return false;
+  sdMounted = true;
+  return true;
+}
+
+/*
+  Forgets about the card mounted and everything read from it.
+*/
+void unmountSD() {
+  releaseStore();
+  clearMacros();
+  fileIndexCnt = -1;
+  sdMounted = false;
+}
+
+/*
+  Reads the names of the (not hidden) files in folder ending with pattern
+  into the directory index, without the extension given by pattern.
+  The index is read from the card only if folder or pattern have changed.
+  Returns the number of files in the index or -1 if the card is not available.
+*/
+int indexFiles(const char* folder, const char* pattern) {
+  FsFile root;
+  FsFile file;
+  char fname[40];
+
+  if(!mountSD())
+    return -1;
+  if(fileIndexCnt != -1 && strcmp(folder, fileIndexFolder) == 0 && strcmp(pattern, fileIndexPattern) == 0)
+    return fileIndexCnt;
+
+  fileIndexCnt = 0;
+  strncpy(fileIndexFolder, folder, sizeof(fileIndexFolder)-1);
+  fileIndexFolder[sizeof(fileIndexFolder)-1] = 0;
+  strncpy(fileIndexPattern, pattern, sizeof(fileIndexPattern)-1);
+  fileIndexPattern[sizeof(fileIndexPattern)-1] = 0;
+  if(!root.open(folder, O_READ))
+    return fileIndexCnt;
+  int patLen = strlen(pattern);
+  while(fileIndexCnt < FILE_INDEX_MAX && file.openNext(&root, O_READ)) {
+    if(!file.isHidden() && !file.isDir()) {
+      file.getName(fname, sizeof(fname));
+      int len = strlen(fname) - patLen;
+      if(len > 0 && len < FILE_INDEX_NAME_LEN && strcasecmp(fname+len, pattern) == 0) {
+        memcpy(fileIndex[fileIndexCnt], fname, len);
+        fileIndex[fileIndexCnt][len] = 0;
+        fileIndexCnt++;
+      }
+    }
+    file.close();
+  }
+  root.close();
+  return fileIndexCnt;
+}
+
+/*
+  Returns the name of a file in the directory index or an empty string
+  if there's no such file (anymore).
+  Since the index is shared, folder and pattern must be the ones the
+  caller has indexed; if someone else has indexed another folder in the
+  meantime, the index gets read again. Otherwise the card isn't accessed
+  at all (it has been checked by indexFiles() already).
+*/
+const char* getIndexedFile(const char* folder, const char* pattern, int index) {
+  if(fileIndexCnt == -1 || strcmp(folder, fileIndexFolder) != 0 || strcmp(pattern, fileIndexPattern) != 0) {
+    if(indexFiles(folder, pattern) == -1)
+      return "";
+  }
+  if(index < 0 || index >= fileIndexCnt)
+    return "";
+  return fileIndex[index];
+}
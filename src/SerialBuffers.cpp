@@ -0,0 +1,475 @@
+/**
+ * SMuFF Firmware
+ * Copyright (C) 2019 Technik Gegg
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Module for non-blocking serial output and interrupt driven serial input
+ */
+
+#include "SMuFF.h"
+#include "SerialBuffers.h"
+
+TxBuffer txBuffer[NUM_SERIALS];
+RxBuffer rxBuffer[NUM_SERIALS];
+
+typedef struct {
+  int8_t      rate = -1;          // index into autobaudRates; -1 if not active
+  uint8_t     valid = 0;          // number of valid characters in the current line
+  char        first = 0;          // first character of the current line
+} AutobaudState;
+
+// most likely rates first
+static const unsigned long autobaudRates[] = { 115200, 250000, 57600, 230400, 500000, 1000000, 38400, 19200, 9600 };
+#define NUM_AUTOBAUD_RATES  (sizeof(autobaudRates)/sizeof(autobaudRates[0]))
+
+static unsigned long  pendingBaudrate[NUM_SERIALS];
+static unsigned long  pendingTime[NUM_SERIALS];
+static AutobaudState  autobaud[NUM_SERIALS];
+
+static Print* getPort(int serial) {
+  switch(serial) {
+    case 0: return &Serial;
+    case 1: return &Serial1;
+    case 2: return &Serial2;
+    case 3: return &Serial3;
+  }
+  return NULL;
+}
+
+static Stream* getStream(int serial) {
+  switch(serial) {
+    case 0: return &Serial;
+    case 1: return &Serial1;
+    case 2: return &Serial2;
+    case 3: return &Serial3;
+  }
+  return NULL;
+}
+
+/*
+  Returns the number of bytes the port is able to take
+  without blocking.
+*/
+static int getPortRoom(int serial) {
+  switch(serial) {
+#ifdef __STM32F1__
+    case 0: return 64;    // USB CDC, packetized by the USB stack
+#else
+    case 0: return Serial.availableForWrite();
+#endif
+    case 1: return Serial1.availableForWrite();
+    case 2: return Serial2.availableForWrite();
+    case 3: return Serial3.availableForWrite();
+  }
+  return 0;
+}
+
+void TxBuffer::attach(int serial, bool isrSafe) {
+  _serial = serial;
+  _isrSafe = isrSafe;
+  _head = _tail = 0;
+  resetStats();
+}
+
+/*
+  Returns true if the caller may wait for the port to take some bytes,
+  which it never will from within an interrupt or with interrupts disabled.
+*/
+static bool canWait() {
+#ifdef __STM32F1__
+  uint32_t ipsr, primask;
+  asm volatile("mrs %0, ipsr" : "=r" (ipsr));
+  asm volatile("mrs %0, primask" : "=r" (primask));
+  return ipsr == 0 && primask == 0;
+#else
+  return (SREG & _BV(SREG_I)) != 0;
+#endif
+}
+
+void TxBuffer::put(char data) {
+  uint8_t next = (_head + 1) & (TX_BUFFER_LEN-1);
+  while(next == _tail) {
+    if(!canWait()) {
+      _overflows++;
+      return;
+    }
+    service();            // buffer is full, push out whatever the port is able to take
+  }
+  _buffer[_head] = data;
+  _head = next;
+  unsigned int used = getUsed();
+  if(used > _maxUsed)
+    _maxUsed = used;
+}
+
+bool TxBuffer::send(const char* data, bool isProgmem, Priority prio) {
+  if(_serial == -1 || data == NULL)
+    return false;
+  unsigned int len = isProgmem ? strlen_P(data) : strlen(data);
+  if(prio == PRIO_DEBUG) {
+    // debug messages must not make a response wait, so they're either
+    // queued as a whole or dropped if they would eat up the reserve
+    if(!isEmpty() && getFree() < len + TX_BUFFER_LEN/4) {
+      _drops++;
+      return false;
+    }
+  }
+  else if(getFree() < len) {
+    _stalls++;
+  }
+  for(unsigned int i=0; i < len; i++) {
+    put(isProgmem ? (char)pgm_read_byte(data+i) : data[i]);
+  }
+  return true;
+}
+
+/*
+  Queues a short message which bypasses the buffer and is sent as soon
+  as the current line has been sent completely.
+  Meant to be called from within the timer interrupt only.
+*/
+void TxBuffer::sendUrgent(const char* data) {
+  uint8_t len = strlen(data);
+  if(_serial == -1 || len > URGENT_LEN)
+    return;
+  memcpy(_urgent, data, len);
+  _urgentLen = len;
+}
+
+size_t TxBuffer::write(uint8_t data) {
+  if(_serial == -1)
+    return 0;
+  if(getFree() == 0)
+    _stalls++;
+  put((char)data);
+  return 1;
+}
+
+void TxBuffer::service(bool fromIsr) {
+  if(_serial == -1 || _busy || (fromIsr && !_isrSafe))
+    return;
+  _busy = true;
+  Print* port = getPort(_serial);
+  while(true) {
+    int room = getPortRoom(_serial);
+    if(_urgentLen > 0 && _atLineStart) {
+      if(room < _urgentLen)
+        break;
+      // take the message out of the slot with interrupts masked, since
+      // the timer interrupt may queue the next one at any time
+      char msg[URGENT_LEN];
+      if(!fromIsr)
+        noInterrupts();
+      uint8_t len = _urgentLen;
+      memcpy(msg, _urgent, len);
+      _urgentLen = 0;
+      if(!fromIsr)
+        interrupts();
+      port->write((const uint8_t*)msg, len);
+      continue;
+    }
+    if(_tail == _head || room <= 0)
+      break;
+    // send the contiguous part of the buffer only, the rest follows on next turn
+    uint8_t head = _head;
+    unsigned int len = (head > _tail) ? head - _tail : TX_BUFFER_LEN - _tail;
+    if(len > (unsigned int)room)
+      len = room;
+    if(_urgentLen > 0) {
+      // finish the current line only, so the urgent message can go out in between
+      for(unsigned int i=0; i < len; i++) {
+        if(_buffer[_tail+i] == '\n') {
+          len = i+1;
+          break;
+        }
+      }
+    }
+    port->write((const uint8_t*)&_buffer[_tail], len);
+    _atLineStart = _buffer[_tail+len-1] == '\n';
+    _tail = (_tail + len) & (TX_BUFFER_LEN-1);
+  }
+  _busy = false;
+}
+
+void TxBuffer::drain() {
+  while(!isEmpty()) {
+    service();
+  }
+}
+
+void setupTxBuffers() {
+  for(int i=0; i < NUM_SERIALS; i++) {
+#ifdef __STM32F1__
+    txBuffer[i].attach(i, i != 0);    // don't feed the USB stack from within the timer interrupt
+#else
+    txBuffer[i].attach(i, true);
+#endif
+  }
+}
+
+void serviceTxBuffers(bool fromIsr) {
+  for(int i=0; i < NUM_SERIALS; i++) {
+    txBuffer[i].service(fromIsr);
+  }
+}
+
+void drainTxBuffers() {
+  for(int i=0; i < NUM_SERIALS; i++) {
+    txBuffer[i].drain();
+  }
+}
+
+void printSerialStatistics(int serial) {
+  char tmp[100];
+  for(int i=0; i < NUM_SERIALS; i++) {
+    sprintf_P(tmp, P_TxStatistics, i, txBuffer[i].getUsed(), TX_BUFFER_LEN-1, txBuffer[i].getMaxUsed(), txBuffer[i].getStalls(), txBuffer[i].getDrops(), txBuffer[i].getOverflows());
+    printResponse(tmp, serial);
+  }
+  for(int i=0; i < NUM_SERIALS; i++) {
+    if(!rxBuffer[i].isAttached())
+      continue;
+    sprintf_P(tmp, P_RxStatistics, i, rxBuffer[i].getOverruns(), rxBuffer[i].getFastReplies());
+    printResponse(tmp, serial);
+  }
+}
+
+void RxBuffer::attach(int serial) {
+  _head = _tail = 0;
+  _frame = FRAME_START;
+  _heldLen = 0;
+  resetStats();
+  _serial = serial;
+}
+
+void RxBuffer::put(char data) {
+  uint8_t next = (_head + 1) & (RX_BUFFER_LEN-1);
+  if(next == _tail) {
+    _overruns++;
+    return;
+  }
+  _buffer[_head] = data;
+  _head = next;
+}
+
+int RxBuffer::read() {
+  if(_head == _tail)
+    return -1;
+  char data = _buffer[_tail];
+  _tail = (_tail + 1) & (RX_BUFFER_LEN-1);
+  return data;
+}
+
+/*
+  Checks whether the data received is part of a FINDA status request.
+  Returns true if the character has been consumed (i.e. held back or answered).
+*/
+bool RxBuffer::checkFastPath(char data) {
+  switch(_frame) {
+    case FRAME_START:
+      if(data == 'P') {
+        _held[_heldLen++] = data;
+        _frame = FRAME_P;
+        return true;
+      }
+      break;
+    case FRAME_P:
+      if(data == '0') {
+        _held[_heldLen++] = data;
+        _frame = FRAME_P0;
+        return true;
+      }
+      break;
+    case FRAME_P0:
+      if(data == '\r' && _heldLen < sizeof(_held)) {
+        _held[_heldLen++] = data;
+        return true;
+      }
+      if(data == '\n') {
+        txBuffer[_serial].sendUrgent(cachedFeederEndstop ? "1ok\n" : "0ok\n");
+        _fastReplies++;
+        _heldLen = 0;
+        _frame = FRAME_START;
+        return true;
+      }
+      break;
+    case FRAME_LINE:
+      break;
+  }
+  // not a FINDA request, pass on whatever has been held back
+  for(uint8_t i=0; i < _heldLen; i++)
+    put(_held[i]);
+  _heldLen = 0;
+  _frame = (data == '\n') ? FRAME_START : FRAME_LINE;
+  return false;
+}
+
+/*
+  Reads all the data available from the serial port.
+  Called from within the timer interrupt.
+*/
+void RxBuffer::poll() {
+  if(_serial == -1)
+    return;
+  Stream* port = getStream(_serial);
+  while(port->available()) {
+    char data = (char)port->read();
+    if(smuffConfig.prusaMMU2 && checkFastPath(data))
+      continue;
+    put(data);
+  }
+}
+
+void setupRxBuffers() {
+  // ports connected to the printer (Prusa MMU2 emulation)
+#ifdef __STM32F1__
+  rxBuffer[1].attach(1);
+  rxBuffer[3].attach(3);
+#else
+  rxBuffer[2].attach(2);
+#endif
+}
+
+void pollRxBuffers() {
+  for(int i=0; i < NUM_SERIALS; i++) {
+    rxBuffer[i].poll();
+  }
+}
+
+void setBaudrate(int serial, unsigned long baudrate) {
+  switch(serial) {
+#ifndef __STM32F1__
+    // on the STM32 Serial is the USB CDC port, which has no baudrate
+    // and would disconnect the host if it got restarted
+    case 0: Serial.end();  Serial.begin(baudrate);  break;
+#endif
+    case 1: Serial1.end(); Serial1.begin(baudrate); break;
+    case 2: Serial2.end(); Serial2.begin(baudrate); break;
+    case 3: Serial3.end(); Serial3.begin(baudrate); break;
+  }
+}
+
+/*
+  Returns the serial ports assigned to the port number used
+  in the configuration (1 = Serial1Baudrate, 2 = Serial2Baudrate).
+  Port 1 is the USB CDC port on the STM32, which has no baudrate;
+  port 2 are Serial1 and Serial3 there, which share Serial2Baudrate.
+*/
+static int getSerials(int port, int serials[2]) {
+  if(port == 1) {
+#ifdef __STM32F1__
+    return 0;
+#else
+    serials[0] = 0;
+    return 1;
+#endif
+  }
+#ifdef __STM32F1__
+  serials[0] = 1;
+  serials[1] = 3;
+  return 2;
+#else
+  serials[0] = 2;
+  return 1;
+#endif
+}
+
+/*
+  Requests a baudrate change for the given port. The change
+  takes place as soon as all pending output has been sent,
+  so the response to the request still goes out at the old rate.
+*/
+void requestBaudrate(int port, unsigned long baudrate) {
+  int serials[2];
+  int cnt = getSerials(port, serials);
+  for(int i=0; i < cnt; i++) {
+    pendingBaudrate[serials[i]] = baudrate;
+    pendingTime[serials[i]] = millis();
+  }
+}
+
+void serviceBaudrates() {
+  for(int i=0; i < NUM_SERIALS; i++) {
+    if(pendingBaudrate[i] == 0)
+      continue;
+    if(!txBuffer[i].isEmpty()) {
+      pendingTime[i] = millis();
+      continue;
+    }
+    // give the UART some time to send out the last characters
+    if(millis() - pendingTime[i] < BAUDRATE_SWITCH_DELAY)
+      continue;
+    // while the autobaud detection is running, its current rate is the one to use
+    setBaudrate(i, autobaud[i].rate != -1 ? autobaudRates[autobaud[i].rate] : pendingBaudrate[i]);
+    pendingBaudrate[i] = 0;
+  }
+}
+
+void startAutobaud(int port) {
+  int serials[2];
+  int cnt = getSerials(port, serials);
+  for(int i=0; i < cnt; i++) {
+    autobaud[serials[i]].rate = 0;
+    autobaud[serials[i]].valid = 0;
+    autobaud[serials[i]].first = 0;
+    pendingBaudrate[serials[i]] = autobaudRates[0];
+    pendingTime[serials[i]] = millis();
+  }
+}
+
+/*
+  Checks the input while the autobaud detection is active.
+  Garbage received means the rate is wrong, so the next one gets tried.
+  The rate gets locked as soon as a clean line has been received.
+  Returns true if the character has to be discarded.
+*/
+bool checkAutobaud(int serial, char in) {
+  if(serial < 0 || serial >= NUM_SERIALS || autobaud[serial].rate == -1)
+    return false;
+  AutobaudState* state = &autobaud[serial];
+  bool garbage = ((uint8_t)in >= 0x80) || (in < ' ' && in != '\n' && in != '\r' && in != '\t');
+  if(in == '\n') {
+    if(state->valid > 0 && isalpha(state->first)) {
+      unsigned long rate = autobaudRates[state->rate];
+      state->rate = -1;
+      if(serial == 0)
+        smuffConfig.serial1Baudrate = rate;
+      else
+        smuffConfig.serial2Baudrate = rate;
+      char tmp[50];
+      sprintf_P(tmp, P_AutobaudLocked, serial, rate);
+      printResponse(tmp, serial);
+      return false;
+    }
+    garbage = state->valid > 0;
+  }
+  if(garbage) {
+    state->rate = (state->rate + 1) % NUM_AUTOBAUD_RATES;
+    setBaudrate(serial, autobaudRates[state->rate]);
+    pendingBaudrate[serial] = 0;
+    resetSerialBuffer(serial);
+    state->valid = 0;
+    return true;
+  }
+  if(in == '\n' || in == '\r')
+    return true;
+  if(state->valid == 0)
+    state->first = in;
+  if(state->valid < 255)
+    state->valid++;
+  return false;
+}
@@ -30,12 +30,84 @@ extern ZStepper steppers[];
 char ptmp[80];
 volatile bool parserBusy = false;
 unsigned int currentLine = 0;
+long lastLineNumber[NUM_SERIALS];
+
+/*
+  Sends the error message along with the request to resend the
+  line following the last one accepted (Marlin style).
+*/
+void requestResend(const char* PROGMEM errMsg, int serial) {
+  sprintf_P(ptmp, errMsg, lastLineNumber[serial]);
+  printResponse(ptmp, serial);
+  sprintf_P(ptmp, P_Resend, lastLineNumber[serial]+1);
+  printResponse(ptmp, serial);
+  sendOkResponse(serial);
+}
+
+/*
+  Asks the printer (Prusa MMU2 emulation) to send the current
+  command again later on.
+*/
+static void requestPMMU2Resend(int serial) {
+  if(currentLine > 0)
+    sprintf_P(ptmp, PSTR("M998 %d\n"), currentLine);
+  else
+    sprintf_P(ptmp, PSTR("M998\n"), NULL);
+  printResponse(ptmp, serial);
+}
+
+/*
+  Validates line number and checksum of the line received.
+  Returns false if the line must not be processed; the response
+  has already been sent in this case.
+  The line number is taken as processed only by acceptLine(), so a line
+  rejected later on (i.e. because the parser is busy) can be re-sent.
+*/
+bool validateLine(long lineNumber, int checksum, uint8_t rxSum, bool isM110, int serial) {
+  if(serial < 0 || serial >= NUM_SERIALS)
+    return true;
+  if(lineNumber == -1) {
+    if(checksum != -1) {
+      requestResend(P_NoLineNumber, serial);
+      return false;
+    }
+    return true;
+  }
+  if(checksum == -1) {
+    requestResend(P_NoChecksum, serial);
+    return false;
+  }
+  if(checksum != rxSum) {
+    requestResend(P_ChecksumMismatch, serial);
+    return false;
+  }
+  if(!isM110 && lineNumber != lastLineNumber[serial]+1) {
+    // a line already processed is a duplicate the host has re-sent because it missed the 'ok';
+    // acknowledge it without executing it again
+    if(lineNumber <= lastLineNumber[serial] && lastLineNumber[serial]-lineNumber < LINE_HISTORY_LEN) {
+      sendOkResponse(serial);
+      return false;
+    }
+    requestResend(P_LineNumberError, serial);
+    return false;
+  }
+  return true;
+}
+
+/*
+  Marks the line validated as processed.
+*/
+static void acceptLine(long lineNumber, int serial) {
+  if(serial >= 0 && serial < NUM_SERIALS && lineNumber != -1)
+    lastLineNumber[serial] = lineNumber;
+}
 
 void parseGcode(const String& serialBuffer, int serial) {
 
   String line;
   line.reserve(80);
   line = String(serialBuffer);
+  uint8_t rxSum = (serial >= 0 && serial < NUM_SERIALS) ? rxChecksum[serial] : 0;
   resetSerialBuffer(serial);
 
   /*
@@ -52,7 +124,9 @@ void parseGcode(const String& serialBuffer, int serial) {
   //__debug(PSTR("Line: %s %d"), line.c_str(), line.length());
 
   int pos;
+  int checksum = -1;
   if((pos = line.lastIndexOf("*")) > -1) {
+    checksum = line.substring(pos+1).toInt();
     line = line.substring(0, pos);
   }
   if((pos = line.lastIndexOf(";")) > -1) {
@@ -62,13 +136,38 @@ void parseGcode(const String& serialBuffer, int serial) {
     line = line.substring(0, pos);
   }
   currentLine = 0;
+  long lineNumber = -1;
   if(line.startsWith("N")) {
-    char ln[15];
-    if((int)(currentLine = getParam(line, (char*)"N")) != -1) {
-      sprintf_P(ln, PSTR("%d"), currentLine);
-      line = line.substring(strlen(ln)+1);
-    }
+    unsigned int i = 1;
+    while(i < line.length() && isdigit(line.charAt(i)))
+      i++;
+    lineNumber = line.substring(1, i).toInt();
+    currentLine = lineNumber;
+    line = line.substring(i);
   }
+  if(!validateLine(lineNumber, checksum, rxSum, line.startsWith("M110") && !isdigit(line.charAt(4)), serial))
+    return;
+
+  // answers to host prompts have to get through while the parser is busy
+  if(line.startsWith("M876")) {
+    acceptLine(lineNumber, serial);
+    if(parse_M(line.substring(1), serial))
+      sendOkResponse(serial);  
+    else
+      sendErrorResponseP(serial);
+    return;
+  }
+#ifdef HEADLESS
+  // nothing else gets processed while a dialog waits for the host,
+  // the printer (Prusa MMU2 emulation) is asked to send its command again later
+  if(hostPromptPending) {
+    if(!smuffConfig.prusaMMU2)
+      sendErrorResponseP(serial, P_Busy);
+    else
+      requestPMMU2Resend(serial);
+    return;
+  }
+#endif
 
   if(parserBusy || !steppers[FEEDER].getMovementDone()) {
     if(!smuffConfig.prusaMMU2) {
@@ -94,17 +193,14 @@ void parseGcode(const String& serialBuffer, int serial) {
       if(!steppers[FEEDER].getMovementDone()) { 
         //__debug(PSTR("Wait after 'T' 500ms")); 
         delay(500);
-        if(currentLine > 0)
-          sprintf_P(ptmp, PSTR("M998 %d\n"), currentLine);
-        else
-          sprintf_P(ptmp, PSTR("M998\n"), NULL);
-        printResponseP(ptmp, serial);
+        requestPMMU2Resend(serial);
         //__debug(PSTR("Resend 'T' sent"));  
         return;
       }
     }
     if(line.startsWith("U") || line.startsWith("C")) {
       if(!steppers[FEEDER].getMovementDone()) {
+        acceptLine(lineNumber, serial);
         sendOkResponse(serial);  
         //__debug(PSTR("Cancelling U/C"));  
         return;
@@ -116,11 +212,13 @@ void parseGcode(const String& serialBuffer, int serial) {
         setAbortRequested(true);
         //__debug(PSTR("Abort set"));
       }
+      acceptLine(lineNumber, serial);
       sendOkResponse(serial);  
       return;
     }
   }
 
+  acceptLine(lineNumber, serial);
   parserBusy = true;
   
   if(line.startsWith("G")) {
@@ -317,7 +415,7 @@ bool parse_PMMU2(char cmd, const String& buf, int serial) {
       break;
 
     case 'P':     // FINDA status (Feeder endstop)
-        sprintf_P(tmp,PSTR("%dok\n"), feederEndstop() ? 1 : 0);
+        sprintf_P(tmp,PSTR("%dok\n"), cachedFeederEndstop ? 1 : 0);
         printResponse(tmp,serial);
         //__debug(PSTR("To Prusa (P%d): '%s'"), type, tmp);
       break;
@@ -506,19 +604,11 @@ void reportSettings(int serial) {
 }
 
 void printResponse(const char* response, int serial) {
-  switch(serial) {
-    case 0: Serial.print(response); break;
-    case 1: Serial1.print(response); break;
-    case 2: Serial2.print(response); break;
-    case 3: Serial3.print(response); break;
-  }
+  if(serial >= 0 && serial < NUM_SERIALS)
+    txBuffer[serial].send(response);
 }
 
 void printResponseP(const char* response, int serial) {
-  switch(serial) {
-    case 0: Serial.print((__FlashStringHelper*)response); break;
-    case 1: Serial1.print((__FlashStringHelper*)response); break;
-    case 2: Serial2.print((__FlashStringHelper*)response); break;
-    case 3: Serial3.print((__FlashStringHelper*)response); break;
-  }
+  if(serial >= 0 && serial < NUM_SERIALS)
+    txBuffer[serial].send(response, true);
 }